@@ -1,6 +1,6 @@
 #include "protocol.h"
 
-#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
@@ -10,7 +10,17 @@
 // Helper Functions
 // ============================================================================
 
+// Set by an event loop for the messages it creates during one iteration
+static _Thread_local uint64_t cached_timestamp;
+
+void protocol_cache_timestamp(uint64_t timestamp) {
+    cached_timestamp = timestamp;
+}
+
 uint64_t protocol_get_timestamp(void) {
+    if (cached_timestamp != 0) {
+        return cached_timestamp;
+    }
     struct timeval tv;
     gettimeofday(&tv, NULL);
     return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
@@ -25,6 +35,8 @@ const char* protocol_get_type_name(MessageType type) {
         case MSG_TYPE_COMMAND:  return "COMMAND";
         case MSG_TYPE_PING:     return "PING";
         case MSG_TYPE_PONG:     return "PONG";
+        case MSG_TYPE_PRESENCE: return "PRESENCE";
+        case MSG_TYPE_RECEIPT:  return "RECEIPT";
         default:                return "UNKNOWN";
     }
 }
@@ -33,71 +45,127 @@ const char* protocol_get_type_name(MessageType type) {
 // Message Creation Functions
 // ============================================================================
 
-static void write_header(uint8_t *buffer, uint8_t type, uint32_t content_len) {
+static void write_header(uint8_t *buffer, uint8_t version, uint8_t type, uint32_t content_len) {
     MessageHeader *header = (MessageHeader *)buffer;
-    header->version = PROTOCOL_VERSION;
+    header->version = version;
     header->type = type;
     header->reserved = 0;
     header->content_len = htonl(content_len);  // Convert to network byte order
     header->timestamp = htobe64(protocol_get_timestamp());  // Convert to big-endian
 }
 
-int protocol_create_chat_message(uint8_t *buffer, const char *username,
-                                  const char *room, const char *message) {
-    if (!buffer || !username || !room || !message) return -1;
-
-    // Validate lengths
-    if (strlen(username) >= MAX_USERNAME_LEN ||
-        strlen(room) >= MAX_ROOMNAME_LEN ||
-        strlen(message) >= MAX_CONTENT_LEN) {
-        return -1;
-    }
-
-    ChatMessage msg = {0};
-    strncpy(msg.username, username, MAX_USERNAME_LEN - 1);
-    strncpy(msg.room, room, MAX_ROOMNAME_LEN - 1);
-    strncpy(msg.message, message, MAX_CONTENT_LEN - 1);
+// v2 short string: 1 length byte followed by the bytes, no terminator
+static size_t put_short_string(uint8_t *out, const char *str, size_t len) {
+    out[0] = (uint8_t)len;
+    memcpy(out + 1, str, len);
+    return 1 + len;
+}
 
-    uint32_t content_len = sizeof(ChatMessage);
-    write_header(buffer, MSG_TYPE_CHAT, content_len);
-    memcpy(buffer + sizeof(MessageHeader), &msg, sizeof(ChatMessage));
+// Source of the v1 padding, referenced instead of zeroing it per frame
+static const uint8_t zero_padding[MAX_CONTENT_LEN];
 
-    return sizeof(MessageHeader) + content_len;
+// v1 fixed slot: the string followed by zeroes up to the slot size
+static size_t put_fixed_string(uint8_t *out, StringView str, size_t capacity) {
+    memcpy(out, str.data, str.len);
+    memset(out + str.len, 0, capacity - str.len);
+    return capacity;
 }
 
-int protocol_create_system_message(uint8_t *buffer, const char *message) {
+// Header and `fields_len` bytes already in builder->head, then the payload
+// referenced in place, then `padding` zero bytes
+static bool builder_finish(MessageBuilder *builder, uint8_t version, MessageType type,
+                           size_t fields_len, StringView payload, size_t padding) {
+    const size_t content_len = fields_len + payload.len + padding;
+    write_header(builder->head, version, type, (uint32_t)content_len);
+
+    int count = 0;
+    builder->iov[count++] = (struct iovec){ builder->head, sizeof(MessageHeader) + fields_len };
+    if (payload.len > 0) {
+        builder->iov[count++] = (struct iovec){ (void *)payload.data, payload.len };
+    }
+    if (padding > 0) {
+        builder->iov[count++] = (struct iovec){ (void *)zero_padding, padding };
+    }
+    builder->iov_count = count;
+    builder->len = sizeof(MessageHeader) + content_len;
+    return true;
+}
 
-    if (strlen(message) >= MAX_CONTENT_LEN) {
-        return -1;
-        }
+bool protocol_build_chat(MessageBuilder *builder, uint8_t version, StringView username,
+                         StringView room, StringView message) {
+    if (!builder || username.len >= MAX_USERNAME_LEN || room.len >= MAX_ROOMNAME_LEN ||
+        message.len >= MAX_CONTENT_LEN) {
+        return false;
+    }
 
-    SystemMessage msg = {0};
-    strncpy(msg.message, message, MAX_CONTENT_LEN - 1);
+    uint8_t *fields = builder->head + sizeof(MessageHeader);
+    size_t pos;
+    if (version == PROTOCOL_VERSION_1) {
+        pos = put_fixed_string(fields, username, MAX_USERNAME_LEN);
+        pos += put_fixed_string(fields + pos, room, MAX_ROOMNAME_LEN);
+        return builder_finish(builder, version, MSG_TYPE_CHAT, pos, message, MAX_CONTENT_LEN - message.len);
+    }
+    pos = put_short_string(fields, username.data, username.len);
+    pos += put_short_string(fields + pos, room.data, room.len);
+    return builder_finish(builder, version, MSG_TYPE_CHAT, pos, message, 0);
+}
 
-    uint32_t content_len = sizeof(SystemMessage);
-    write_header(buffer, MSG_TYPE_SYSTEM, content_len);
-    memcpy(buffer + sizeof(MessageHeader), &msg, sizeof(SystemMessage));
+bool protocol_build_text(MessageBuilder *builder, uint8_t version, MessageType type, StringView text) {
+    if (!builder || text.len >= MAX_CONTENT_LEN) {
+        return false;
+    }
+    // v1 pads the text to MAX_CONTENT_LEN, v2 carries only its bytes
+    const size_t padding = version == PROTOCOL_VERSION_1 ? MAX_CONTENT_LEN - text.len : 0;
+    return builder_finish(builder, version, type, 0, text, padding);
+}
 
-    return sizeof(MessageHeader) + content_len;
+void protocol_builder_set_timestamp(MessageBuilder *builder, uint64_t timestamp) {
+    ((MessageHeader *)builder->head)->timestamp = htobe64(timestamp);
 }
 
-int protocol_create_error_message(uint8_t *buffer, const char *error) {
+size_t protocol_builder_copy(const MessageBuilder *builder, uint8_t *out) {
+    size_t pos = 0;
+    for (int i = 0; i < builder->iov_count; i++) {
+        memcpy(out + pos, builder->iov[i].iov_base, builder->iov[i].iov_len);
+        pos += builder->iov[i].iov_len;
+    }
+    return pos;
+}
 
-    if (strlen(error) >= MAX_CONTENT_LEN) {
+// One copy of the built message into the caller's buffer
+static int create_built(uint8_t *buffer, const MessageBuilder *builder, bool built) {
+    if (!buffer || !built) {
         return -1;
     }
+    return (int)protocol_builder_copy(builder, buffer);
+}
+
+int protocol_create_chat_message(uint8_t *buffer, uint8_t version, const char *username,
+                                  const char *room, const char *message) {
+    if (!username || !room || !message) return -1;
 
-    ErrorMessage msg = {0};
-    strncpy(msg.error, error, MAX_CONTENT_LEN - 1);
+    MessageBuilder builder;
+    return create_built(buffer, &builder,
+                        protocol_build_chat(&builder, version, protocol_string_view(username),
+                                            protocol_string_view(room), protocol_string_view(message)));
+}
 
-    uint32_t content_len = sizeof(ErrorMessage);
-    write_header(buffer, MSG_TYPE_ERROR, content_len);
-    memcpy(buffer + sizeof(MessageHeader), &msg, sizeof(ErrorMessage));
+static int create_text_message(uint8_t *buffer, uint8_t version, MessageType type, const char *text) {
+    if (!text) return -1;
 
-    return sizeof(MessageHeader) + content_len;
+    MessageBuilder builder;
+    return create_built(buffer, &builder, protocol_build_text(&builder, version, type, protocol_string_view(text)));
+}
+
+int protocol_create_system_message(uint8_t *buffer, uint8_t version, const char *message) {
+    return create_text_message(buffer, version, MSG_TYPE_SYSTEM, message);
+}
+
+int protocol_create_error_message(uint8_t *buffer, uint8_t version, const char *error) {
+    return create_text_message(buffer, version, MSG_TYPE_ERROR, error);
 }
 
-int protocol_create_userlist_message(uint8_t *buffer, const char **usernames,uint16_t count) {
+int protocol_create_userlist_message(uint8_t *buffer, uint8_t version, const char **usernames, uint16_t count) {
     if (count >= MAX_USER_COUNT) {
         return -1;
     }
@@ -108,34 +176,155 @@ int protocol_create_userlist_message(uint8_t *buffer, const char **usernames,uin
         }
     }
 
-    UserListMessage msg = {0};
+    uint8_t *body = buffer + sizeof(MessageHeader);
+    const uint16_t net_count = htons(count);
+    memcpy(body, &net_count, sizeof(net_count));
+    size_t pos = sizeof(net_count);
     for (int i = 0; i < count; i++) {
-        strcpy(msg.usernames[i],usernames[i]);
+        const StringView name = protocol_string_view(usernames[i]);
+        if (version == PROTOCOL_VERSION_1) {
+            pos += put_fixed_string(body + pos, name, MAX_USERNAME_LEN);
+        } else {
+            pos += put_short_string(body + pos, name.data, name.len);
+        }
+    }
+    if (version == PROTOCOL_VERSION_1) {
+        // Unused slots are part of the fixed-size v1 body
+        memset(body + pos, 0, sizeof(UserListMessage) - pos);
+        pos = sizeof(UserListMessage);
+    }
+    const uint32_t content_len = (uint32_t)pos;
+    write_header(buffer, version, MSG_TYPE_USERLIST, content_len);
+
+    return sizeof(MessageHeader) + content_len;
+}
+
+int protocol_create_presence_message(uint8_t *buffer, uint8_t version, const PresenceEntry *entries, uint16_t count) {
+    if (!buffer || !entries || count > MAX_PRESENCE_ENTRIES) {
+        return -1;
+    }
+
+    uint8_t *body = buffer + sizeof(MessageHeader);
+    const uint16_t net_count = htons(count);
+    memcpy(body, &net_count, sizeof(net_count));
+    size_t pos = sizeof(net_count);
+    for (uint16_t i = 0; i < count; i++) {
+        const StringView name = { entries[i].username, strnlen(entries[i].username, MAX_USERNAME_LEN - 1) };
+        body[pos++] = entries[i].action;
+        if (version == PROTOCOL_VERSION_1) {
+            pos += put_fixed_string(body + pos, name, MAX_USERNAME_LEN);
+        } else {
+            pos += put_short_string(body + pos, name.data, name.len);
+        }
     }
-    msg.count = htons(count);
 
-    uint32_t content_len = sizeof(UserListMessage);
-    write_header(buffer, MSG_TYPE_USERLIST, content_len);
-    memcpy(buffer + sizeof(MessageHeader), &msg, sizeof(UserListMessage));
+    uint32_t content_len = (uint32_t)pos;
+    write_header(buffer, version, MSG_TYPE_PRESENCE, content_len);
 
     return sizeof(MessageHeader) + content_len;
 }
 
-int protocol_create_command_message(uint8_t *buffer, const char *command) {
-    if (strlen(command) >= MAX_CONTENT_LEN) {
+int protocol_create_command_message(uint8_t *buffer, uint8_t version, const char *command) {
+    return create_text_message(buffer, version, MSG_TYPE_COMMAND, command);
+}
+
+int protocol_create_receipt_message(uint8_t *buffer, uint8_t version, uint64_t sent_at,
+                                    uint64_t received_at, const char *room) {
+    if (!buffer || !room) return -1;
+
+    const StringView room_view = protocol_string_view(room);
+    if (room_view.len >= MAX_ROOMNAME_LEN) {
         return -1;
     }
 
-    CommandMessage msg = {0};
-    strncpy(msg.command, command, MAX_CONTENT_LEN - 1);
+    uint8_t *body = buffer + sizeof(MessageHeader);
+    const uint64_t net_sent_at = htobe64(sent_at);
+    const uint64_t net_received_at = htobe64(received_at);
+    memcpy(body, &net_sent_at, sizeof(net_sent_at));
+    memcpy(body + sizeof(net_sent_at), &net_received_at, sizeof(net_received_at));
+    size_t pos = sizeof(net_sent_at) + sizeof(net_received_at);
+    if (version == PROTOCOL_VERSION_1) {
+        pos += put_fixed_string(body + pos, room_view, MAX_ROOMNAME_LEN);
+    } else {
+        pos += put_short_string(body + pos, room_view.data, room_view.len);
+    }
 
-    uint32_t content_len = sizeof(CommandMessage);
-    write_header(buffer, MSG_TYPE_COMMAND, content_len);
-    memcpy(buffer + sizeof(MessageHeader), &msg, sizeof(CommandMessage));
+    const uint32_t content_len = (uint32_t)pos;
+    write_header(buffer, version, MSG_TYPE_RECEIPT, content_len);
 
     return sizeof(MessageHeader) + content_len;
 }
 
+int protocol_create_keepalive_message(uint8_t *buffer, uint8_t version, MessageType type) {
+    if (!buffer || (type != MSG_TYPE_PING && type != MSG_TYPE_PONG)) return -1;
+
+    write_header(buffer, version, type, 0);
+    return sizeof(MessageHeader);
+}
+
+int protocol_encode_message(uint8_t *buffer, uint8_t version, const ParsedMessage *msg) {
+    switch (msg->type) {
+        case MSG_TYPE_CHAT:
+            return protocol_create_chat_message(buffer, version, msg->chat.username, msg->chat.room, msg->chat.message);
+        case MSG_TYPE_SYSTEM:
+            return protocol_create_system_message(buffer, version, msg->system.message);
+        case MSG_TYPE_ERROR:
+            return protocol_create_error_message(buffer, version, msg->error.error);
+        case MSG_TYPE_COMMAND:
+            return protocol_create_command_message(buffer, version, msg->command.command);
+        case MSG_TYPE_USERLIST: {
+            const char *usernames[MAX_USER_COUNT];
+            for (int i = 0; i < msg->userlist.count; i++) {
+                usernames[i] = msg->userlist.usernames[i];
+            }
+            return protocol_create_userlist_message(buffer, version, usernames, msg->userlist.count);
+        }
+        case MSG_TYPE_PRESENCE:
+            return protocol_create_presence_message(buffer, version, msg->presence.entries, msg->presence.count);
+        case MSG_TYPE_RECEIPT:
+            return protocol_create_receipt_message(buffer, version, msg->receipt.sent_at,
+                                                   msg->receipt.received_at, msg->receipt.room);
+        default:
+            return -1;
+    }
+}
+
+int protocol_convert_message(const uint8_t *data, size_t len, uint8_t version, uint8_t *buffer) {
+    MessageHeader header;
+    if (!protocol_parse_header(data, len, &header) || len < sizeof(MessageHeader) + header.content_len) {
+        return -1;
+    }
+    const size_t total_len = sizeof(MessageHeader) + header.content_len;
+    if (header.version == version) {
+        memcpy(buffer, data, total_len);
+        return (int)total_len;
+    }
+
+    ParsedMessage msg;
+    msg.type = (MessageType)header.type;
+    bool parsed;
+    switch (header.type) {
+        case MSG_TYPE_CHAT:     parsed = protocol_parse_chat_message(data, total_len, &msg.chat); break;
+        case MSG_TYPE_SYSTEM:   parsed = protocol_parse_system_message(data, total_len, &msg.system); break;
+        case MSG_TYPE_ERROR:    parsed = protocol_parse_error_message(data, total_len, &msg.error); break;
+        case MSG_TYPE_COMMAND:  parsed = protocol_parse_command_message(data, total_len, &msg.command); break;
+        case MSG_TYPE_USERLIST: parsed = protocol_parse_userlist_message(data, total_len, &msg.userlist); break;
+        case MSG_TYPE_PRESENCE: parsed = protocol_parse_presence_message(data, total_len, &msg.presence); break;
+        case MSG_TYPE_RECEIPT:  parsed = protocol_parse_receipt_message(data, total_len, &msg.receipt); break;
+        default:                parsed = false; break;
+    }
+    if (!parsed) {
+        return -1;
+    }
+
+    const int converted = protocol_encode_message(buffer, version, &msg);
+    if (converted > 0) {
+        // Keep the original send time
+        ((MessageHeader *)buffer)->timestamp = htobe64(header.timestamp);
+    }
+    return converted;
+}
+
 // ============================================================================
 // Message Parsing Functions
 // ============================================================================
@@ -152,65 +341,215 @@ bool protocol_parse_header(const uint8_t *data, size_t len, MessageHeader *heade
     header->content_len = ntohl(header->content_len);
     header->timestamp = be64toh(header->timestamp);
 
-    if (header->version != PROTOCOL_VERSION) {
+    if (!protocol_version_compatible(header->version)) {
         return false;
     }
 
     return true;
 }
 
-bool protocol_get_parsed_message(const uint8_t *data, size_t len, ParsedMessage *msg_out, MessageHeader *header) {
-    bool success = false;
-    switch (header->type) {
-        case MSG_TYPE_CHAT:
-            printf("DEBUG RECV: Parsing CHAT message\n");
-            success = protocol_parse_chat_message(data, len, &msg_out->chat);
-            if (success) {
-                printf("DEBUG RECV: CHAT parsed - user='%s', room='%s', msg='%s'\n",
-                       msg_out->chat.username, msg_out->chat.room, msg_out->chat.message);
+// ============================================================================
+// Message View Functions
+// ============================================================================
+
+// v1 string field: must be terminated within its fixed slot
+static bool view_fixed_string(const uint8_t *field, size_t capacity, StringView *out) {
+    const uint8_t *nul = memchr(field, '\0', capacity);
+    if (nul == NULL) {
+        return false;
+    }
+    out->data = (const char *)field;
+    out->len = (size_t)(nul - field);
+    return true;
+}
+
+// v2 bytes used as a string: shorter than the v1 slot and free of NULs, so
+// a copy of it always terminates where the view ends
+static bool view_bytes(const uint8_t *data, size_t len, size_t capacity, StringView *out) {
+    if (len >= capacity || memchr(data, '\0', len) != NULL) {
+        return false;
+    }
+    out->data = (const char *)data;
+    out->len = len;
+    return true;
+}
+
+// v2 short string: 1 length byte followed by the bytes
+static bool view_short_string(const uint8_t **pos, const uint8_t *end, size_t capacity, StringView *out) {
+    if (*pos >= end || (size_t)(end - *pos) < 1 + (size_t)**pos) {
+        return false;
+    }
+    const size_t len = **pos;
+    if (!view_bytes(*pos + 1, len, capacity, out)) {
+        return false;
+    }
+    *pos += 1 + len;
+    return true;
+}
+
+// Reads one entry of a USERLIST or PRESENCE list; action is NULL for user lists
+static bool list_entry(const ListView *list, const uint8_t **pos, uint8_t *action, StringView *name) {
+    if (list->version == PROTOCOL_VERSION_1) {
+        const size_t slot = action != NULL ? sizeof(PresenceEntry) : MAX_USERNAME_LEN;
+        if ((size_t)(list->end - *pos) < slot) {
+            return false;
+        }
+        if (action != NULL) {
+            *action = (*pos)[0];
+        }
+        if (!view_fixed_string(*pos + (action != NULL ? 1 : 0), MAX_USERNAME_LEN, name)) {
+            return false;
+        }
+        *pos += slot;
+    } else {
+        if (action != NULL) {
+            if (*pos >= list->end) {
+                return false;
             }
-            break;
+            *action = *(*pos)++;
+        }
+        if (!view_short_string(pos, list->end, MAX_USERNAME_LEN, name)) {
+            return false;
+        }
+    }
+    return action == NULL || *action == PRESENCE_JOIN || *action == PRESENCE_LEAVE;
+}
 
-        case MSG_TYPE_SYSTEM:
-            printf("DEBUG RECV: Parsing SYSTEM message\n");
-            success = protocol_parse_system_message(data, len, &msg_out->system);
-            if (success) {
-                printf("DEBUG RECV: SYSTEM parsed - msg='%s'\n", msg_out->system.message);
+// Checks every entry up front so iterating the list cannot fail
+static bool view_list(uint8_t version, bool presence, const uint8_t *body, size_t body_len, ListView *list) {
+    uint16_t count;
+    if (body_len < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, body, sizeof(count));
+    list->count = ntohs(count);
+    list->index = 0;
+    list->version = version;
+    list->pos = body + sizeof(count);
+    list->end = body + body_len;
+    if (list->count > (presence ? MAX_PRESENCE_ENTRIES : MAX_USER_COUNT - 1)) {
+        return false;
+    }
+
+    const uint8_t *pos = list->pos;
+    uint8_t action;
+    StringView name;
+    for (uint16_t i = 0; i < list->count; i++) {
+        if (!list_entry(list, &pos, presence ? &action : NULL, &name)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool protocol_view_message(const uint8_t *data, size_t len, MessageView *view) {
+    if (!data || !view) return false;
+
+    if (!protocol_parse_header(data, len, &view->header) ||
+        len - sizeof(MessageHeader) < view->header.content_len) {
+        return false;
+    }
+    const uint8_t version = view->header.version;
+    const uint8_t *body = data + sizeof(MessageHeader);
+    const size_t body_len = view->header.content_len;
+
+    switch (view->header.type) {
+        case MSG_TYPE_CHAT:
+            if (version == PROTOCOL_VERSION_1) {
+                return body_len >= sizeof(ChatMessage) &&
+                       view_fixed_string(body + offsetof(ChatMessage, username), MAX_USERNAME_LEN, &view->chat.username) &&
+                       view_fixed_string(body + offsetof(ChatMessage, room), MAX_ROOMNAME_LEN, &view->chat.room) &&
+                       view_fixed_string(body + offsetof(ChatMessage, message), MAX_CONTENT_LEN, &view->chat.message);
+            } else {
+                const uint8_t *pos = body;
+                const uint8_t *end = body + body_len;
+                return view_short_string(&pos, end, MAX_USERNAME_LEN, &view->chat.username) &&
+                       view_short_string(&pos, end, MAX_ROOMNAME_LEN, &view->chat.room) &&
+                       view_bytes(pos, (size_t)(end - pos), MAX_CONTENT_LEN, &view->chat.message);
             }
-            break;
 
+        case MSG_TYPE_SYSTEM:
         case MSG_TYPE_ERROR:
-            printf("DEBUG RECV: Parsing ERROR message\n");
-            success = protocol_parse_error_message(data, len, &msg_out->error);
-            if (success) {
-                printf("DEBUG RECV: ERROR parsed - msg='%s'\n", msg_out->error.error);
+        case MSG_TYPE_COMMAND:
+            if (version == PROTOCOL_VERSION_1) {
+                return body_len >= MAX_CONTENT_LEN && view_fixed_string(body, MAX_CONTENT_LEN, &view->text);
             }
-            break;
+            return view_bytes(body, body_len, MAX_CONTENT_LEN, &view->text);
 
         case MSG_TYPE_USERLIST:
-            printf("DEBUG RECV: Parsing USERLIST message\n");
-            success = protocol_parse_userlist_message(data, len, &msg_out->userlist);
-            if (success) {
-                printf("DEBUG RECV: USERLIST parsed - count=%d\n", msg_out->userlist.count);
+            if (version == PROTOCOL_VERSION_1 && body_len < sizeof(UserListMessage)) {
+                return false;
             }
-            break;
+            return view_list(version, false, body, body_len, &view->list);
+
+        case MSG_TYPE_PRESENCE:
+            return view_list(version, true, body, body_len, &view->list);
+
+        case MSG_TYPE_RECEIPT: {
+            uint64_t times[2];
+            if (body_len < sizeof(times)) {
+                return false;
+            }
+            memcpy(times, body, sizeof(times));
+            view->receipt.sent_at = be64toh(times[0]);
+            view->receipt.received_at = be64toh(times[1]);
+            const uint8_t *pos = body + sizeof(times);
+            if (version == PROTOCOL_VERSION_1) {
+                return body_len >= sizeof(times) + MAX_ROOMNAME_LEN &&
+                       view_fixed_string(pos, MAX_ROOMNAME_LEN, &view->receipt.room);
+            }
+            return view_short_string(&pos, body + body_len, MAX_ROOMNAME_LEN, &view->receipt.room);
+        }
+
+        case MSG_TYPE_PING:
+        case MSG_TYPE_PONG:
+            return true;
 
         default:
-            printf("WARNING: Unknown message type 0x%02x\n", header->type);
-            success = false;
-            break;
+            return false;
+    }
+}
+
+bool protocol_list_next_user(ListView *list, StringView *name) {
+    if (list->index >= list->count) {
+        return false;
     }
-    return success;
+    list->index++;
+    return list_entry(list, &list->pos, NULL, name);
+}
+
+bool protocol_list_next_presence(ListView *list, uint8_t *action, StringView *name) {
+    if (list->index >= list->count) {
+        return false;
+    }
+    list->index++;
+    return list_entry(list, &list->pos, action, name);
+}
+
+// ============================================================================
+// Copying Parsers (built on the views)
+// ============================================================================
+
+static void copy_view(char *out, size_t capacity, StringView view) {
+    const size_t len = view.len < capacity ? view.len : capacity - 1;
+    memcpy(out, view.data, len);
+    out[len] = '\0';
+}
+
+static bool view_of_type(const uint8_t *data, size_t len, MessageType type, MessageView *view) {
+    return protocol_view_message(data, len, view) && view->header.type == type;
 }
 
 bool protocol_parse_chat_message(const uint8_t *data, size_t len, ChatMessage *msg) {
     if (!data || !msg) return false;
 
-    if (len < sizeof(MessageHeader) + sizeof(ChatMessage)) {
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_CHAT, &view)) {
         return false;
     }
-
-    memcpy(msg, data + sizeof(MessageHeader), sizeof(ChatMessage));
+    copy_view(msg->username, MAX_USERNAME_LEN, view.chat.username);
+    copy_view(msg->room, MAX_ROOMNAME_LEN, view.chat.room);
+    copy_view(msg->message, MAX_CONTENT_LEN, view.chat.message);
 
     return true;
 }
@@ -218,11 +557,11 @@ bool protocol_parse_chat_message(const uint8_t *data, size_t len, ChatMessage *m
 bool protocol_parse_system_message(const uint8_t *data, size_t len, SystemMessage *msg) {
     if (!data || !msg) return false;
 
-    if (len < sizeof(MessageHeader) + sizeof(SystemMessage)) {
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_SYSTEM, &view)) {
         return false;
     }
-
-    memcpy(msg, data + sizeof(MessageHeader), sizeof(SystemMessage));
+    copy_view(msg->message, MAX_CONTENT_LEN, view.text);
 
     return true;
 }
@@ -230,11 +569,11 @@ bool protocol_parse_system_message(const uint8_t *data, size_t len, SystemMessag
 bool protocol_parse_error_message(const uint8_t *data, size_t len, ErrorMessage *msg) {
     if (!data || !msg) return false;
 
-    if (len < sizeof(MessageHeader) + sizeof(ErrorMessage)) {
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_ERROR, &view)) {
         return false;
     }
-
-    memcpy(msg, data + sizeof(MessageHeader), sizeof(ErrorMessage));
+    copy_view(msg->error, MAX_CONTENT_LEN, view.text);
 
     return true;
 }
@@ -242,12 +581,31 @@ bool protocol_parse_error_message(const uint8_t *data, size_t len, ErrorMessage
 bool protocol_parse_userlist_message(const uint8_t *data, size_t len, UserListMessage *msg) {
     if (!data || !msg) return false;
 
-    if (len < sizeof(MessageHeader) + sizeof(UserListMessage)) {
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_USERLIST, &view)) {
         return false;
     }
+    msg->count = view.list.count;
+    StringView name;
+    for (uint16_t i = 0; protocol_list_next_user(&view.list, &name); i++) {
+        copy_view(msg->usernames[i], MAX_USERNAME_LEN, name);
+    }
+
+    return true;
+}
+
+bool protocol_parse_presence_message(const uint8_t *data, size_t len, PresenceMessage *msg) {
+    if (!data || !msg) return false;
 
-    memcpy(msg, data + sizeof(MessageHeader), sizeof(UserListMessage));
-    msg->count = ntohs(msg->count);
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_PRESENCE, &view)) {
+        return false;
+    }
+    msg->count = view.list.count;
+    StringView name;
+    for (uint16_t i = 0; protocol_list_next_presence(&view.list, &msg->entries[i].action, &name); i++) {
+        copy_view(msg->entries[i].username, MAX_USERNAME_LEN, name);
+    }
 
     return true;
 }
@@ -255,11 +613,25 @@ bool protocol_parse_userlist_message(const uint8_t *data, size_t len, UserListMe
 bool protocol_parse_command_message(const uint8_t *data, size_t len, CommandMessage *msg) {
     if (!data || !msg) return false;
 
-    if (len < sizeof(MessageHeader) + sizeof(CommandMessage)) {
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_COMMAND, &view)) {
         return false;
     }
+    copy_view(msg->command, MAX_CONTENT_LEN, view.text);
+
+    return true;
+}
+
+bool protocol_parse_receipt_message(const uint8_t *data, size_t len, ReceiptMessage *msg) {
+    if (!data || !msg) return false;
 
-    memcpy(msg, data + sizeof(MessageHeader), sizeof(CommandMessage));
+    MessageView view;
+    if (!view_of_type(data, len, MSG_TYPE_RECEIPT, &view)) {
+        return false;
+    }
+    msg->sent_at = view.receipt.sent_at;
+    msg->received_at = view.receipt.received_at;
+    copy_view(msg->room, MAX_ROOMNAME_LEN, view.receipt.room);
 
     return true;
 }
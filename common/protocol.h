@@ -4,9 +4,11 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
 
 /**
- * Chat Protocol Specification v1.0
+ * Chat Protocol Specification v2.0
  *
  * HTTP-inspired protocol with length-prefixed messages to avoid delimiter conflicts.
  * All multi-byte integers are in network byte order (big-endian).
@@ -16,10 +18,23 @@
  * - Length-prefixed to avoid delimiter conflicts in content
  * - Structured headers separate from body
  * - Binary-safe (can send any content including newlines, colons, etc.)
+ *
+ * Versions:
+ * - v1 bodies are the fixed-size structures below, strings NUL-padded to
+ *   their maximum length.
+ * - v2 bodies carry only the bytes in use. Each structure documents its v2
+ *   layout; a "short string" is a 1-byte length followed by that many bytes,
+ *   without a terminator.
+ *
+ * Every message states its version in the header. The server answers each
+ * connection in the version of the last message it received from it (v1
+ * until the first one arrives), so clients must accept both.
  */
 
-// Protocol version
-#define PROTOCOL_VERSION 1
+// Protocol versions
+#define PROTOCOL_VERSION_1 1
+#define PROTOCOL_VERSION_2 2
+#define PROTOCOL_VERSION   PROTOCOL_VERSION_2  // Newest version, sent by this build
 
 // Message types (1 byte)
 typedef enum {
@@ -29,15 +44,25 @@ typedef enum {
     MSG_TYPE_USERLIST = 0x04,  // Online users list
     MSG_TYPE_COMMAND  = 0x05,  // Client command
     MSG_TYPE_PING     = 0x06,  // Keep-alive ping
-    MSG_TYPE_PONG     = 0x07   // Keep-alive response
+    MSG_TYPE_PONG     = 0x07,  // Keep-alive response
+    MSG_TYPE_PRESENCE = 0x08,  // Users who joined or left (delta against the last USERLIST)
+    MSG_TYPE_RECEIPT  = 0x09   // Client's report of when a chat message reached it
 } MessageType;
 
+// Presence actions (1 byte)
+typedef enum {
+    PRESENCE_JOIN  = 0x01,
+    PRESENCE_LEAVE = 0x02
+} PresenceAction;
+
 // Maximum field lengths
 #define MAX_USERNAME_LEN  32
 #define MAX_ROOMNAME_LEN  64
 #define MAX_USER_COUNT    50
+#define MAX_PRESENCE_ENTRIES 64  // Joins and leaves carried by one PRESENCE message
 #define MAX_CONTENT_LEN   2048
 #define MAX_MESSAGE_SIZE  (sizeof(MessageHeader) + sizeof(ChatMessage))
+#define RECV_BUFFER_SIZE  4096  // Per-connection receive ring (power of two >= MAX_MESSAGE_SIZE)
 
 /**
  * Message Header Structure (fixed size: 16 bytes)
@@ -51,7 +76,7 @@ typedef enum {
  * Followed by variable-length content
  */
 typedef struct __attribute__((packed)) {
-    uint8_t  version;       // Protocol version (always 1 for now)
+    uint8_t  version;       // Protocol version the body is encoded with
     uint8_t  type;          // Message type (MessageType enum)
     uint16_t reserved;      // Reserved for future use (set to 0)
     uint32_t content_len;   // Length of content following header
@@ -65,10 +90,15 @@ typedef struct __attribute__((packed)) {
  *   - type: MSG_TYPE_CHAT
  *   - content_len: length of entire ChatMessageBody
  *
- * Body format (variable length):
+ * Body format (v1, fixed length):
  *   - username: null-terminated string (max MAX_USERNAME_LEN)
  *   - room: null-terminated string (max MAX_ROOMNAME_LEN)
  *   - message: null-terminated string (max MAX_CONTENT_LEN)
+ *
+ * Body format (v2):
+ *   - username: short string
+ *   - room: short string
+ *   - message: the rest of the body
  */
 typedef struct {
     char username[MAX_USERNAME_LEN];
@@ -81,7 +111,7 @@ typedef struct {
  *
  * Header fields:
  *   - type: MSG_TYPE_SYSTEM
- *   - content_len: length of message string + 1 (null terminator)
+ *   - content_len: v1: MAX_CONTENT_LEN (NUL-padded), v2: length of the message
  */
 typedef struct {
     char message[MAX_CONTENT_LEN];
@@ -92,7 +122,7 @@ typedef struct {
  *
  * Header fields:
  *   - type: MSG_TYPE_ERROR
- *   - content_len: length of error string + 1 (null terminator)
+ *   - content_len: v1: MAX_CONTENT_LEN (NUL-padded), v2: length of the error
  */
 typedef struct {
     char error[MAX_CONTENT_LEN];
@@ -107,19 +137,52 @@ typedef struct {
  *
  * Body format:
  *   - count: 2 bytes (number of users)
- *   - usernames: array of null-terminated strings
+ *   - usernames: v1: MAX_USER_COUNT null-terminated slots of MAX_USERNAME_LEN,
+ *                v2: count short strings
  */
 typedef struct {
     uint16_t count;
     char usernames[MAX_USER_COUNT][MAX_USERNAME_LEN];  // Max 50 users
 } UserListMessage;
 
+/**
+ * Presence Entry: one user who joined or left
+ */
+typedef struct {
+    uint8_t action;                  // PresenceAction
+    char username[MAX_USERNAME_LEN];
+} PresenceEntry;
+
+/**
+ * Presence Message Structure
+ *
+ * Header fields:
+ *   - type: MSG_TYPE_PRESENCE
+ *   - content_len: v1: 2 + count * sizeof(PresenceEntry), v2: size of the entries
+ *
+ * A client receives one full USERLIST when it registers and then PRESENCE
+ * frames listing the users that joined or left since. The server gathers
+ * changes over a short window, so one frame may carry several entries and a
+ * user who joined and left within the window is not mentioned at all. Deltas
+ * must be applied idempotently: a JOIN for a listed user or a LEAVE for an
+ * unlisted one is ignored.
+ *
+ * Body format (variable length):
+ *   - count: 2 bytes (number of entries, at most MAX_PRESENCE_ENTRIES)
+ *   - entries: count x (action: 1 byte, username: v1: MAX_USERNAME_LEN bytes,
+ *              v2: short string)
+ */
+typedef struct {
+    uint16_t count;
+    PresenceEntry entries[MAX_PRESENCE_ENTRIES];
+} PresenceMessage;
+
 /**
  * Command Message Structure
  *
  * Header fields:
  *   - type: MSG_TYPE_COMMAND
- *   - content_len: length of command string + 1
+ *   - content_len: v1: MAX_CONTENT_LEN (NUL-padded), v2: length of the command
  *
  * Commands start with '/' and include arguments
  */
@@ -128,6 +191,28 @@ typedef struct {
 } CommandMessage;
 
 
+/**
+ * Delivery Receipt Structure
+ *
+ * Sent by a client for each chat message it receives, so the server can
+ * measure sender-to-recipient latency.
+ *
+ * Header fields:
+ *   - type: MSG_TYPE_RECEIPT
+ *   - content_len: size of the receipt body
+ *
+ * Body format:
+ *   - sent_at: 8 bytes, header timestamp of the chat message
+ *   - received_at: 8 bytes, client time it arrived (milliseconds)
+ *   - room: room field of the chat message, v1: MAX_ROOMNAME_LEN bytes
+ *           (NUL-padded), v2: short string
+ */
+typedef struct {
+    uint64_t sent_at;
+    uint64_t received_at;
+    char room[MAX_ROOMNAME_LEN];
+} ReceiptMessage;
+
 /**
  * General Parsed Message Structure
  */
@@ -138,63 +223,228 @@ typedef struct {
         SystemMessage system;
         ErrorMessage error;
         UserListMessage userlist;
+        PresenceMessage presence;
+        CommandMessage command;
+        ReceiptMessage receipt;
     };
 } ParsedMessage;
 
+/**
+ * Pointer and length of a string, not null-terminated.
+ * Views into a received frame are valid only as long as the frame.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+} StringView;
+
+#define MESSAGE_BUILDER_IOV 3  // Header and fields, body, padding
+
+/**
+ * Gather list of an encoded message.
+ *
+ * The header and the short fields are written into head; the message or
+ * text body is referenced where the caller keeps it, and v1 padding points
+ * at shared zeroes. Valid as long as the referenced body is.
+ */
+typedef struct {
+    uint8_t head[sizeof(MessageHeader) + MAX_USERNAME_LEN + MAX_ROOMNAME_LEN];
+    struct iovec iov[MESSAGE_BUILDER_IOV];
+    int iov_count;
+    size_t len;             // Total encoded length
+} MessageBuilder;
+
+/**
+ * Position within the entries of a USERLIST or PRESENCE frame
+ */
+typedef struct {
+    uint16_t count;         // Number of entries in the frame
+    uint16_t index;         // Entries already returned
+    uint8_t version;
+    const uint8_t *pos;
+    const uint8_t *end;
+} ListView;
+
+/**
+ * Validated message whose fields point into the frame instead of copies.
+ *
+ * Every string is checked to fit its fixed-size counterpart (so copying
+ * it into ChatMessage & co. with a terminator never truncates) and to
+ * contain no NUL.
+ */
+typedef struct {
+    MessageHeader header;   // Host byte order, like protocol_parse_header
+    union {
+        struct {
+            StringView username;
+            StringView room;
+            StringView message;
+        } chat;
+        StringView text;    // System, error and command messages
+        ListView list;      // User list and presence messages
+        struct {
+            uint64_t sent_at;
+            uint64_t received_at;
+            StringView room;
+        } receipt;
+    };
+} MessageView;
+
 // ============================================================================
 // Protocol Helper Functions
 // ============================================================================
 
 /**
  * Get current timestamp in milliseconds
- * @return Unix timestamp in milliseconds
+ * @return Unix timestamp in milliseconds, or the value cached by
+ *         protocol_cache_timestamp on this thread
  */
 uint64_t protocol_get_timestamp(void);
 
+/**
+ * Stamp messages created on the calling thread with a fixed time, so an event
+ * loop reads the clock once per iteration instead of once per message
+ * @param timestamp Unix timestamp in milliseconds, 0 to read the clock again
+ */
+void protocol_cache_timestamp(uint64_t timestamp);
+
 /**
  * Create and serialize a chat message
  * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
  * @param username Sender username
  * @param room Room name
  * @param message Message content
  * @return Total bytes written, or -1 on error
  */
-int protocol_create_chat_message(uint8_t *buffer, const char *username,
+int protocol_create_chat_message(uint8_t *buffer, uint8_t version, const char *username,
                                   const char *room, const char *message);
 
 /**
  * Create and serialize a system message
  * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
  * @param message System message content
  * @return Total bytes written, or -1 on error
  */
-int protocol_create_system_message(uint8_t *buffer, const char *message);
+int protocol_create_system_message(uint8_t *buffer, uint8_t version, const char *message);
 
 /**
  * Create and serialize an error message
  * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
  * @param error Error description
  * @return Total bytes written, or -1 on error
  */
-int protocol_create_error_message(uint8_t *buffer, const char *error);
+int protocol_create_error_message(uint8_t *buffer, uint8_t version, const char *error);
 
 /**
  * Create and serialize a user list message
  * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
  * @param usernames Array of username strings
  * @param count Number of usernames
  * @return Total bytes written, or -1 on error
  */
-int protocol_create_userlist_message(uint8_t *buffer, const char **usernames,
+int protocol_create_userlist_message(uint8_t *buffer, uint8_t version, const char **usernames,
                                       uint16_t count);
 
+/**
+ * Create and serialize a presence delta
+ * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
+ * @param entries Users who joined or left
+ * @param count Number of entries (at most MAX_PRESENCE_ENTRIES)
+ * @return Total bytes written, or -1 on error
+ */
+int protocol_create_presence_message(uint8_t *buffer, uint8_t version, const PresenceEntry *entries, uint16_t count);
+
 /**
  * Create and serialize a command message
  * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
  * @param command Command string (should start with '/')
  * @return Total bytes written, or -1 on error
  */
-int protocol_create_command_message(uint8_t *buffer, const char *command);
+int protocol_create_command_message(uint8_t *buffer, uint8_t version, const char *command);
+
+/**
+ * Create and serialize a delivery receipt
+ * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
+ * @param sent_at Header timestamp of the chat message received
+ * @param received_at When it was received (milliseconds)
+ * @param room Room field of the chat message
+ * @return Total bytes written, or -1 on error
+ */
+int protocol_create_receipt_message(uint8_t *buffer, uint8_t version, uint64_t sent_at,
+                                    uint64_t received_at, const char *room);
+
+/**
+ * Create a keep-alive ping or its response; both have an empty body
+ * @param buffer Output buffer (at least sizeof(MessageHeader) bytes)
+ * @param version Protocol version to encode with
+ * @param type MSG_TYPE_PING or MSG_TYPE_PONG
+ * @return Total bytes written, or -1 on error
+ */
+int protocol_create_keepalive_message(uint8_t *buffer, uint8_t version, MessageType type);
+
+/**
+ * Serialize a parsed message (msg->type selects the member)
+ * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @param version Protocol version to encode with
+ * @param msg Message to encode
+ * @return Total bytes written, or -1 on error
+ */
+int protocol_encode_message(uint8_t *buffer, uint8_t version, const ParsedMessage *msg);
+
+/**
+ * Re-encode a complete message in another protocol version, keeping its timestamp
+ * @param data Raw data buffer (including header)
+ * @param len Length of data
+ * @param version Protocol version to encode with
+ * @param buffer Output buffer (must be at least MAX_MESSAGE_SIZE bytes)
+ * @return Total bytes written, or -1 if the message could not be parsed or encoded
+ */
+int protocol_convert_message(const uint8_t *data, size_t len, uint8_t version, uint8_t *buffer);
+
+/**
+ * Lay out a chat message without copying its text
+ * @param builder Output gather list
+ * @param version Protocol version to encode with
+ * @param username Sender username
+ * @param room Room name
+ * @param message Message content, referenced by the builder
+ * @return true on success, false if a field is too long
+ */
+bool protocol_build_chat(MessageBuilder *builder, uint8_t version, StringView username,
+                         StringView room, StringView message);
+
+/**
+ * Lay out a system, error or command message without copying its text
+ * @param builder Output gather list
+ * @param version Protocol version to encode with
+ * @param type MSG_TYPE_SYSTEM, MSG_TYPE_ERROR or MSG_TYPE_COMMAND
+ * @param text Message text, referenced by the builder
+ * @return true on success, false if the text is too long
+ */
+bool protocol_build_text(MessageBuilder *builder, uint8_t version, MessageType type, StringView text);
+
+/**
+ * Replace the timestamp of a built message, e.g. to keep the time the
+ * message it was derived from was sent
+ * @param builder Built message
+ * @param timestamp Unix timestamp in milliseconds
+ */
+void protocol_builder_set_timestamp(MessageBuilder *builder, uint64_t timestamp);
+
+/**
+ * Gather a built message into one buffer
+ * @param builder Built message
+ * @param out Output buffer (at least builder->len bytes)
+ * @return Bytes written (builder->len)
+ */
+size_t protocol_builder_copy(const MessageBuilder *builder, uint8_t *out);
 
 /**
  * Parse message header from received data
@@ -205,16 +455,6 @@ int protocol_create_command_message(uint8_t *buffer, const char *command);
  */
 bool protocol_parse_header(const uint8_t *data, size_t len, MessageHeader *header);
 
-/**
- * Parse a complete message into a ParsedMessage structure
- * @param data Raw data buffer (including header)
- * @param len Length of data
- * @param msg_out Output parsed message structure
- * @param header Output message header structure
- * @return true if successfully parsed, false otherwise
- */
-bool protocol_get_parsed_message(const uint8_t *data, size_t len, ParsedMessage *msg_out, MessageHeader *header);
-
 /**
  * Parse a complete chat message
  * @param data Raw data buffer (including header)
@@ -251,6 +491,15 @@ bool protocol_parse_error_message(const uint8_t *data, size_t len, ErrorMessage
  */
 bool protocol_parse_userlist_message(const uint8_t *data, size_t len, UserListMessage *msg);
 
+/**
+ * Parse a presence delta
+ * @param data Raw data buffer (including header)
+ * @param len Length of data
+ * @param msg Output presence structure
+ * @return true if successfully parsed, false otherwise
+ */
+bool protocol_parse_presence_message(const uint8_t *data, size_t len, PresenceMessage *msg);
+
 /**
  * Parse a command message
  * @param data Raw data buffer (including header)
@@ -260,6 +509,50 @@ bool protocol_parse_userlist_message(const uint8_t *data, size_t len, UserListMe
  */
 bool protocol_parse_command_message(const uint8_t *data, size_t len, CommandMessage *msg);
 
+/**
+ * Parse a delivery receipt
+ * @param data Raw data buffer (including header)
+ * @param len Length of data
+ * @param msg Output receipt structure
+ * @return true if successfully parsed, false otherwise
+ */
+bool protocol_parse_receipt_message(const uint8_t *data, size_t len, ReceiptMessage *msg);
+
+/**
+ * Validate a complete message in place and point into it instead of copying
+ * @param data Raw data buffer (including header)
+ * @param len Length of data
+ * @param view Output view; its pointers are only valid as long as data is
+ * @return true if the message is well formed, false otherwise
+ */
+bool protocol_view_message(const uint8_t *data, size_t len, MessageView *view);
+
+/**
+ * Next username of a user list view
+ * @param list view->list of a MSG_TYPE_USERLIST view
+ * @param name Output username
+ * @return true if an entry was returned, false after the last one
+ */
+bool protocol_list_next_user(ListView *list, StringView *name);
+
+/**
+ * Next entry of a presence view
+ * @param list view->list of a MSG_TYPE_PRESENCE view
+ * @param action Output PresenceAction
+ * @param name Output username
+ * @return true if an entry was returned, false after the last one
+ */
+bool protocol_list_next_presence(ListView *list, uint8_t *action, StringView *name);
+
+/**
+ * View of a null-terminated string
+ * @param str The string
+ * @return View of str without its terminator
+ */
+static inline StringView protocol_string_view(const char *str) {
+    return (StringView){ str, strlen(str) };
+}
+
 /**
  * Check if a string is a command (starts with '/')
  * @param message The message to check
@@ -275,7 +568,7 @@ static inline bool protocol_is_command(const char *message) {
  * @return true if compatible, false if version mismatch
  */
 static inline bool protocol_version_compatible(uint8_t version) {
-    return version == PROTOCOL_VERSION;
+    return version >= PROTOCOL_VERSION_1 && version <= PROTOCOL_VERSION;
 }
 
 /**
@@ -0,0 +1,68 @@
+#include "ring_buffer.h"
+
+#include <string.h>
+
+void ring_buffer_init(RingBuffer *ring, uint8_t *storage, size_t capacity) {
+    ring->data = storage;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+int ring_buffer_write_regions(const RingBuffer *ring, struct iovec iov[2]) {
+    const size_t free_bytes = ring->capacity - ring_buffer_used(ring);
+    if (free_bytes == 0) {
+        return 0;
+    }
+
+    const size_t offset = ring->tail & (ring->capacity - 1);
+    const size_t first = ring->capacity - offset;
+    iov[0].iov_base = ring->data + offset;
+    if (free_bytes <= first) {
+        iov[0].iov_len = free_bytes;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = free_bytes - first;
+    return 2;
+}
+
+void ring_buffer_commit(RingBuffer *ring, size_t len) {
+    ring->tail += len;
+}
+
+size_t ring_buffer_write(RingBuffer *ring, const uint8_t *data, size_t len) {
+    struct iovec iov[2];
+    const int count = ring_buffer_write_regions(ring, iov);
+    size_t written = 0;
+    for (int i = 0; i < count && written < len; i++) {
+        size_t chunk = len - written < iov[i].iov_len ? len - written : iov[i].iov_len;
+        memcpy(iov[i].iov_base, data + written, chunk);
+        written += chunk;
+    }
+    ring->tail += written;
+    return written;
+}
+
+const uint8_t *ring_buffer_peek(const RingBuffer *ring, size_t len, uint8_t *scratch) {
+    const size_t offset = ring->head & (ring->capacity - 1);
+    const size_t first = ring->capacity - offset;
+    if (len <= first) {
+        return ring->data + offset; // Contiguous: parse in place
+    }
+
+    // The bytes wrap around the end of the storage: join them once
+    memcpy(scratch, ring->data + offset, first);
+    memcpy(scratch + first, ring->data, len - first);
+    return scratch;
+}
+
+void ring_buffer_consume(RingBuffer *ring, size_t len) {
+    ring->head += len;
+    if (ring->head == ring->tail) {
+        // Empty: restart at the front so the next frames are less likely to wrap
+        ring->head = 0;
+        ring->tail = 0;
+    }
+}
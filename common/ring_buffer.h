@@ -0,0 +1,88 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Receive Ring Buffer
+ *
+ * Byte ring for one connection's incoming stream. recv()/readv() write
+ * straight into the free space and frames are parsed in place, so a frame is
+ * only copied when it wraps around the end of the storage.
+ *
+ * The read and write positions are free-running counters; the capacity must
+ * be a power of two.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+    size_t head;        // Read position
+    size_t tail;        // Write position
+} RingBuffer;
+
+/**
+ * Initialize an empty ring over caller-owned storage
+ * @param ring Ring to initialize
+ * @param storage Backing memory (at least `capacity` bytes)
+ * @param capacity Size of storage, a power of two
+ */
+void ring_buffer_init(RingBuffer *ring, uint8_t *storage, size_t capacity);
+
+/**
+ * Describe the free space as up to two iovecs (two when it wraps)
+ * @param ring The ring
+ * @param iov Output array of two iovecs, suitable for readv()
+ * @return Number of iovecs filled (0 if the ring is full)
+ */
+int ring_buffer_write_regions(const RingBuffer *ring, struct iovec iov[2]);
+
+/**
+ * Mark bytes written into the regions from ring_buffer_write_regions() as filled
+ * @param ring The ring
+ * @param len Number of bytes written
+ */
+void ring_buffer_commit(RingBuffer *ring, size_t len);
+
+/**
+ * Copy bytes into the ring
+ * @param ring The ring
+ * @param data Bytes to append
+ * @param len Number of bytes
+ * @return Number of bytes copied (less than len if the ring filled up)
+ */
+size_t ring_buffer_write(RingBuffer *ring, const uint8_t *data, size_t len);
+
+/**
+ * Get `len` contiguous bytes from the read position without consuming them
+ * @param ring The ring
+ * @param len Number of bytes (must not exceed ring_buffer_used())
+ * @param scratch Buffer of at least `len` bytes, used only if the bytes wrap
+ * @return Pointer into the ring, or to scratch when the bytes had to be joined
+ */
+const uint8_t *ring_buffer_peek(const RingBuffer *ring, size_t len, uint8_t *scratch);
+
+/**
+ * Discard bytes from the read position
+ * @param ring The ring
+ * @param len Number of bytes (must not exceed ring_buffer_used())
+ */
+void ring_buffer_consume(RingBuffer *ring, size_t len);
+
+/**
+ * Number of unread bytes in the ring
+ */
+static inline size_t ring_buffer_used(const RingBuffer *ring) {
+    return ring->tail - ring->head;
+}
+
+/**
+ * Check whether the ring holds no unread bytes
+ */
+static inline bool ring_buffer_empty(const RingBuffer *ring) {
+    return ring->tail == ring->head;
+}
+
+#endif // RING_BUFFER_H
@@ -0,0 +1,219 @@
+#include "backlog_store.h"
+#include "name_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BACKLOG_STORE_INITIAL_BUCKETS 64
+
+// Storage room_backlog_append allocates for one backlog
+static size_t backlog_store_block_size(const BacklogStore *store) {
+    return sizeof(uint32_t) * (size_t)store->max_frames + store->backlog_bytes;
+}
+
+// Bucket holding the room with this name, or the empty bucket where it would go
+static size_t backlog_store_probe(const BacklogStore *store, const char *name, size_t len) {
+    const size_t mask = store->bucket_count - 1;
+    size_t bucket = name_hash(name, len) & mask;
+    while (store->buckets[bucket] != 0) {
+        const BacklogEntry *entry = &store->entries[store->buckets[bucket] - 1];
+        if (strncmp(entry->name, name, len) == 0 && entry->name[len] == '\0') {
+            break;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+static bool backlog_store_rehash(BacklogStore *store, size_t bucket_count) {
+    int *buckets = calloc(bucket_count, sizeof(int));
+    if (buckets == NULL) {
+        return false;
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_count = bucket_count;
+    for (int i = 0; i < store->count; i++) {
+        const char *name = store->entries[i].name;
+        store->buckets[backlog_store_probe(store, name, strlen(name))] = i + 1;
+    }
+    return true;
+}
+
+static void backlog_store_unlink(BacklogStore *store, int index) {
+    const BacklogEntry *entry = &store->entries[index];
+    if (entry->newer >= 0) {
+        store->entries[entry->newer].older = entry->older;
+    } else {
+        store->newest = entry->older;
+    }
+    if (entry->older >= 0) {
+        store->entries[entry->older].newer = entry->newer;
+    } else {
+        store->oldest = entry->newer;
+    }
+}
+
+static void backlog_store_push_newest(BacklogStore *store, int index) {
+    BacklogEntry *entry = &store->entries[index];
+    entry->newer = -1;
+    entry->older = store->newest;
+    if (store->newest >= 0) {
+        store->entries[store->newest].newer = index;
+    } else {
+        store->oldest = index;
+    }
+    store->newest = index;
+}
+
+static void backlog_store_touch(BacklogStore *store, int index) {
+    if (store->newest != index) {
+        backlog_store_unlink(store, index);
+        backlog_store_push_newest(store, index);
+    }
+}
+
+// Frees an entry and keeps the entries dense by moving the last one into its place
+static void backlog_store_remove(BacklogStore *store, int index) {
+    BacklogEntry *entry = &store->entries[index];
+    backlog_store_unlink(store, index);
+    if (entry->backlog.lengths != NULL) {
+        store->bytes -= backlog_store_block_size(store);
+    }
+    room_backlog_destroy(&entry->backlog);
+
+    // Backward-shift deletion: pull later entries of the probe chain into the
+    // hole unless that would move them before their home bucket
+    const size_t mask = store->bucket_count - 1;
+    size_t hole = backlog_store_probe(store, entry->name, strlen(entry->name));
+    for (size_t next = (hole + 1) & mask; store->buckets[next] != 0; next = (next + 1) & mask) {
+        const char *name = store->entries[store->buckets[next] - 1].name;
+        const size_t home = name_hash(name, strlen(name)) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            store->buckets[hole] = store->buckets[next];
+            hole = next;
+        }
+    }
+    store->buckets[hole] = 0;
+
+    const int last = --store->count;
+    if (index != last) {
+        const BacklogEntry *moved = &store->entries[last];
+        store->buckets[backlog_store_probe(store, moved->name, strlen(moved->name))] = index + 1;
+        *entry = *moved;
+        if (entry->newer >= 0) {
+            store->entries[entry->newer].older = index;
+        } else {
+            store->newest = index;
+        }
+        if (entry->older >= 0) {
+            store->entries[entry->older].newer = index;
+        } else {
+            store->oldest = index;
+        }
+    }
+}
+
+// Creates an empty backlog for the room, first freeing the least recently
+// used ones until its storage fits. Returns its index, or -1.
+static int backlog_store_add(BacklogStore *store, const char *name, size_t len) {
+    const size_t block = backlog_store_block_size(store);
+    while (store->oldest >= 0 && store->bytes + block > store->max_bytes) {
+        backlog_store_remove(store, store->oldest);
+        store->evicted++;
+    }
+
+    if (store->count >= store->capacity) {
+        const int new_capacity = store->capacity > 0 ? store->capacity * 2 : 16;
+        BacklogEntry *new_entries = realloc(store->entries, sizeof(BacklogEntry) * new_capacity);
+        if (new_entries == NULL) {
+            return -1;
+        }
+        store->entries = new_entries;
+        store->capacity = new_capacity;
+    }
+    // Keep the load factor at or below one half
+    if ((size_t)(store->count + 1) * 2 > store->bucket_count &&
+        !backlog_store_rehash(store, store->bucket_count * 2)) {
+        return -1;
+    }
+
+    const int index = store->count++;
+    BacklogEntry *entry = &store->entries[index];
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    room_backlog_init(&entry->backlog, store->max_frames, store->backlog_bytes);
+    store->buckets[backlog_store_probe(store, name, len)] = index + 1;
+    backlog_store_push_newest(store, index);
+    return index;
+}
+
+bool backlog_store_init(BacklogStore *store, int max_frames, size_t backlog_bytes, size_t max_bytes) {
+    pthread_mutex_init(&store->lock, NULL);
+    store->entries = NULL;
+    store->count = 0;
+    store->capacity = 0;
+    store->buckets = calloc(BACKLOG_STORE_INITIAL_BUCKETS, sizeof(int));
+    store->bucket_count = BACKLOG_STORE_INITIAL_BUCKETS;
+    store->newest = -1;
+    store->oldest = -1;
+    store->max_frames = max_frames;
+    store->backlog_bytes = backlog_bytes;
+    store->max_bytes = max_bytes;
+    store->bytes = 0;
+    store->evicted = 0;
+    return store->buckets != NULL;
+}
+
+void backlog_store_destroy(BacklogStore *store) {
+    if (store->buckets == NULL) {
+        return; // Never initialized
+    }
+    for (int i = 0; i < store->count; i++) {
+        room_backlog_destroy(&store->entries[i].backlog);
+    }
+    free(store->entries);
+    free(store->buckets);
+    store->entries = NULL;
+    store->buckets = NULL;
+    store->count = 0;
+    store->capacity = 0;
+    store->bytes = 0;
+    pthread_mutex_destroy(&store->lock);
+}
+
+bool backlog_store_append(BacklogStore *store, const char *room, const uint8_t *frame, size_t len) {
+    const size_t name_len = strnlen(room, MAX_ROOM_NAME - 1);
+    pthread_mutex_lock(&store->lock);
+    int index = store->buckets[backlog_store_probe(store, room, name_len)] - 1;
+    if (index >= 0) {
+        backlog_store_touch(store, index);
+    } else {
+        index = backlog_store_add(store, room, name_len);
+    }
+
+    bool stored = false;
+    if (index >= 0) {
+        RoomBacklog *backlog = &store->entries[index].backlog;
+        const bool allocated = backlog->lengths != NULL;
+        stored = room_backlog_append(backlog, frame, len);
+        if (!allocated && backlog->lengths != NULL) {
+            store->bytes += backlog_store_block_size(store);
+        } else if (!allocated) {
+            backlog_store_remove(store, index); // Still empty, nothing to keep
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return stored;
+}
+
+size_t backlog_store_copy(BacklogStore *store, const char *room, uint8_t *buf) {
+    pthread_mutex_lock(&store->lock);
+    const int index = store->buckets[backlog_store_probe(store, room, strnlen(room, MAX_ROOM_NAME - 1))] - 1;
+    size_t len = 0;
+    if (index >= 0) {
+        backlog_store_touch(store, index);
+        len = room_backlog_copy(&store->entries[index].backlog, buf);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return len;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "room_backlog.h"
+#include "room_table.h"
+
+#define DEFAULT_BACKLOG_MEMORY (16 * 1024 * 1024)
+
+// The backlog of one room and its place in the least recently used order
+typedef struct {
+    char name[MAX_ROOM_NAME];
+    RoomBacklog backlog;
+    int newer;             // Entry used next after this one, -1 for the newest
+    int older;             // ... and before it, -1 for the oldest
+} BacklogEntry;
+
+/**
+ * The chat backlogs of every room, shared by all shards.
+ *
+ * A room has one backlog however many shards its members are on: the shard a
+ * message arrives on appends it, and the shard of a client that joins copies
+ * it out for the replay. A backlog is created by the room's first message.
+ * Appends and replays move it to the front of a least recently used list, and
+ * once the backlogs together would exceed `max_bytes` the ones at the back
+ * are freed, so rooms nobody talks in or joins lose theirs first.
+ *
+ * Entries are dense and indexed by an open-addressing hash of the room names,
+ * like the user directory. One mutex guards everything; each call holds it for
+ * a lookup and one copy.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    BacklogEntry *entries;
+    int count;
+    int capacity;
+    int *buckets;          // Entry index + 1, 0 for an empty bucket
+    size_t bucket_count;   // Power of two
+    int newest;            // Front of the least recently used list, -1 if empty
+    int oldest;
+    int max_frames;        // Frames each backlog keeps
+    size_t backlog_bytes;  // Bytes each backlog keeps
+    size_t max_bytes;      // Storage of all backlogs together
+    size_t bytes;          // Storage allocated now
+    uint64_t evicted;      // Backlogs freed to stay under max_bytes
+} BacklogStore;
+
+/**
+ * @brief Initializes an empty store.
+ * @param max_frames Chat frames each room keeps for replay.
+ * @param backlog_bytes Bytes each room keeps at most for them.
+ * @param max_bytes Storage of all backlogs together. At least one backlog is
+ *        kept even if it alone is larger.
+ * @return true on success, false if allocation failed.
+ */
+bool backlog_store_init(BacklogStore *store, int max_frames, size_t backlog_bytes, size_t max_bytes);
+
+/**
+ * @brief Frees every backlog and the index.
+ */
+void backlog_store_destroy(BacklogStore *store);
+
+/**
+ * @brief Appends a chat frame to the room's backlog, creating the backlog and
+ *        evicting the least recently used ones as needed. Safe to call from any thread.
+ * @return false if the frame could not be stored.
+ */
+bool backlog_store_append(BacklogStore *store, const char *room, const uint8_t *frame, size_t len);
+
+/**
+ * @brief Copies the room's backlog, oldest frame first, back to back.
+ *        Safe to call from any thread.
+ * @param buf Buffer of at least backlog_bytes bytes.
+ * @return Bytes copied, 0 if the room has no backlog.
+ */
+size_t backlog_store_copy(BacklogStore *store, const char *room, uint8_t *buf);
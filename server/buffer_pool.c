@@ -0,0 +1,61 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+void buffer_pool_init(BufferPool *pool, size_t block_size, size_t blocks_per_slab) {
+    pool->block_size = block_size;
+    pool->blocks_per_slab = blocks_per_slab;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->in_use = 0;
+}
+
+uint8_t *buffer_pool_acquire(BufferPool *pool) {
+    if (pool->free_list == NULL) {
+        BufferSlab *slab = malloc(sizeof(BufferSlab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->blocks = malloc(pool->block_size * pool->blocks_per_slab);
+        if (slab->blocks == NULL) {
+            free(slab);
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_count++;
+
+        // Thread the new blocks onto the free list
+        for (size_t i = 0; i < pool->blocks_per_slab; i++) {
+            void **block = (void **)(slab->blocks + i * pool->block_size);
+            *block = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+
+    void **block = pool->free_list;
+    pool->free_list = *block;
+    pool->in_use++;
+    return (uint8_t *)block;
+}
+
+void buffer_pool_release(BufferPool *pool, uint8_t *block) {
+    if (block == NULL) {
+        return;
+    }
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+}
+
+void buffer_pool_destroy(BufferPool *pool) {
+    while (pool->slabs != NULL) {
+        BufferSlab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free(slab->blocks);
+        free(slab);
+    }
+    pool->free_list = NULL;
+    pool->slab_count = 0;
+    pool->in_use = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fixed-size block allocator carved out of large slabs.
+ *
+ * Used for receive buffers that a connection only holds while a partial frame
+ * is pending. Blocks are recycled through a free list; slabs are only returned
+ * to the system when the pool is destroyed. Not thread-safe: each shard owns
+ * its own pool.
+ */
+typedef struct BufferSlab {
+    struct BufferSlab *next;
+    uint8_t *blocks;
+} BufferSlab;
+
+typedef struct {
+    size_t block_size;
+    size_t blocks_per_slab;
+    void *free_list;        // Free blocks, linked through their first bytes
+    BufferSlab *slabs;
+    size_t slab_count;
+    size_t in_use;          // Blocks handed out
+} BufferPool;
+
+/**
+ * @brief Initializes an empty pool. No memory is allocated until the first acquire.
+ * @param pool The pool.
+ * @param block_size Size of each block (at least sizeof(void *)).
+ * @param blocks_per_slab Blocks allocated at once when the pool runs dry.
+ */
+void buffer_pool_init(BufferPool *pool, size_t block_size, size_t blocks_per_slab);
+
+/**
+ * @brief Takes a block from the pool, allocating a new slab if needed.
+ * @return The block, or NULL if allocation failed.
+ */
+uint8_t *buffer_pool_acquire(BufferPool *pool);
+
+/**
+ * @brief Returns a block to the pool. NULL is ignored.
+ */
+void buffer_pool_release(BufferPool *pool, uint8_t *block);
+
+/**
+ * @brief Frees every slab. Blocks still handed out become invalid.
+ */
+void buffer_pool_destroy(BufferPool *pool);
+
+/**
+ * @brief Number of blocks the pool currently owns (free or in use).
+ */
+static inline size_t buffer_pool_capacity(const BufferPool *pool) {
+    return pool->slab_count * pool->blocks_per_slab;
+}
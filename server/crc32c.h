@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Extends a CRC32C (Castagnoli) over `len` more bytes. Uses the SSE4.2
+ *        crc32 instruction when the CPU has it.
+ * @param crc CRC of the bytes so far, 0 to start.
+ * @return The CRC including `data`.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
@@ -0,0 +1,63 @@
+#include "latency.h"
+
+#define LATENCY_SUB_COUNT (1u << LATENCY_SUB_BITS)
+
+static unsigned latency_bucket(uint64_t value) {
+    if (value >= (1ull << LATENCY_MAX_BITS)) {
+        return LATENCY_BUCKETS - 1;
+    }
+    if (value < LATENCY_SUB_COUNT) {
+        return (unsigned)value;
+    }
+    // The top LATENCY_SUB_BITS bits below the leading one pick the sub-bucket
+    const unsigned shift = (unsigned)(63 - __builtin_clzll(value)) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + (unsigned)((value >> shift) & (LATENCY_SUB_COUNT - 1));
+}
+
+// Largest value that falls into the bucket
+static uint64_t latency_bucket_limit(unsigned bucket) {
+    if (bucket < LATENCY_SUB_COUNT) {
+        return bucket;
+    }
+    const unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    const uint64_t sub = bucket & (LATENCY_SUB_COUNT - 1);
+    return ((LATENCY_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void latency_record(LatencyHistogram *histogram, uint64_t value_us) {
+    histogram->buckets[latency_bucket(value_us)]++;
+    histogram->count++;
+    if (value_us > histogram->max) {
+        histogram->max = value_us;
+    }
+}
+
+uint64_t latency_percentile(const LatencyHistogram *histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    // Rank of the sample wanted, 1-based
+    uint64_t rank = (uint64_t)(quantile * (double)histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            const uint64_t limit = latency_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+const char *latency_phase_name(LatencyPhase phase) {
+    switch (phase) {
+        case LATENCY_INGRESS:  return "ingress";
+        case LATENCY_DISPATCH: return "dispatch";
+        case LATENCY_FLUSH:    return "flush";
+        case LATENCY_DELIVERY: return "delivery";
+        default:               return "unknown";
+    }
+}
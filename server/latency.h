@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Stages a chat message passes through, each measured in microseconds.
+ */
+typedef enum {
+    LATENCY_INGRESS,   // Sender's header timestamp -> received by the server
+    LATENCY_DISPATCH,  // Received -> queued for a recipient (includes the hop between shards)
+    LATENCY_FLUSH,     // Queued -> last byte handed to the kernel
+    LATENCY_DELIVERY,  // Sender's header timestamp -> received by a client, as the client reports it
+    LATENCY_PHASES
+} LatencyPhase;
+
+// Log-linear buckets: values below 8 are exact, then 8 buckets per power of two
+// (at most 12.5% wide) up to 2^36 us
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS  ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/**
+ * Distribution of one phase's samples. Recording is O(1) and allocation free.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/**
+ * One histogram per phase, kept for all traffic and for each room.
+ */
+typedef struct {
+    LatencyHistogram phases[LATENCY_PHASES];
+} LatencyStats;
+
+/**
+ * @brief Adds one sample. Values beyond the last bucket are counted in it.
+ */
+void latency_record(LatencyHistogram *histogram, uint64_t value_us);
+
+/**
+ * @brief Value below which the fraction `quantile` of the samples fall.
+ * @param quantile Between 0 and 1, e.g. 0.999.
+ * @return Upper bound of the bucket holding that sample (never above the
+ *         largest sample), or 0 without samples.
+ */
+uint64_t latency_percentile(const LatencyHistogram *histogram, double quantile);
+
+/**
+ * @brief Short name of a phase for reports.
+ */
+const char *latency_phase_name(LatencyPhase phase);
@@ -0,0 +1,327 @@
+#include "log_index.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_INDEX_INITIAL_ROOMS 64   // Power of two
+#define LOG_INDEX_INITIAL_ENTRIES 16
+
+static size_t log_index_slot(uint64_t room, size_t capacity) {
+    return (size_t)((room * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+// Builder
+
+void log_index_init(LogIndexBuilder *index) {
+    index->rooms = NULL;
+    index->room_capacity = 0;
+    index->room_count = 0;
+    index->entry_count = 0;
+    index->max_time = 0;
+}
+
+void log_index_clear(LogIndexBuilder *index) {
+    for (size_t i = 0; i < index->room_capacity; i++) {
+        free(index->rooms[i].entries);
+    }
+    free(index->rooms);
+    log_index_init(index);
+}
+
+static LogIndexRoomState *log_index_find(const LogIndexBuilder *index, uint64_t room) {
+    if (index->room_capacity == 0) {
+        return NULL;
+    }
+    size_t slot = log_index_slot(room, index->room_capacity);
+    while (index->rooms[slot].entries != NULL) {
+        if (index->rooms[slot].room == room) {
+            return &index->rooms[slot];
+        }
+        slot = (slot + 1) & (index->room_capacity - 1);
+    }
+    return &index->rooms[slot];  // Empty slot the room would take
+}
+
+static bool log_index_grow(LogIndexBuilder *index) {
+    const size_t capacity = index->room_capacity == 0 ? LOG_INDEX_INITIAL_ROOMS : index->room_capacity * 2;
+    LogIndexRoomState *rooms = calloc(capacity, sizeof(LogIndexRoomState));
+    if (rooms == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < index->room_capacity; i++) {
+        const LogIndexRoomState *state = &index->rooms[i];
+        if (state->entries == NULL) {
+            continue;
+        }
+        size_t slot = log_index_slot(state->room, capacity);
+        while (rooms[slot].entries != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        rooms[slot] = *state;
+    }
+    free(index->rooms);
+    index->rooms = rooms;
+    index->room_capacity = capacity;
+    return true;
+}
+
+bool log_index_add(LogIndexBuilder *index, uint64_t room, uint64_t time, uint64_t offset) {
+    // Keep the table at most half full
+    if ((index->room_count + 1) * 2 > index->room_capacity && !log_index_grow(index)) {
+        return false;
+    }
+    LogIndexRoomState *state = log_index_find(index, room);
+    if (state->entries == NULL) {
+        state->entries = malloc(LOG_INDEX_INITIAL_ENTRIES * sizeof(LogIndexEntry));
+        if (state->entries == NULL) {
+            return false;
+        }
+        state->room = room;
+        state->max_time = 0;
+        state->block = UINT64_MAX;
+        state->count = 0;
+        state->capacity = LOG_INDEX_INITIAL_ENTRIES;
+        index->room_count++;
+    }
+
+    if (time > state->max_time) {
+        state->max_time = time;
+    }
+    if (time > index->max_time) {
+        index->max_time = time;
+    }
+    const uint64_t block = offset / LOG_INDEX_BLOCK;
+    if (block == state->block) {
+        return true;
+    }
+    if (state->count == state->capacity) {
+        LogIndexEntry *grown = realloc(state->entries, (size_t)state->capacity * 2 * sizeof(LogIndexEntry));
+        if (grown == NULL) {
+            return false;
+        }
+        state->entries = grown;
+        state->capacity *= 2;
+    }
+    state->entries[state->count++] = (LogIndexEntry){ .time = state->max_time, .offset = offset };
+    state->block = block;
+    index->entry_count++;
+    return true;
+}
+
+const LogIndexEntry *log_index_room(const LogIndexBuilder *index, uint64_t room, uint32_t *count) {
+    const LogIndexRoomState *state = log_index_find(index, room);
+    if (state == NULL || state->entries == NULL) {
+        return NULL;
+    }
+    *count = state->count;
+    return state->entries;
+}
+
+static int log_index_compare_keys(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t *log_index_keys(const LogIndexBuilder *index, uint32_t *count) {
+    *count = 0;
+    if (index->room_count == 0) {
+        return NULL;
+    }
+    uint64_t *keys = malloc(index->room_count * sizeof(uint64_t));
+    if (keys == NULL) {
+        LOG_ERROR("Failed to allocate room set of %zu rooms", index->room_count);
+        return NULL;
+    }
+    for (size_t i = 0; i < index->room_capacity; i++) {
+        if (index->rooms[i].entries != NULL) {
+            keys[(*count)++] = index->rooms[i].room;
+        }
+    }
+    qsort(keys, *count, sizeof(uint64_t), log_index_compare_keys);
+    return keys;
+}
+
+static int log_index_compare_rooms(const void *a, const void *b) {
+    const uint64_t x = (*(const LogIndexRoomState *const *)a)->room;
+    const uint64_t y = (*(const LogIndexRoomState *const *)b)->room;
+    return (x > y) - (x < y);
+}
+
+static bool log_index_write_all(int fd, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        const ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+bool log_index_write(const LogIndexBuilder *index, const char *path, uint64_t end, uint64_t max_time) {
+    // The table is left as it is; the rooms are sorted through pointers
+    const LogIndexRoomState **sorted = malloc((index->room_count + 1) * sizeof(*sorted));
+    LogIndexRoom *rooms = malloc((index->room_count + 1) * sizeof(LogIndexRoom));
+    if (sorted == NULL || rooms == NULL) {
+        LOG_ERROR("Failed to allocate index of %zu rooms", index->room_count);
+        free(sorted);
+        free(rooms);
+        return false;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < index->room_capacity; i++) {
+        if (index->rooms[i].entries != NULL) {
+            sorted[n++] = &index->rooms[i];
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), log_index_compare_rooms);
+    uint32_t first = 0;
+    for (size_t i = 0; i < n; i++) {
+        rooms[i] = (LogIndexRoom){ .room = sorted[i]->room, .first = first, .count = sorted[i]->count };
+        first += sorted[i]->count;
+    }
+
+    LogIndexHeader header = {
+        .room_count = (uint32_t)n,
+        .entry_count = first,
+        .end = end,
+        .max_time = max_time
+    };
+    memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(header.magic));
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 &&
+              log_index_write_all(fd, &header, sizeof(header)) &&
+              log_index_write_all(fd, rooms, n * sizeof(LogIndexRoom));
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = log_index_write_all(fd, sorted[i]->entries, sorted[i]->count * sizeof(LogIndexEntry));
+    }
+    if (!ok) {
+        LOG_ERROR("write %s: %s", tmp, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    // The index can be rebuilt from its segment, so it is not synced: a
+    // damaged one is detected and replaced on startup
+    if (ok && rename(tmp, path) < 0) {
+        LOG_ERROR("rename %s: %s", tmp, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp);
+    }
+    free(sorted);
+    free(rooms);
+    return ok;
+}
+
+// Mapped index files
+
+bool log_index_map(LogIndexMap *map, const char *path) {
+    map->data = NULL;
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LogIndexHeader)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    map->data = data;
+    map->size = (size_t)st.st_size;
+    map->header = data;
+    map->rooms = (const LogIndexRoom *)(map->data + sizeof(LogIndexHeader));
+    map->entries = (const LogIndexEntry *)(map->rooms + map->header->room_count);
+
+    const size_t expected = sizeof(LogIndexHeader) + (size_t)map->header->room_count * sizeof(LogIndexRoom) +
+                            (size_t)map->header->entry_count * sizeof(LogIndexEntry);
+    if (memcmp(map->header->magic, LOG_INDEX_MAGIC, sizeof(map->header->magic)) != 0 || map->size != expected) {
+        log_index_unmap(map);
+        return false;
+    }
+    madvise(data, map->size, MADV_RANDOM);
+    return true;
+}
+
+const LogIndexEntry *log_index_map_room(const LogIndexMap *map, uint64_t room, uint32_t *count) {
+    uint32_t lo = 0;
+    uint32_t hi = map->header->room_count;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (map->rooms[mid].room < room) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == map->header->room_count || map->rooms[lo].room != room) {
+        return NULL;
+    }
+    const LogIndexRoom *entry = &map->rooms[lo];
+    if ((uint64_t)entry->first + entry->count > map->header->entry_count) {
+        return NULL;
+    }
+    *count = entry->count;
+    return map->entries + entry->first;
+}
+
+uint64_t *log_index_map_keys(const LogIndexMap *map, uint32_t *count) {
+    *count = 0;
+    if (map->header->room_count == 0) {
+        return NULL;
+    }
+    uint64_t *keys = malloc(map->header->room_count * sizeof(uint64_t));
+    if (keys == NULL) {
+        LOG_ERROR("Failed to allocate room set of %u rooms", map->header->room_count);
+        return NULL;
+    }
+    // Stored sorted already
+    for (uint32_t i = 0; i < map->header->room_count; i++) {
+        keys[i] = map->rooms[i].room;
+    }
+    *count = map->header->room_count;
+    return keys;
+}
+
+void log_index_unmap(LogIndexMap *map) {
+    if (map->data != NULL) {
+        munmap((void *)map->data, map->size);
+        map->data = NULL;
+    }
+}
+
+uint32_t log_index_seek(const LogIndexEntry *entries, uint32_t count, uint64_t from) {
+    // First entry at or after `from`, then step back one block
+    uint32_t lo = 0;
+    uint32_t hi = count;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].time < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
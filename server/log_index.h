@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_INDEX_MAGIC "CHATIDX1"
+#define LOG_INDEX_BLOCK 4096   // Log bytes covered by one index entry per room
+
+/**
+ * Sparse index of one message log segment.
+ *
+ * For every room, the index holds one entry per LOG_INDEX_BLOCK bytes of the
+ * segment that contain a record of the room: the offset of the room's first
+ * record in that block and the room's latest arrival time up to and including
+ * it. Times are a running maximum, so entries are sorted by time as well as by
+ * offset even when shards stamp messages slightly out of order, and every
+ * record in blocks before an entry is no later than that entry's time.
+ *
+ * A sealed segment's index is a file next to it: a header, the rooms sorted
+ * by key, then each room's entries. Both levels are binary searched in place
+ * through a read-only mapping.
+ */
+
+typedef struct {
+    uint64_t time;     // Running maximum of the room's arrival times, ms
+    uint64_t offset;   // Of the room's first record in the block, from the segment start
+} LogIndexEntry;
+
+typedef struct {
+    uint64_t room;
+    uint32_t first;    // Index of the room's first entry
+    uint32_t count;
+} LogIndexRoom;
+
+typedef struct {
+    char magic[8];
+    uint32_t room_count;
+    uint32_t entry_count;
+    uint64_t end;       // End of the segment's records
+    uint64_t max_time;  // Latest arrival time in this and every earlier segment
+} LogIndexHeader;
+
+// One room of an index being built
+typedef struct {
+    uint64_t room;
+    uint64_t max_time;
+    uint64_t block;        // Block of the last entry, UINT64_MAX before the first
+    LogIndexEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+} LogIndexRoomState;
+
+/**
+ * Index of a segment as it is written, kept in memory. Rooms are found
+ * through an open-addressing table keyed by the room key.
+ */
+typedef struct {
+    LogIndexRoomState *rooms;
+    size_t room_capacity;    // Power of two, or 0 before the first record
+    size_t room_count;
+    size_t entry_count;
+    uint64_t max_time;
+} LogIndexBuilder;
+
+// A sealed segment's index file, mapped read-only
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    const LogIndexHeader *header;
+    const LogIndexRoom *rooms;
+    const LogIndexEntry *entries;
+} LogIndexMap;
+
+/**
+ * @brief Initializes an empty builder.
+ */
+void log_index_init(LogIndexBuilder *index);
+
+/**
+ * @brief Frees the builder's memory and empties it.
+ */
+void log_index_clear(LogIndexBuilder *index);
+
+/**
+ * @brief Notes a record; adds an entry if it is the room's first in its block.
+ * @param index The builder.
+ * @param room Room key of the record.
+ * @param time Arrival time of the record.
+ * @param offset Offset of the record from the segment start.
+ * @return true on success, false if memory ran out.
+ */
+bool log_index_add(LogIndexBuilder *index, uint64_t room, uint64_t time, uint64_t offset);
+
+/**
+ * @brief Looks up a room's entries in a builder.
+ * @return The room's entries (count in *count), or NULL if it has none.
+ */
+const LogIndexEntry *log_index_room(const LogIndexBuilder *index, uint64_t room, uint32_t *count);
+
+/**
+ * @brief Lists the rooms with entries in a builder.
+ * @param index The builder.
+ * @param count Set to the number of rooms.
+ * @return Their keys in ascending order, to be freed by the caller; NULL if
+ *         there are none or memory ran out.
+ */
+uint64_t *log_index_keys(const LogIndexBuilder *index, uint32_t *count);
+
+/**
+ * @brief Writes the builder out as an index file, through a temporary file
+ *        renamed into place.
+ * @param index The builder.
+ * @param path Path of the index file.
+ * @param end End of the segment's records.
+ * @param max_time Latest arrival time in this and every earlier segment.
+ * @return true on success, false on failure.
+ */
+bool log_index_write(const LogIndexBuilder *index, const char *path, uint64_t end, uint64_t max_time);
+
+/**
+ * @brief Maps an index file and checks that it is complete.
+ * @return true on success, false if it is missing or damaged.
+ */
+bool log_index_map(LogIndexMap *map, const char *path);
+
+/**
+ * @brief Looks up a room's entries in a mapped index by binary search.
+ * @return The room's entries (count in *count), or NULL if it has none.
+ */
+const LogIndexEntry *log_index_map_room(const LogIndexMap *map, uint64_t room, uint32_t *count);
+
+/**
+ * @brief Lists the rooms in a mapped index, like log_index_keys.
+ */
+uint64_t *log_index_map_keys(const LogIndexMap *map, uint32_t *count);
+
+/**
+ * @brief Unmaps an index file.
+ */
+void log_index_unmap(LogIndexMap *map);
+
+/**
+ * @brief Finds the entry to start reading at for records arriving at or after
+ *        `from`: the last one whose time is earlier, or the first.
+ */
+uint32_t log_index_seek(const LogIndexEntry *entries, uint32_t count, uint64_t from);
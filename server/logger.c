@@ -0,0 +1,340 @@
+#include "logger.h"
+#include "wake_queue.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 4096        // Power of two
+#define LOG_STRING_SPACE 352       // String bytes per record, beyond which they are truncated
+#define LOG_IDLE_POLL_MS 100       // Backstop for a wakeup lost to the relaxed flag check
+#define LOG_LINE_MAX 1024
+#define LOG_OUTPUT_MAX (64 * 1024) // Written out whenever this much is formatted
+
+// A captured argument; strings refer to bytes in the slot's data area
+typedef struct {
+    uint8_t type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        struct {
+            uint16_t offset;
+            uint16_t len;
+        } s;
+    };
+} LogValue;
+
+typedef struct {
+    _Atomic size_t sequence;  // Vyukov bounded queue: equals the position when free, position + 1 when filled
+    uint64_t time_us;         // Wall clock
+    const char *format;
+    uint8_t level;
+    uint8_t arg_count;
+    LogValue values[LOG_MAX_ARGS];
+    char data[LOG_STRING_SPACE];
+} LogSlot;
+
+_Static_assert(sizeof(LogSlot) == 512, "log slots should stay a whole number of cache lines");
+
+typedef struct {
+    LogSlot *slots;
+    _Alignas(64) _Atomic size_t tail;  // Next position producers claim
+    _Alignas(64) size_t head;          // Next position the writer thread reads
+    _Atomic uint64_t dropped;          // Records lost to a full ring
+    WakeSignal wake;                   // Signalled when the ring goes from empty to filled
+    atomic_bool stopping;
+    pthread_t thread;
+    bool running;
+    char output[LOG_OUTPUT_MAX + LOG_LINE_MAX];
+    size_t output_len;
+} Logger;
+
+static Logger logger = { .wake.fd = -1 };
+
+static const char *const log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Producer side
+
+static void logger_capture(LogSlot *slot, int level, const char *format, const LogArg *args, int arg_count) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->time_us = (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+    slot->format = format;
+    slot->level = (uint8_t)level;
+    slot->arg_count = (uint8_t)(arg_count < LOG_MAX_ARGS ? arg_count : LOG_MAX_ARGS);
+
+    size_t used = 0;
+    for (int i = 0; i < slot->arg_count; i++) {
+        LogValue *value = &slot->values[i];
+        value->type = args[i].type;
+        if (args[i].type != LOG_ARG_STRING) {
+            value->u = args[i].u;
+            continue;
+        }
+        size_t len = args[i].s.data != NULL ? args[i].s.len : 0;
+        if (len > sizeof(slot->data) - used) {
+            len = sizeof(slot->data) - used;
+        }
+        if (len > 0) {
+            memcpy(slot->data + used, args[i].s.data, len);
+        }
+        value->s.offset = (uint16_t)used;
+        value->s.len = (uint16_t)len;
+        used += len;
+    }
+}
+
+// Formatting (writer thread, or the caller while no thread runs)
+
+// Length modifiers are dropped: integers are always printed as long long
+static bool log_format_spec(char *spec, size_t spec_size, const char **cursor) {
+    const char *p = *cursor; // Just past the '%'
+    size_t len = 0;
+    spec[len++] = '%';
+    while (*p != '\0' && strchr("-+ #0123456789.*", *p) != NULL && len < spec_size - 4) {
+        spec[len++] = *p++;
+    }
+    while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't' || *p == 'L' || *p == 'q') {
+        p++;
+    }
+    if (*p == '\0') {
+        return false;
+    }
+    const char conversion = *p++;
+    if (strchr("diouxX", conversion) != NULL) {
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+    }
+    spec[len++] = conversion;
+    spec[len] = '\0';
+    *cursor = p;
+    return true;
+}
+
+static int log_format_value(char *out, size_t size, const char *spec, const LogSlot *slot, int *next_arg) {
+    const char conversion = spec[strlen(spec) - 1];
+    const bool star = strchr(spec, '*') != NULL;
+    if (star || *next_arg >= slot->arg_count) {
+        return snprintf(out, size, "<?>"); // '*' widths and missing arguments are not supported
+    }
+    const LogValue *value = &slot->values[(*next_arg)++];
+
+    switch (conversion) {
+        case 'd': case 'i': case 'c':
+            if (value->type == LOG_ARG_INT || value->type == LOG_ARG_UINT) {
+                return conversion == 'c' ? snprintf(out, size, spec, (int)value->i) : snprintf(out, size, spec, (long long)value->i);
+            }
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            if (value->type == LOG_ARG_INT || value->type == LOG_ARG_UINT) {
+                return snprintf(out, size, spec, (unsigned long long)value->u);
+            }
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            if (value->type == LOG_ARG_DOUBLE) {
+                return snprintf(out, size, spec, value->d);
+            }
+            break;
+        case 'p':
+            if (value->type == LOG_ARG_POINTER) {
+                return snprintf(out, size, spec, value->p);
+            }
+            break;
+        case 's':
+            if (value->type == LOG_ARG_STRING) {
+                // The copy is not terminated; bound it with a precision
+                char bounded[32];
+                const char *dot = strchr(spec, '.');
+                int precision = value->s.len;
+                if (dot != NULL && atoi(dot + 1) < precision) {
+                    precision = atoi(dot + 1);
+                }
+                snprintf(bounded, sizeof(bounded), "%.*s.*s", dot != NULL ? (int)(dot - spec) : (int)strlen(spec) - 1, spec);
+                return snprintf(out, size, bounded, precision, slot->data + value->s.offset);
+            }
+            break;
+    }
+    return snprintf(out, size, "<?>");
+}
+
+// Formats one record as a line, newline included
+static size_t logger_format(const LogSlot *slot, char *line, size_t size) {
+    const time_t seconds = (time_t)(slot->time_us / 1000000u);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    size_t len = strftime(line, size, "%H:%M:%S", &tm);
+    len += (size_t)snprintf(line + len, size - len, ".%03u %-5s ",
+                            (unsigned)(slot->time_us / 1000u % 1000u), log_level_names[slot->level]);
+
+    int next_arg = 0;
+    for (const char *p = slot->format; *p != '\0' && len < size - 2;) {
+        if (*p != '%') {
+            line[len++] = *p++;
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            line[len++] = *p++;
+            continue;
+        }
+        char spec[32];
+        if (!log_format_spec(spec, sizeof(spec), &p)) {
+            break;
+        }
+        const int written = log_format_value(line + len, size - 1 - len, spec, slot, &next_arg);
+        if (written > 0) {
+            len += (size_t)written < size - 1 - len ? (size_t)written : size - 2 - len;
+        }
+    }
+    // Messages carry no newline of their own; drop any the format had
+    while (len > 0 && line[len - 1] == '\n') {
+        len--;
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+static void logger_flush_output(void) {
+    if (logger.output_len > 0) {
+        fwrite(logger.output, 1, logger.output_len, stdout);
+        fflush(stdout);
+        logger.output_len = 0;
+    }
+}
+
+// Formats every filled slot, then writes the batch out
+static void logger_drain(void) {
+    const size_t mask = LOG_RING_SLOTS - 1;
+    while (1) {
+        LogSlot *slot = &logger.slots[logger.head & mask];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger.head + 1) {
+            break;
+        }
+        logger.output_len += logger_format(slot, logger.output + logger.output_len, LOG_LINE_MAX);
+        atomic_store_explicit(&slot->sequence, logger.head + LOG_RING_SLOTS, memory_order_release);
+        logger.head++;
+        if (logger.output_len >= LOG_OUTPUT_MAX) {
+            logger_flush_output();
+        }
+    }
+
+    const uint64_t dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        logger.output_len += (size_t)snprintf(logger.output + logger.output_len, LOG_LINE_MAX,
+                                              "%llu log records dropped: ring full\n", (unsigned long long)dropped);
+    }
+    logger_flush_output();
+}
+
+static void *logger_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        const bool stopping = atomic_load(&logger.stopping);
+        wake_signal_clear(&logger.wake);
+        logger_drain();
+        if (stopping) {
+            break;
+        }
+        wake_signal_wait(&logger.wake, LOG_IDLE_POLL_MS);
+    }
+    return NULL;
+}
+
+// Public API
+
+bool logger_start(void) {
+    logger.slots = aligned_alloc(64, sizeof(LogSlot) * LOG_RING_SLOTS);
+    if (logger.slots == NULL) {
+        perror("Failed to allocate log ring");
+        return false;
+    }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&logger.slots[i].sequence, i);
+    }
+    atomic_init(&logger.tail, 0);
+    logger.head = 0;
+    atomic_init(&logger.dropped, 0);
+    atomic_init(&logger.stopping, false);
+    logger.output_len = 0;
+
+    if (!wake_signal_init(&logger.wake)) {
+        free(logger.slots);
+        logger.slots = NULL;
+        return false;
+    }
+
+    // The writer thread must never take SIGINT/SIGTERM: shard 0 reads them through its signalfd
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    const int result = pthread_create(&logger.thread, NULL, logger_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        fprintf(stderr, "pthread_create logger: %s\n", strerror(result));
+        wake_signal_destroy(&logger.wake);
+        free(logger.slots);
+        logger.slots = NULL;
+        return false;
+    }
+    logger.running = true;
+    return true;
+}
+
+void logger_stop(void) {
+    if (!logger.running) {
+        return;
+    }
+    atomic_store(&logger.stopping, true);
+    wake_signal_force(&logger.wake);
+    pthread_join(logger.thread, NULL);
+    logger.running = false;
+    wake_signal_destroy(&logger.wake);
+    free(logger.slots);
+    logger.slots = NULL;
+}
+
+void logger_write(int level, const char *format, const LogArg *args, int arg_count) {
+    if (!logger.running) {
+        // Startup and shutdown: format right away
+        LogSlot slot;
+        char line[LOG_LINE_MAX];
+        logger_capture(&slot, level, format, args, arg_count);
+        fwrite(line, 1, logger_format(&slot, line, sizeof(line)), stdout);
+        fflush(stdout);
+        return;
+    }
+
+    const size_t mask = LOG_RING_SLOTS - 1;
+    size_t position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+    LogSlot *slot;
+    while (1) {
+        slot = &logger.slots[position & mask];
+        const size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        const intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger.tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full: the writer thread is behind; never block the caller
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+        }
+    }
+
+    logger_capture(slot, level, format, args, arg_count);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    // Only the first record since the writer last drained needs a wakeup
+    if (!wake_signal_pending(&logger.wake)) {
+        wake_signal_notify(&logger.wake);
+    }
+}
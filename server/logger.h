@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../common/protocol.h"
+
+/**
+ * Asynchronous leveled logger.
+ *
+ * A log call copies its format pointer and arguments into a slot of a
+ * lock-free ring and returns; a background thread formats the records and
+ * writes them to stdout. When the ring is full the record is dropped and
+ * counted rather than blocking the caller.
+ *
+ * Arguments are captured by type: integers, floating point values, pointers,
+ * C strings (copied) and StringViews (copied, printed by a plain %s). The
+ * format must be a string literal, since only its address is recorded.
+ */
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+
+// Calls below this level compile to nothing; set with -DCHAT_LOG_LEVEL=DEBUG|INFO|WARN|ERROR
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MAX_ARGS 8
+
+typedef enum {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING
+} LogArgType;
+
+// One captured argument
+typedef struct {
+    uint8_t type;   // LogArgType
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        StringView s;
+    };
+} LogArg;
+
+/**
+ * @brief Starts the thread that writes the records out. Until then, and
+ *        after logger_stop, log calls write synchronously.
+ * @return true on success, false if the ring or thread could not be created.
+ */
+bool logger_start(void);
+
+/**
+ * @brief Writes out every pending record and stops the thread.
+ */
+void logger_stop(void);
+
+/**
+ * @brief Records one message. Called through the LOG_* macros.
+ */
+void logger_write(int level, const char *format, const LogArg *args, int arg_count);
+
+static inline LogArg log_arg_int(long long value) { return (LogArg){ .type = LOG_ARG_INT, .i = value }; }
+static inline LogArg log_arg_uint(unsigned long long value) { return (LogArg){ .type = LOG_ARG_UINT, .u = value }; }
+static inline LogArg log_arg_double(double value) { return (LogArg){ .type = LOG_ARG_DOUBLE, .d = value }; }
+static inline LogArg log_arg_pointer(const void *value) { return (LogArg){ .type = LOG_ARG_POINTER, .p = value }; }
+static inline LogArg log_arg_string(const char *value) {
+    return (LogArg){ .type = LOG_ARG_STRING, .s = { value, value != NULL ? strlen(value) : 0 } };
+}
+static inline LogArg log_arg_view(StringView value) { return (LogArg){ .type = LOG_ARG_STRING, .s = value }; }
+
+#define LOG_ARG(x) _Generic((x),                                               \
+    char *: log_arg_string, const char *: log_arg_string,                      \
+    StringView: log_arg_view,                                                  \
+    float: log_arg_double, double: log_arg_double,                             \
+    _Bool: log_arg_int, char: log_arg_int, signed char: log_arg_int,           \
+    short: log_arg_int, int: log_arg_int, long: log_arg_int,                   \
+    long long: log_arg_int,                                                    \
+    unsigned char: log_arg_uint, unsigned short: log_arg_uint,                 \
+    unsigned int: log_arg_uint, unsigned long: log_arg_uint,                   \
+    unsigned long long: log_arg_uint,                                          \
+    default: log_arg_pointer)(x)
+
+// Argument count and list, for up to LOG_MAX_ARGS arguments
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_CAT_(a, b) a##b
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a) LOG_ARG(a),
+#define LOG_ARGS_2(a, ...) LOG_ARG(a), LOG_ARGS_1(__VA_ARGS__)
+#define LOG_ARGS_3(a, ...) LOG_ARG(a), LOG_ARGS_2(__VA_ARGS__)
+#define LOG_ARGS_4(a, ...) LOG_ARG(a), LOG_ARGS_3(__VA_ARGS__)
+#define LOG_ARGS_5(a, ...) LOG_ARG(a), LOG_ARGS_4(__VA_ARGS__)
+#define LOG_ARGS_6(a, ...) LOG_ARG(a), LOG_ARGS_5(__VA_ARGS__)
+#define LOG_ARGS_7(a, ...) LOG_ARG(a), LOG_ARGS_6(__VA_ARGS__)
+#define LOG_ARGS_8(a, ...) LOG_ARG(a), LOG_ARGS_7(__VA_ARGS__)
+
+#define LOG_AT(level, format, ...)                                                         \
+    logger_write((level), (format),                                                        \
+                 (const LogArg[]){ LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__) \
+                                   { .type = LOG_ARG_INT } },                              \
+                 LOG_NARGS(__VA_ARGS__))
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) ((void)0)
+#endif
+
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
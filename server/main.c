@@ -1,40 +1,204 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include "server.h"
 
 #define PORT 8080
 
-// The *only* global variable, for signal handling.
-volatile sig_atomic_t running = 1;
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --backend=epoll|io_uring  I/O backend (default: epoll)\n"
+            "  --threads=N               Worker threads, one listener each (default: 1)\n"
+            "  --output-budget=BYTES     Queued output per client before the slow-consumer\n"
+            "                            policy applies (default: %d, minimum: %zu)\n"
+            "  --slow-policy=POLICY      drop-oldest-chat|drop-non-control|disconnect\n"
+            "                            (default: drop-oldest-chat)\n"
+            "  --slow-grace=MS           Time a client may stay over budget under the\n"
+            "                            disconnect policy (default: %d)\n"
+            "  --flush-bytes=BYTES       Flush a client before the end of the loop\n"
+            "                            iteration once this much is queued (default: %d)\n"
+            "  --flush-budget-us=US      Flush all queued output early once an iteration\n"
+            "                            has run this long (default: %d)\n"
+            "  --max-clients=N           Preallocate N client slots per shard and refuse\n"
+            "                            connections beyond them (default: grow on demand)\n"
+            "  --presence-window=MS      Gather joins and leaves for this long and send\n"
+            "                            them as one update, 0 to send each at once\n"
+            "                            (default: %d)\n"
+            "  --ping-interval=MS        Ping clients that sent nothing for this long,\n"
+            "                            0 for no pings (default: %d)\n"
+            "  --idle-timeout=MS         Disconnect clients that sent nothing for this\n"
+            "                            long, 0 to keep them (default: %d)\n"
+            "  --backlog=N               Recent chat messages each room replays to clients\n"
+            "                            that join it, 0 for none (default: %d)\n"
+            "  --backlog-memory-mb=N     Memory for the backlogs of all rooms together;\n"
+            "                            the least recently used are dropped beyond it\n"
+            "                            (default: %d)\n"
+            "  --metrics-port=PORT       Serve Prometheus metrics on 127.0.0.1:PORT/metrics\n"
+            "  --metrics-socket=PATH     Serve them on a unix socket instead\n"
+            "  --log-dir=PATH            Keep every chat message in an append-only log\n"
+            "                            in this directory (default: no log)\n"
+            "  --log-segment-mb=N        Size of each log segment file (default: %d)\n"
+            "  --search-memory-mb=N      Keep a /search index of recent messages in this\n"
+            "                            much memory (default: no search)\n"
+            "  --help                    Show this help\n",
+            program, DEFAULT_OUTPUT_BUDGET, MIN_OUTPUT_BUDGET, DEFAULT_SLOW_GRACE_MS,
+            DEFAULT_FLUSH_BYTES, DEFAULT_FLUSH_BUDGET_US, DEFAULT_PRESENCE_WINDOW_MS,
+            DEFAULT_PING_INTERVAL_MS, DEFAULT_IDLE_TIMEOUT_MS,
+            DEFAULT_BACKLOG_FRAMES, DEFAULT_BACKLOG_MEMORY / (1024 * 1024), DEFAULT_LOG_SEGMENT_SIZE / (1024 * 1024));
+}
 
-/**
- * @brief Handles signals like CTRL+C (SIGINT) to allow graceful shutdown.
- */
-void signal_handler(int sig) {
-    if (sig == SIGINT) {
-        printf("\nSIGINT received, shutting down...\n");
-        running = 0;
+static bool parse_args(int argc, char **argv, ServerConfig *config) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--backend=epoll") == 0) {
+            config->backend = SERVER_BACKEND_EPOLL;
+        } else if (strcmp(argv[i], "--backend=io_uring") == 0) {
+            config->backend = SERVER_BACKEND_IO_URING;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            config->threads = atoi(argv[i] + 10);
+            if (config->threads < 1 || config->threads > MAX_SHARDS) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--output-budget=", 16) == 0) {
+            long long budget = atoll(argv[i] + 16);
+            if (budget < (long long)MIN_OUTPUT_BUDGET) {
+                return false;
+            }
+            config->output_budget = (size_t)budget;
+        } else if (strcmp(argv[i], "--slow-policy=drop-oldest-chat") == 0) {
+            config->slow_policy = SLOW_POLICY_DROP_OLDEST_CHAT;
+        } else if (strcmp(argv[i], "--slow-policy=drop-non-control") == 0) {
+            config->slow_policy = SLOW_POLICY_DROP_NON_CONTROL;
+        } else if (strcmp(argv[i], "--slow-policy=disconnect") == 0) {
+            config->slow_policy = SLOW_POLICY_DISCONNECT;
+        } else if (strncmp(argv[i], "--slow-grace=", 13) == 0) {
+            config->slow_grace_ms = atoi(argv[i] + 13);
+            if (config->slow_grace_ms < 0) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--flush-bytes=", 14) == 0) {
+            long long bytes = atoll(argv[i] + 14);
+            if (bytes < 1) {
+                return false;
+            }
+            config->flush_bytes = (size_t)bytes;
+        } else if (strncmp(argv[i], "--flush-budget-us=", 18) == 0) {
+            config->flush_budget_us = atoi(argv[i] + 18);
+            if (config->flush_budget_us < 0) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--max-clients=", 14) == 0) {
+            config->max_clients = atoi(argv[i] + 14);
+            if (config->max_clients < 1 || config->max_clients > MAX_CLIENT_SLOTS) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--presence-window=", 18) == 0) {
+            config->presence_window_ms = atoi(argv[i] + 18);
+            if (config->presence_window_ms < 0) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--ping-interval=", 16) == 0) {
+            config->ping_interval_ms = atoi(argv[i] + 16);
+            if (config->ping_interval_ms < 0) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--idle-timeout=", 15) == 0) {
+            config->idle_timeout_ms = atoi(argv[i] + 15);
+            if (config->idle_timeout_ms < 0) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--backlog=", 10) == 0) {
+            config->backlog_frames = atoi(argv[i] + 10);
+            if (config->backlog_frames < 0 || config->backlog_frames > MAX_BACKLOG_FRAMES) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--backlog-memory-mb=", 20) == 0) {
+            long long megabytes = atoll(argv[i] + 20);
+            if (megabytes < 1 || megabytes > 65536) {
+                return false;
+            }
+            config->backlog_memory = (size_t)megabytes * 1024 * 1024;
+        } else if (strncmp(argv[i], "--metrics-port=", 15) == 0) {
+            config->metrics_port = atoi(argv[i] + 15);
+            if (config->metrics_port < 1 || config->metrics_port > 65535) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--metrics-socket=", 17) == 0) {
+            config->metrics_socket = argv[i] + 17;
+            if (config->metrics_socket[0] == '\0') {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--log-dir=", 10) == 0) {
+            config->log_dir = argv[i] + 10;
+            if (config->log_dir[0] == '\0') {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--log-segment-mb=", 17) == 0) {
+            long long megabytes = atoll(argv[i] + 17);
+            if (megabytes < MIN_LOG_SEGMENT_SIZE / (1024 * 1024) || megabytes > 4096) {
+                return false;
+            }
+            config->log_segment_size = (size_t)megabytes * 1024 * 1024;
+        } else if (strncmp(argv[i], "--search-memory-mb=", 19) == 0) {
+            long long megabytes = atoll(argv[i] + 19);
+            if (megabytes < 0 || megabytes > 65536) {
+                return false;
+            }
+            config->search_memory = (size_t)megabytes * 1024 * 1024;
+        } else {
+            return false;
+        }
     }
+    return true;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     signal(SIGPIPE, SIG_IGN);
 
-    signal(SIGINT, signal_handler);
+    ServerConfig config = {
+        .port = PORT,
+        .backend = SERVER_BACKEND_EPOLL,
+        .threads = 1,
+        .output_budget = DEFAULT_OUTPUT_BUDGET,
+        .slow_policy = SLOW_POLICY_DROP_OLDEST_CHAT,
+        .slow_grace_ms = DEFAULT_SLOW_GRACE_MS,
+        .flush_bytes = DEFAULT_FLUSH_BYTES,
+        .flush_budget_us = DEFAULT_FLUSH_BUDGET_US,
+        .max_clients = 0,
+        .presence_window_ms = DEFAULT_PRESENCE_WINDOW_MS,
+        .ping_interval_ms = DEFAULT_PING_INTERVAL_MS,
+        .idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS,
+        .backlog_frames = DEFAULT_BACKLOG_FRAMES,
+        .backlog_memory = DEFAULT_BACKLOG_MEMORY,
+        .metrics_port = 0,
+        .metrics_socket = NULL,
+        .log_dir = NULL,
+        .log_segment_size = DEFAULT_LOG_SEGMENT_SIZE,
+        .search_memory = 0
+    };
+    if (!parse_args(argc, argv, &config)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
-    Server server = {0};
+    // Log calls write synchronously if the background writer cannot start
+    logger_start();
 
-    if (!server_init(&server, PORT)) {
+    // SIGINT/SIGTERM are handled inside the event loop via signalfd
+    ServerGroup group = {0};
+
+    if (!server_group_init(&group, &config)) {
         fprintf(stderr, "Failed to initialize server.\n");
+        server_group_shutdown(&group);
+        logger_stop();
         exit(EXIT_FAILURE);
     }
 
-    while (running) {
-        server_poll_events(&server);
-    }
+    const bool ran = server_group_run(&group);
 
-    server_shutdown(&server);
+    server_group_shutdown(&group);
+    logger_stop();
 
-    return 0;
+    return ran ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,815 @@
+#include "message_log.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "../common/protocol.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESSAGE_LOG_NAME_DIGITS 20
+#define MESSAGE_LOG_COMMIT_BYTES (4 * 1024 * 1024)  // Written before an fdatasync() even if more is queued
+
+static size_t message_log_record_size(size_t len) {
+    return sizeof(LogRecordHeader) + ((len + 7) & ~(size_t)7);
+}
+
+static uint32_t message_log_record_crc(const LogRecordHeader *header, const uint8_t *frame) {
+    uint32_t crc = crc32c(0, &header->len, sizeof(header->len));
+    crc = crc32c(crc, &header->room, sizeof(header->room) + sizeof(header->time));
+    return crc32c(crc, frame, header->len);
+}
+
+static void message_log_segment_path(const MessageLog *log, uint64_t base, char *path, size_t size) {
+    snprintf(path, size, "%s/%0*llu.log", log->dir, MESSAGE_LOG_NAME_DIGITS, (unsigned long long)base);
+}
+
+static void message_log_index_path(const MessageLog *log, uint64_t base, char *path, size_t size) {
+    snprintf(path, size, "%s/%0*llu.idx", log->dir, MESSAGE_LOG_NAME_DIGITS, (unsigned long long)base);
+}
+
+static double message_log_elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1000.0 + (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Segments
+
+// Creates, preallocates and syncs a segment and makes it the active one
+static bool message_log_create_segment(MessageLog *log, uint64_t base) {
+    char path[4096];
+    message_log_segment_path(log, base, path, sizeof(path));
+    const int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    // Filesystems without fallocate get a sparse file of the same size
+    int err = posix_fallocate(fd, 0, (off_t)log->segment_size);
+    if ((err == EOPNOTSUPP || err == EINVAL) && ftruncate(fd, (off_t)log->segment_size) == 0) {
+        err = 0;
+    }
+    if (err != 0) {
+        LOG_ERROR("allocate %s: %s", path, strerror(err));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    uint8_t header[MESSAGE_LOG_SEGMENT_HEADER];
+    memcpy(header, MESSAGE_LOG_MAGIC, 8);
+    memcpy(header + 8, &base, sizeof(base));
+    if (pwrite(fd, header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) < 0 || fsync(log->dir_fd) < 0) {
+        LOG_ERROR("write %s: %s", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    log->fd = fd;
+    log->segment_base = base;
+    log->segment_end = MESSAGE_LOG_SEGMENT_HEADER;
+    log->segment_capacity = log->segment_size;
+    return true;
+}
+
+// Walks the records of a mapped segment and returns where the valid ones end.
+// Records are added to index unless it is NULL.
+static size_t message_log_scan(const uint8_t *map, size_t size, uint64_t *records, LogIndexBuilder *index) {
+    size_t pos = MESSAGE_LOG_SEGMENT_HEADER;
+    while (pos + sizeof(LogRecordHeader) <= size) {
+        LogRecordHeader header;
+        memcpy(&header, map + pos, sizeof(header));
+        if (header.len == 0) {
+            break;
+        }
+        const size_t record = message_log_record_size(header.len);
+        if (record > size - pos ||
+            message_log_record_crc(&header, map + pos + sizeof(header)) != header.crc) {
+            break;
+        }
+        if (index != NULL) {
+            log_index_add(index, header.room, header.time, pos);
+        }
+        pos += record;
+        (*records)++;
+    }
+    return pos;
+}
+
+static int message_log_compare_bases(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Lists the segment bases in the directory, oldest first
+static bool message_log_list_segments(MessageLog *log, uint64_t **bases, int *count) {
+    DIR *dir = opendir(log->dir);
+    if (dir == NULL) {
+        LOG_ERROR("opendir %s: %s", log->dir, strerror(errno));
+        return false;
+    }
+    int capacity = 0;
+    *bases = NULL;
+    *count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strlen(name) != MESSAGE_LOG_NAME_DIGITS + 4 || strcmp(name + MESSAGE_LOG_NAME_DIGITS, ".log") != 0 ||
+            strspn(name, "0123456789") != MESSAGE_LOG_NAME_DIGITS) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            uint64_t *grown = realloc(*bases, (size_t)capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                LOG_ERROR("Failed to allocate segment list");
+                closedir(dir);
+                return false;
+            }
+            *bases = grown;
+        }
+        (*bases)[(*count)++] = strtoull(name, NULL, 10);
+    }
+    closedir(dir);
+    if (*count > 1) {
+        qsort(*bases, (size_t)*count, sizeof(uint64_t), message_log_compare_bases);
+    }
+    return true;
+}
+
+// Adds a full segment to the ones history queries read, taking over its room
+// set. Called with index_lock held once the writer has started.
+static bool message_log_add_sealed(MessageLog *log, uint64_t base, uint64_t end, uint64_t max_time,
+                                   uint64_t *rooms, uint32_t room_count) {
+    if (log->sealed_count == log->sealed_capacity) {
+        const int capacity = log->sealed_capacity == 0 ? 16 : log->sealed_capacity * 2;
+        LogSegment *grown = realloc(log->sealed, (size_t)capacity * sizeof(LogSegment));
+        if (grown == NULL) {
+            LOG_ERROR("Failed to allocate segment list");
+            free(rooms);
+            return false;
+        }
+        log->sealed = grown;
+        log->sealed_capacity = capacity;
+    }
+    const uint64_t previous = log->sealed_count > 0 ? log->sealed[log->sealed_count - 1].max_time : 0;
+    log->sealed[log->sealed_count++] = (LogSegment){
+        .base = base,
+        .end = end,
+        .max_time = max_time > previous ? max_time : previous,
+        .rooms = rooms,
+        .room_count = room_count
+    };
+    return true;
+}
+
+// Whether a sealed segment may hold records of the room
+static bool message_log_segment_has(const LogSegment *segment, uint64_t room) {
+    if (segment->rooms == NULL) {
+        return true;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = segment->room_count;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (segment->rooms[mid] < room) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < segment->room_count && segment->rooms[lo] == room;
+}
+
+// Checks a sealed segment's records and makes sure its index file matches
+// them, rebuilding it if needed. Returns where the records end.
+static size_t message_log_recover_sealed(MessageLog *log, uint64_t base, const uint8_t *map, size_t size,
+                                         uint64_t *records) {
+    char path[4096];
+    message_log_index_path(log, base, path, sizeof(path));
+    uint64_t scanned = 0;
+    LogIndexMap index_map;
+    if (log_index_map(&index_map, path)) {
+        const size_t end = message_log_scan(map, size, &scanned, NULL);
+        const bool current = index_map.header->end == end;
+        const uint64_t max_time = index_map.header->max_time;
+        uint32_t room_count = 0;
+        uint64_t *rooms = current ? log_index_map_keys(&index_map, &room_count) : NULL;
+        log_index_unmap(&index_map);
+        if (current) {
+            *records += scanned;
+            message_log_add_sealed(log, base, end, max_time, rooms, room_count);
+            return end;
+        }
+        scanned = 0;
+    }
+
+    // Missing, damaged or stale: build it again while scanning
+    LOG_INFO("Rebuilding index %s", path);
+    LogIndexBuilder index;
+    log_index_init(&index);
+    const size_t end = message_log_scan(map, size, &scanned, &index);
+    *records += scanned;
+    uint64_t max_time = index.max_time;
+    if (log->sealed_count > 0 && log->sealed[log->sealed_count - 1].max_time > max_time) {
+        max_time = log->sealed[log->sealed_count - 1].max_time;
+    }
+    log_index_write(&index, path, end, max_time);
+    uint32_t room_count;
+    uint64_t *rooms = log_index_keys(&index, &room_count);
+    log_index_clear(&index);
+    message_log_add_sealed(log, base, end, max_time, rooms, room_count);
+    return end;
+}
+
+// Maps one segment and scans it. The last segment stays open as the active one,
+// with everything after its last valid record cleared.
+static bool message_log_recover_segment(MessageLog *log, uint64_t base, bool last, uint64_t *records) {
+    char path[4096];
+    message_log_segment_path(log, base, path, sizeof(path));
+    const int fd = open(path, (last ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("open %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOG_ERROR("fstat %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    const size_t size = (size_t)st.st_size;
+
+    uint64_t header_base = 0;
+    size_t end = 0;
+    if (size >= MESSAGE_LOG_SEGMENT_HEADER) {
+        uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            LOG_ERROR("mmap %s: %s", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        memcpy(&header_base, map + 8, sizeof(header_base));
+        if (memcmp(map, MESSAGE_LOG_MAGIC, 8) != 0 || header_base != base) {
+            end = 0;
+        } else if (last) {
+            end = message_log_scan(map, size, records, &log->index);
+        } else {
+            end = message_log_recover_sealed(log, base, map, size, records);
+        }
+        munmap(map, size);
+    }
+
+    if (end == 0) {
+        // Only a crash while creating the newest segment leaves one without a header
+        if (!last) {
+            LOG_ERROR("%s is not a message log segment", path);
+            close(fd);
+            return false;
+        }
+        LOG_WARN("Recreating incomplete segment %s", path);
+        close(fd);
+        unlink(path);
+        return message_log_create_segment(log, base);
+    }
+
+    if (!last) {
+        if (end + sizeof(LogRecordHeader) <= size) {
+            uint32_t len;
+            if (pread(fd, &len, sizeof(len), (off_t)end) == sizeof(len) && len != 0) {
+                LOG_WARN("%s is damaged at offset %zu; later records in it are skipped", path, end);
+            }
+        }
+        close(fd);
+        return true;
+    }
+
+    // Cut the tail so that neither a torn record nor data from before it can
+    // resurface after the records appended next, then allocate it again
+    if (ftruncate(fd, (off_t)end) < 0 || ftruncate(fd, (off_t)size) < 0) {
+        LOG_ERROR("truncate %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    posix_fallocate(fd, (off_t)end, (off_t)(size - end));
+    if (fdatasync(fd) < 0) {
+        LOG_ERROR("fdatasync %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    log->fd = fd;
+    log->segment_base = base;
+    log->segment_end = end;
+    log->segment_capacity = size;
+    return true;
+}
+
+// Writer thread
+
+static bool message_log_pwritev(int fd, struct iovec *iov, int count, off_t offset) {
+    while (count > 0) {
+        const ssize_t written = pwritev(fd, iov, count, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += written;
+        size_t remaining = (size_t)written;
+        while (count > 0 && remaining >= iov->iov_len) {
+            remaining -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + remaining;
+            iov->iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+// Writes gathered records at the end of the active segment and indexes them
+static void message_log_flush(MessageLog *log, LogEntry **entries, struct iovec *iov, int count, size_t bytes) {
+    if (count == 0) {
+        return;
+    }
+    if (!message_log_pwritev(log->fd, iov, count, (off_t)log->segment_end)) {
+        LOG_ERROR("message log write: %s", strerror(errno));
+        atomic_fetch_add(&log->dropped, (uint64_t)count);
+        return;
+    }
+
+    pthread_mutex_lock(&log->index_lock);
+    size_t offset = log->segment_end;
+    for (int i = 0; i < count; i++) {
+        if (!log_index_add(&log->index, entries[i]->header.room, entries[i]->header.time, offset)) {
+            LOG_ERROR("Failed to allocate log index entry");
+        }
+        offset += entries[i]->size;
+    }
+    log->segment_end += bytes;
+    log->active_end = log->segment_end;
+    pthread_mutex_unlock(&log->index_lock);
+    atomic_fetch_add(&log->records, (uint64_t)count);
+}
+
+static void message_log_sync(MessageLog *log) {
+    if (log->fd < 0) {
+        return;
+    }
+    if (fdatasync(log->fd) < 0) {
+        LOG_ERROR("message log fdatasync: %s", strerror(errno));
+        return;
+    }
+    atomic_fetch_add(&log->commits, 1);
+    atomic_store(&log->durable, log->segment_base + log->segment_end);
+}
+
+// Seals the active segment and starts the next one where it ended
+static void message_log_roll(MessageLog *log) {
+    const uint64_t base = log->segment_base + log->segment_end;
+    if (log->fd >= 0) {
+        message_log_sync(log);
+        close(log->fd);
+        log->fd = -1;
+
+        // Only this thread changes the index, so it can be written out unlocked
+        char path[4096];
+        message_log_index_path(log, log->segment_base, path, sizeof(path));
+        uint64_t max_time = log->index.max_time;
+        if (log->sealed_count > 0 && log->sealed[log->sealed_count - 1].max_time > max_time) {
+            max_time = log->sealed[log->sealed_count - 1].max_time;
+        }
+        log_index_write(&log->index, path, log->segment_end, max_time);
+        uint32_t room_count;
+        uint64_t *rooms = log_index_keys(&log->index, &room_count);
+
+        pthread_mutex_lock(&log->index_lock);
+        message_log_add_sealed(log, log->segment_base, log->segment_end, max_time, rooms, room_count);
+        log_index_clear(&log->index);
+        log->active_base = base;
+        log->active_end = MESSAGE_LOG_SEGMENT_HEADER;
+        pthread_mutex_unlock(&log->index_lock);
+    }
+    message_log_create_segment(log, base);
+}
+
+// Writes a batch of entries, rolling segments as they fill, and frees them
+static void message_log_write(MessageLog *log, LogEntry **entries, int count) {
+    struct iovec iov[MESSAGE_LOG_BATCH_IOV];
+    LogEntry *gathered[MESSAGE_LOG_BATCH_IOV];
+    int iov_count = 0;
+    size_t bytes = 0;
+    size_t freed = 0;
+    for (int i = 0; i < count; i++) {
+        LogEntry *entry = entries[i];
+        if (log->fd < 0 || log->segment_end + bytes + entry->size > log->segment_capacity) {
+            message_log_flush(log, gathered, iov, iov_count, bytes);
+            iov_count = 0;
+            bytes = 0;
+            message_log_roll(log);
+        }
+        if (log->fd < 0) {
+            atomic_fetch_add(&log->dropped, 1);
+            continue;
+        }
+        gathered[iov_count] = entry;
+        iov[iov_count].iov_base = &entry->header;
+        iov[iov_count].iov_len = entry->size;
+        iov_count++;
+        bytes += entry->size;
+    }
+    message_log_flush(log, gathered, iov, iov_count, bytes);
+
+    for (int i = 0; i < count; i++) {
+        freed += entries[i]->size;
+        free(entries[i]);
+    }
+    atomic_fetch_sub(&log->pending_bytes, freed);
+}
+
+static void *message_log_thread_main(void *arg) {
+    MessageLog *log = arg;
+    LogEntry *batch[MESSAGE_LOG_BATCH_IOV];
+    while (1) {
+        const bool stopping = atomic_load(&log->stopping);
+        wake_signal_clear(&log->queue.wake);
+
+        // Everything queued so far shares one fdatasync()
+        size_t uncommitted = 0;
+        int count = 0;
+        MpscNode *node;
+        while (uncommitted < MESSAGE_LOG_COMMIT_BYTES && (node = wake_queue_pop(&log->queue)) != NULL) {
+            LogEntry *entry = (LogEntry *)node;
+            uncommitted += entry->size;
+            batch[count++] = entry;
+            if (count == MESSAGE_LOG_BATCH_IOV) {
+                message_log_write(log, batch, count);
+                count = 0;
+            }
+        }
+        message_log_write(log, batch, count);
+        if (uncommitted > 0) {
+            message_log_sync(log);
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        wake_signal_wait(&log->queue.wake, -1);
+    }
+    return NULL;
+}
+
+// Reader thread
+
+static void message_log_answer(MessageLog *log, const LogQuery *query) {
+    const size_t capacity = (size_t)query->count * MAX_MESSAGE_SIZE;
+    uint8_t *frames = malloc(capacity);
+    if (frames == NULL) {
+        LOG_ERROR("Failed to allocate %zu byte history buffer", capacity);
+        return;
+    }
+    size_t len;
+    const int found = message_log_history(log, message_log_room_key(query->room, strlen(query->room)),
+                                          query->from, query->count, frames, capacity, &len);
+    log->reply(log->reply_context, query->shard, query->reply_to, query->room, frames, len, found);
+    free(frames);
+}
+
+static void *message_log_reader_main(void *arg) {
+    MessageLog *log = arg;
+    while (1) {
+        wake_signal_clear(&log->queries.wake);
+        MpscNode *node;
+        while ((node = wake_queue_pop(&log->queries)) != NULL) {
+            if (!atomic_load(&log->stopping)) {
+                message_log_answer(log, (LogQuery *)node);
+            }
+            atomic_fetch_sub(&log->pending_queries, 1);
+            free(node);
+        }
+        if (atomic_load(&log->stopping)) {
+            break;
+        }
+        wake_signal_wait(&log->queries.wake, -1);
+    }
+    return NULL;
+}
+
+// Public API
+
+bool message_log_open(MessageLog *log, const char *dir, size_t segment_size, MessageLogReplyFn reply, void *context) {
+    log->dir = NULL;
+    log->segment_size = segment_size < MIN_LOG_SEGMENT_SIZE ? MIN_LOG_SEGMENT_SIZE : segment_size;
+    log->fd = -1;
+    log->segment_base = 0;
+    log->segment_end = 0;
+    log->segment_capacity = 0;
+    log->dir_fd = -1;
+    log->queue.wake.fd = -1;
+    atomic_init(&log->pending_bytes, 0);
+    log->running = false;
+    atomic_init(&log->stopping, false);
+    log->reply = reply;
+    log->reply_context = context;
+    log->queries.wake.fd = -1;
+    atomic_init(&log->pending_queries, 0);
+    log->reader_running = false;
+    atomic_init(&log->records, 0);
+    atomic_init(&log->commits, 0);
+    atomic_init(&log->dropped, 0);
+    atomic_init(&log->durable, 0);
+    pthread_mutex_init(&log->index_lock, NULL);
+    log->sealed = NULL;
+    log->sealed_count = 0;
+    log->sealed_capacity = 0;
+    log_index_init(&log->index);
+    log->active_base = 0;
+    log->active_end = 0;
+
+    log->dir = strdup(dir);
+    if (log->dir == NULL) {
+        LOG_ERROR("Failed to allocate message log path");
+        return false;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        LOG_ERROR("mkdir %s: %s", dir, strerror(errno));
+        return false;
+    }
+    log->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (log->dir_fd < 0) {
+        LOG_ERROR("open %s: %s", dir, strerror(errno));
+        return false;
+    }
+    if (!wake_queue_init(&log->queue) || !wake_queue_init(&log->queries)) {
+        return false;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t *bases;
+    int count;
+    if (!message_log_list_segments(log, &bases, &count)) {
+        return false;
+    }
+    uint64_t records = 0;
+    for (int i = 0; i < count; i++) {
+        if (!message_log_recover_segment(log, bases[i], i == count - 1, &records)) {
+            free(bases);
+            return false;
+        }
+    }
+    free(bases);
+
+    if (log->fd < 0 && !message_log_create_segment(log, 0)) {
+        return false;
+    }
+    log->active_base = log->segment_base;
+    log->active_end = log->segment_end;
+    atomic_store(&log->records, records);
+    atomic_store(&log->durable, log->segment_base + log->segment_end);
+    LOG_INFO("Message log %s: recovered %llu records (%llu bytes) from %d segments in %.1f ms",
+             dir, (unsigned long long)records, (unsigned long long)(log->segment_base + log->segment_end),
+             count, message_log_elapsed_ms(&start));
+    return true;
+}
+
+bool message_log_start(MessageLog *log) {
+    int err = pthread_create(&log->thread, NULL, message_log_thread_main, log);
+    if (err != 0) {
+        LOG_ERROR("pthread_create message log: %s", strerror(err));
+        return false;
+    }
+    log->running = true;
+    err = pthread_create(&log->reader, NULL, message_log_reader_main, log);
+    if (err != 0) {
+        LOG_ERROR("pthread_create message log reader: %s", strerror(err));
+        return false;
+    }
+    log->reader_running = true;
+    return true;
+}
+
+bool message_log_append(MessageLog *log, uint64_t room, uint64_t time, const uint8_t *frame, size_t len) {
+    const size_t size = message_log_record_size(len);
+    if (atomic_fetch_add(&log->pending_bytes, size) + size > MESSAGE_LOG_MAX_PENDING) {
+        atomic_fetch_sub(&log->pending_bytes, size);
+        atomic_fetch_add(&log->dropped, 1);
+        return false;
+    }
+    LogEntry *entry = malloc(offsetof(LogEntry, header) + size);
+    if (entry == NULL) {
+        atomic_fetch_sub(&log->pending_bytes, size);
+        atomic_fetch_add(&log->dropped, 1);
+        return false;
+    }
+    entry->size = size;
+    entry->header.len = (uint32_t)len;
+    entry->header.room = room;
+    entry->header.time = time;
+    memcpy(entry->frame, frame, len);
+    memset(entry->frame + len, 0, size - sizeof(LogRecordHeader) - len);
+    entry->header.crc = message_log_record_crc(&entry->header, entry->frame);
+
+    wake_queue_push(&log->queue, &entry->node);
+    return true;
+}
+
+bool message_log_query(MessageLog *log, const char *room, uint64_t from, int count, int shard, uint64_t reply_to) {
+    if (atomic_fetch_add(&log->pending_queries, 1) >= MESSAGE_LOG_MAX_QUERIES) {
+        atomic_fetch_sub(&log->pending_queries, 1);
+        return false;
+    }
+    const size_t room_len = strlen(room);
+    LogQuery *query = malloc(sizeof(LogQuery) + room_len + 1);
+    if (query == NULL) {
+        atomic_fetch_sub(&log->pending_queries, 1);
+        return false;
+    }
+    query->from = from;
+    query->count = count;
+    query->shard = shard;
+    query->reply_to = reply_to;
+    memcpy(query->room, room, room_len + 1);
+    wake_queue_push(&log->queries, &query->node);
+    return true;
+}
+
+// Copies the room's frames from the blocks the entries point at, stopping
+// after `want` frames or once out is full
+static int message_log_read_blocks(const uint8_t *map, size_t end, const LogIndexEntry *entries, uint32_t count,
+                                   uint64_t room, uint64_t from, int want,
+                                   uint8_t *out, size_t capacity, size_t *used) {
+    int found = 0;
+    for (uint32_t i = 0; i < count && found < want; i++) {
+        size_t pos = entries[i].offset;
+        const size_t block_end = (pos / LOG_INDEX_BLOCK + 1) * LOG_INDEX_BLOCK;
+        while (pos < block_end && pos + sizeof(LogRecordHeader) <= end && found < want) {
+            LogRecordHeader header;
+            memcpy(&header, map + pos, sizeof(header));
+            const size_t record = message_log_record_size(header.len);
+            if (header.len == 0 || record > end - pos) {
+                break;
+            }
+            if (header.room == room && header.time >= from) {
+                if (header.len > capacity - *used) {
+                    return found;
+                }
+                memcpy(out + *used, map + pos + sizeof(header), header.len);
+                *used += header.len;
+                found++;
+            }
+            pos += record;
+        }
+    }
+    return found;
+}
+
+int message_log_history(MessageLog *log, uint64_t room, uint64_t from, int count,
+                        uint8_t *out, size_t capacity, size_t *used) {
+    *used = 0;
+    int found = 0;
+
+    // Segments are ordered by their running maximum time: skip those that
+    // only hold earlier messages
+    pthread_mutex_lock(&log->index_lock);
+    int lo = 0;
+    int hi = log->sealed_count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if (log->sealed[mid].max_time < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    pthread_mutex_unlock(&log->index_lock);
+
+    LogIndexEntry *copy = NULL;
+    for (int i = lo; found < count; i++) {
+        // Each block pointed at holds at least one of the room's frames, except
+        // perhaps the first, so one more entry than frames wanted is enough
+        const uint32_t wanted_entries = (uint32_t)(count - found) + 1;
+        LogSegment segment;
+        const LogIndexEntry *entries = NULL;
+        uint32_t entry_count = 0;
+        LogIndexMap index_map = { .data = NULL };
+        bool active = false;
+        bool skip = false;
+
+        pthread_mutex_lock(&log->index_lock);
+        if (i < log->sealed_count) {
+            segment = log->sealed[i];
+            skip = !message_log_segment_has(&segment, room);
+        } else {
+            active = true;
+            segment = (LogSegment){ .base = log->active_base, .end = log->active_end };
+            const LogIndexEntry *room_entries = log_index_room(&log->index, room, &entry_count);
+            if (room_entries != NULL) {
+                const uint32_t start = log_index_seek(room_entries, entry_count, from);
+                entry_count -= start;
+                if (entry_count > wanted_entries) {
+                    entry_count = wanted_entries;
+                }
+                copy = malloc(entry_count * sizeof(LogIndexEntry));
+                if (copy != NULL) {
+                    memcpy(copy, room_entries + start, entry_count * sizeof(LogIndexEntry));
+                    entries = copy;
+                }
+            }
+        }
+        pthread_mutex_unlock(&log->index_lock);
+
+        if (skip) {
+            continue;
+        }
+
+        char path[4096];
+        if (!active) {
+            message_log_index_path(log, segment.base, path, sizeof(path));
+            if (log_index_map(&index_map, path)) {
+                entries = log_index_map_room(&index_map, room, &entry_count);
+                if (entries != NULL) {
+                    const uint32_t start = log_index_seek(entries, entry_count, from);
+                    entries += start;
+                    entry_count -= start;
+                }
+            }
+        }
+
+        if (entries != NULL && entry_count > 0) {
+            message_log_segment_path(log, segment.base, path, sizeof(path));
+            const int fd = open(path, O_RDONLY | O_CLOEXEC);
+            uint8_t *map = fd >= 0 ? mmap(NULL, segment.end, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (map != MAP_FAILED) {
+                madvise(map, segment.end, MADV_RANDOM);
+                found += message_log_read_blocks(map, segment.end, entries, entry_count, room, from,
+                                                 count - found, out, capacity, used);
+                munmap(map, segment.end);
+            } else {
+                LOG_ERROR("map %s: %s", path, strerror(errno));
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        log_index_unmap(&index_map);
+        if (active) {
+            break;
+        }
+    }
+    free(copy);
+    return found;
+}
+
+void message_log_close(MessageLog *log) {
+    if (log->dir == NULL) {
+        return;
+    }
+    atomic_store(&log->stopping, true);
+    if (log->reader_running) {
+        wake_signal_force(&log->queries.wake);
+        pthread_join(log->reader, NULL);
+        log->reader_running = false;
+    }
+    if (log->running) {
+        wake_signal_force(&log->queue.wake);
+        pthread_join(log->thread, NULL);
+        log->running = false;
+    }
+    wake_queue_destroy(&log->queries);
+    wake_queue_destroy(&log->queue);
+    if (log->fd >= 0) {
+        close(log->fd);
+        log->fd = -1;
+    }
+    if (log->dir_fd >= 0) {
+        close(log->dir_fd);
+        log->dir_fd = -1;
+    }
+    for (int i = 0; i < log->sealed_count; i++) {
+        free(log->sealed[i].rooms);
+    }
+    free(log->sealed);
+    log->sealed = NULL;
+    log->sealed_count = 0;
+    log_index_clear(&log->index);
+    pthread_mutex_destroy(&log->index_lock);
+    free(log->dir);
+    log->dir = NULL;
+}
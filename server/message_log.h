@@ -0,0 +1,200 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "wake_queue.h"
+#include "log_index.h"
+#include "name_hash.h"
+
+#define MESSAGE_LOG_MAGIC "CHATLOG1"
+#define MESSAGE_LOG_SEGMENT_HEADER 16             // Magic, then the segment's base offset
+#define DEFAULT_LOG_SEGMENT_SIZE (64 * 1024 * 1024)
+#define MIN_LOG_SEGMENT_SIZE (1024 * 1024)
+#define MESSAGE_LOG_MAX_PENDING (64 * 1024 * 1024)  // Bytes queued for the writer before appends are dropped
+#define MESSAGE_LOG_BATCH_IOV 256                 // Records gathered into one pwritev()
+#define MESSAGE_LOG_MAX_QUERIES 64                // History queries queued before more are refused
+
+/**
+ * Append-only log of chat frames on disk.
+ *
+ * The log is a directory of fixed-size segment files, each named after the
+ * log offset of its first byte. A segment holds a header and then records
+ * back to back, each padded to 8 bytes; a zero length ends the records.
+ * Segments are preallocated, so a record write never grows the file.
+ *
+ * Shards append from their own threads without blocking: the record is
+ * queued for a writer thread, which writes everything queued with one
+ * pwritev() and makes it durable with one fdatasync() (group commit).
+ * On startup the segments are mapped and walked record by record; frames are
+ * only checksummed, never parsed.
+ *
+ * Each segment has a sparse index (see log_index.h): the active one in
+ * memory, sealed ones in a file written when the segment fills up. History
+ * queries binary search it and read only the blocks it points at. They run on
+ * a reader thread of their own, and a sealed segment's index is only opened
+ * if the set of rooms kept in memory for it has the room.
+ */
+
+// On-disk record header. The frame follows, then zero padding to 8 bytes.
+typedef struct {
+    uint32_t len;    // Frame length; 0 marks the end of the segment's records
+    uint32_t crc;    // CRC32C of the other fields and the frame
+    uint64_t room;   // message_log_room_key of the room the message was posted to
+    uint64_t time;   // Server wall clock when the message arrived, in ms since the epoch
+} LogRecordHeader;
+
+// A record waiting for the writer thread
+typedef struct {
+    MpscNode node;   // Must be first
+    size_t size;     // Header, frame and padding
+    LogRecordHeader header;
+    uint8_t frame[];
+} LogEntry;
+
+// A history query waiting for the reader thread
+typedef struct {
+    MpscNode node;   // Must be first
+    uint64_t from;
+    int count;
+    int shard;       // Where the reply goes
+    uint64_t reply_to;
+    char room[];     // Room name, NUL-terminated
+} LogQuery;
+
+// A segment that is full and no longer written
+typedef struct {
+    uint64_t base;
+    uint64_t end;        // End of its records, from the segment start
+    uint64_t max_time;   // Latest arrival time in it and every earlier segment
+    uint64_t *rooms;     // Keys of the rooms with records in it, ascending; NULL if not known
+    uint32_t room_count;
+} LogSegment;
+
+/**
+ * Called on the reader thread with the result of a history query: the room
+ * name, then the frames found back to back, oldest first, as stored.
+ */
+typedef void (*MessageLogReplyFn)(void *context, int shard, uint64_t reply_to, const char *room,
+                                  const uint8_t *frames, size_t len, int found);
+
+typedef struct {
+    char *dir;
+    size_t segment_size;   // Size of new segments
+
+    // Active segment, touched only by the writer thread once started
+    int fd;
+    uint64_t segment_base;  // Log offset of the segment's first byte
+    size_t segment_end;     // Bytes used, header included
+    size_t segment_capacity;
+    int dir_fd;             // fsync'd after a segment is created
+
+    // Producers
+    WakeQueue queue;
+    _Atomic size_t pending_bytes;
+
+    // What history queries read: sealed segments and the active segment's index.
+    // Changed by the writer thread under index_lock.
+    pthread_mutex_t index_lock;
+    LogSegment *sealed;
+    int sealed_count;
+    int sealed_capacity;
+    LogIndexBuilder index;   // Of the active segment
+    uint64_t active_base;
+    size_t active_end;       // Bytes written to the active segment
+
+    pthread_t thread;
+    bool running;
+    atomic_bool stopping;
+
+    // History queries, answered on the reader thread
+    MessageLogReplyFn reply;
+    void *reply_context;
+    WakeQueue queries;
+    _Atomic int pending_queries;
+    pthread_t reader;
+    bool reader_running;
+
+    // Statistics, written by the writer thread (dropped by producers)
+    _Atomic uint64_t records;    // In the log, recovered ones included
+    _Atomic uint64_t commits;    // fdatasync() calls
+    _Atomic uint64_t dropped;    // Appends refused while the writer was behind or failing
+    _Atomic uint64_t durable;    // Log offset up to which every record is on disk
+} MessageLog;
+
+/**
+ * @brief Key a record is filed under for a room name.
+ */
+static inline uint64_t message_log_room_key(const char *name, size_t len) {
+    return name_hash64(name, len);
+}
+
+/**
+ * @brief Opens the log in dir, creating the directory if needed, and recovers
+ *        it: every segment is scanned and a torn tail is cut off.
+ * @param log The MessageLog to initialize.
+ * @param dir Directory holding the segments.
+ * @param segment_size Size of each new segment file.
+ * @param reply Called on the reader thread with each history query's result.
+ * @param context Passed to reply.
+ * @return true on success, false on failure.
+ */
+bool message_log_open(MessageLog *log, const char *dir, size_t segment_size, MessageLogReplyFn reply, void *context);
+
+/**
+ * @brief Starts the writer and reader threads. Appends and queries before
+ *        this are queued.
+ * @return true on success, false if a thread could not be created.
+ */
+bool message_log_start(MessageLog *log);
+
+/**
+ * @brief Queues a frame for the log. Safe to call from any thread; never
+ *        blocks on the disk.
+ * @param log The MessageLog.
+ * @param room Room key from message_log_room_key.
+ * @param time Arrival time in ms since the epoch.
+ * @param frame The encoded frame, header included.
+ * @param len Length of frame.
+ * @return true if queued, false if it was dropped.
+ */
+bool message_log_append(MessageLog *log, uint64_t room, uint64_t time, const uint8_t *frame, size_t len);
+
+/**
+ * @brief Queues a history query for the reader thread, which answers it with
+ *        message_log_history and passes the result to the reply function.
+ *        Safe to call from any thread.
+ * @param log The MessageLog.
+ * @param room Room name.
+ * @param from Arrival time in ms since the epoch.
+ * @param count Most frames to return.
+ * @param shard Passed to the reply function.
+ * @param reply_to Passed to the reply function.
+ * @return true if queued, false if too many queries are waiting.
+ */
+bool message_log_query(MessageLog *log, const char *room, uint64_t from, int count, int shard, uint64_t reply_to);
+
+/**
+ * @brief Copies up to count frames of a room that arrived at or after `from`
+ *        into out, oldest first, as stored. Only blocks of the log the index
+ *        points at are read. Safe to call from any thread.
+ * @param log The MessageLog.
+ * @param room Room key from message_log_room_key.
+ * @param from Arrival time in ms since the epoch.
+ * @param count Most frames to return.
+ * @param out Buffer the frames are copied into back to back.
+ * @param capacity Size of out; frames that do not fit are left out.
+ * @param used Set to the bytes of out filled.
+ * @return The number of frames copied.
+ */
+int message_log_history(MessageLog *log, uint64_t room, uint64_t from, int count,
+                        uint8_t *out, size_t capacity, size_t *used);
+
+/**
+ * @brief Writes out everything queued, stops both threads and closes the
+ *        log. Queries still waiting are dropped. Safe to call on a log whose
+ *        open failed.
+ */
+void message_log_close(MessageLog *log);
@@ -0,0 +1,396 @@
+#include "metrics.h"
+#include "logger.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_INITIAL_TEXT 16384
+#define METRICS_REQUEST_MAX 2048
+#define METRICS_IO_TIMEOUT_S 2   // A stuck scraper only holds up other scrapers this long
+
+// Label for each message type slot; slot 0 collects unknown types
+static const char *const metrics_type_names[METRICS_MESSAGE_TYPES] = {
+    "unknown", "chat", "system", "error", "userlist", "command", "ping", "pong", "presence", "receipt"
+};
+
+void metric_observe(MetricHistogram *histogram, uint64_t value) {
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1); // ceil(log2(value))
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS) {
+        bucket = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    metric_add(&histogram->buckets[bucket], 1);
+    metric_add(&histogram->sum, value);
+}
+
+// Response text
+
+static bool metrics_printf(MetricsServer *server, size_t *len, const char *format, ...) {
+    while (1) {
+        va_list args;
+        va_start(args, format);
+        const int written = vsnprintf(server->text + *len, server->text_capacity - *len, format, args);
+        va_end(args);
+        if (written < 0) {
+            return false;
+        }
+        if ((size_t)written < server->text_capacity - *len) {
+            *len += (size_t)written;
+            return true;
+        }
+        char *grown = realloc(server->text, server->text_capacity * 2);
+        if (grown == NULL) {
+            return false;
+        }
+        server->text = grown;
+        server->text_capacity *= 2;
+    }
+}
+
+static bool metrics_header(MetricsServer *server, size_t *len, const char *name, const char *type, const char *help) {
+    return metrics_printf(server, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One sample per shard of the value at `offset` within ShardMetrics
+static bool metrics_per_shard(MetricsServer *server, size_t *len, const char *name, const char *type,
+                              const char *help, size_t offset) {
+    if (!metrics_header(server, len, name, type, help)) {
+        return false;
+    }
+    for (int i = 0; i < server->shard_count; i++) {
+        const MetricValue *value = (const MetricValue *)((const char *)&server->shards[i] + offset);
+        if (!metrics_printf(server, len, "%s{shard=\"%d\"} %llu\n", name, i, (unsigned long long)metric_get(value))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// One sample per shard and message type of the array at `offset` within ShardMetrics
+static bool metrics_per_type(MetricsServer *server, size_t *len, const char *name, const char *help, size_t offset) {
+    if (!metrics_header(server, len, name, "counter", help)) {
+        return false;
+    }
+    for (int i = 0; i < server->shard_count; i++) {
+        const MetricValue *values = (const MetricValue *)((const char *)&server->shards[i] + offset);
+        for (int type = 0; type < METRICS_MESSAGE_TYPES; type++) {
+            const uint64_t value = metric_get(&values[type]);
+            // Unnamed slots only show up once something arrived in them
+            if (metrics_type_names[type] == NULL && value == 0) {
+                continue;
+            }
+            char unnamed[8];
+            snprintf(unnamed, sizeof(unnamed), "0x%02x", type);
+            const char *label = metrics_type_names[type] != NULL ? metrics_type_names[type] : unnamed;
+            if (!metrics_printf(server, len, "%s{shard=\"%d\",type=\"%s\"} %llu\n",
+                                name, i, label, (unsigned long long)value)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Bucket bounds and the sum are divided by `scale` (e.g. microseconds to seconds)
+static bool metrics_histogram(MetricsServer *server, size_t *len, const char *name, const char *help,
+                              size_t offset, double scale) {
+    if (!metrics_header(server, len, name, "histogram", help)) {
+        return false;
+    }
+    for (int i = 0; i < server->shard_count; i++) {
+        const MetricHistogram *histogram = (const MetricHistogram *)((const char *)&server->shards[i] + offset);
+        // The count is the +Inf bucket, so the two always agree
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+            cumulative += metric_get(&histogram->buckets[bucket]);
+            char bound[32];
+            if (bucket == METRICS_HISTOGRAM_BUCKETS - 1) {
+                snprintf(bound, sizeof(bound), "+Inf");
+            } else {
+                snprintf(bound, sizeof(bound), "%.9g", (double)(1ull << bucket) / scale);
+            }
+            if (!metrics_printf(server, len, "%s_bucket{shard=\"%d\",le=\"%s\"} %llu\n",
+                                name, i, bound, (unsigned long long)cumulative)) {
+                return false;
+            }
+        }
+        if (!metrics_printf(server, len, "%s_sum{shard=\"%d\"} %.9g\n%s_count{shard=\"%d\"} %llu\n",
+                            name, i, (double)metric_get(&histogram->sum) / scale,
+                            name, i, (unsigned long long)cumulative)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define METRIC_OFFSET(field) offsetof(ShardMetrics, field)
+
+// Renders every metric into server->text; returns the length, 0 on allocation failure
+static size_t metrics_render(MetricsServer *server) {
+    size_t len = 0;
+    const bool ok =
+        metrics_per_shard(server, &len, "chat_connections", "gauge",
+                          "Live client connections.", METRIC_OFFSET(connections)) &&
+        metrics_per_shard(server, &len, "chat_accepts_total", "counter",
+                          "Connections accepted, including refused ones.", METRIC_OFFSET(accepts)) &&
+        metrics_per_type(server, &len, "chat_frames_received_total",
+                         "Frames received, by message type.", METRIC_OFFSET(frames_in)) &&
+        metrics_per_type(server, &len, "chat_received_bytes_total",
+                         "Bytes of the frames received, by message type.", METRIC_OFFSET(bytes_in)) &&
+        metrics_per_type(server, &len, "chat_frames_sent_total",
+                         "Frames fully written to clients, by message type.", METRIC_OFFSET(frames_out)) &&
+        metrics_per_type(server, &len, "chat_sent_bytes_total",
+                         "Bytes of the frames fully written, by message type.", METRIC_OFFSET(bytes_out)) &&
+        metrics_histogram(server, &len, "chat_fanout_recipients",
+                          "Recipients on the shard per outbound message.", METRIC_OFFSET(fanout), 1.0) &&
+        metrics_per_shard(server, &len, "chat_output_queue_frames", "gauge",
+                          "Frames queued for clients.", METRIC_OFFSET(queued_frames)) &&
+        metrics_per_shard(server, &len, "chat_output_queue_bytes", "gauge",
+                          "Bytes queued for clients.", METRIC_OFFSET(queued_bytes)) &&
+        metrics_per_shard(server, &len, "chat_output_queue_max_bytes", "gauge",
+                          "Bytes queued for the client furthest behind.", METRIC_OFFSET(max_queued_bytes)) &&
+        metrics_per_shard(server, &len, "chat_frames_dropped_total", "counter",
+                          "Frames shed by the slow-consumer policy.", METRIC_OFFSET(frames_dropped)) &&
+        metrics_per_shard(server, &len, "chat_slow_disconnects_total", "counter",
+                          "Clients disconnected by the slow-consumer policy.", METRIC_OFFSET(slow_disconnects)) &&
+        metrics_per_shard(server, &len, "chat_rooms", "gauge",
+                          "Rooms known to the shard.", METRIC_OFFSET(rooms)) &&
+        metrics_histogram(server, &len, "chat_loop_iteration_seconds",
+                          "Event loop iteration time, excluding the wait for events.", METRIC_OFFSET(loop_us), 1e6);
+    return ok ? len : 0;
+}
+
+// Connections
+
+static bool metrics_send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+// Answers one request and closes the connection
+static void metrics_serve(MetricsServer *server, int fd) {
+    const struct timeval timeout = { .tv_sec = METRICS_IO_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters; wait for the end of the headers so the
+    // client is not reset by closing with unread data
+    char request[METRICS_REQUEST_MAX + 1];
+    size_t received = 0;
+    while (received < METRICS_REQUEST_MAX) {
+        const ssize_t n = recv(fd, request + received, METRICS_REQUEST_MAX - received, 0);
+        if (n <= 0) {
+            break;
+        }
+        received += (size_t)n;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[received] = '\0';
+
+    const bool is_metrics = strncmp(request, "GET /metrics", 12) == 0 &&
+                            (request[12] == ' ' || request[12] == '?' || request[12] == '\r' || request[12] == '\n');
+    const size_t body_len = is_metrics ? metrics_render(server) : 0;
+    char head[192];
+    int head_len;
+    if (is_metrics && body_len > 0) {
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                            "Content-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", body_len);
+    } else if (is_metrics) {
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    } else {
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    if (metrics_send_all(fd, head, (size_t)head_len) && body_len > 0) {
+        metrics_send_all(fd, server->text, body_len);
+    }
+    close(fd);
+}
+
+static void *metrics_thread_main(void *arg) {
+    MetricsServer *server = arg;
+    struct pollfd fds[2] = {
+        { .fd = server->listen_fd, .events = POLLIN },
+        { .fd = server->stop_fd, .events = POLLIN }
+    };
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("metrics poll: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        if (fds[0].revents != 0) {
+            const int fd = accept(server->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                metrics_serve(server, fd);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_ERROR("metrics accept: %s", strerror(errno));
+            }
+        }
+    }
+    return NULL;
+}
+
+// Listener
+
+static int metrics_listen_tcp(int port) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    const int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Never exposed beyond this host
+    address.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        LOG_ERROR("metrics bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int metrics_listen_unix(const char *path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        LOG_ERROR("Metrics socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERROR("metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    // A socket left behind by an earlier run would make bind fail
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        LOG_ERROR("metrics bind: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool metrics_server_init(MetricsServer *server, int port, const char *socket_path,
+                         const ShardMetrics *shards, int shard_count) {
+    server->listen_fd = -1;
+    server->stop_fd = -1;
+    server->socket_path[0] = '\0';
+    server->shards = shards;
+    server->shard_count = shard_count;
+    server->running = false;
+    server->text = NULL;
+    server->text_capacity = 0;
+
+    if (socket_path != NULL) {
+        server->listen_fd = metrics_listen_unix(socket_path);
+        if (server->listen_fd >= 0) {
+            snprintf(server->socket_path, sizeof(server->socket_path), "%s", socket_path);
+        }
+    } else {
+        server->listen_fd = metrics_listen_tcp(port);
+    }
+    if (server->listen_fd < 0) {
+        return false;
+    }
+    if (listen(server->listen_fd, 16) < 0) {
+        LOG_ERROR("metrics listen: %s", strerror(errno));
+        return false;
+    }
+
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->stop_fd < 0) {
+        LOG_ERROR("metrics eventfd: %s", strerror(errno));
+        return false;
+    }
+    server->text = malloc(METRICS_INITIAL_TEXT);
+    if (server->text == NULL) {
+        LOG_ERROR("Failed to allocate metrics buffer: %s", strerror(errno));
+        return false;
+    }
+    server->text_capacity = METRICS_INITIAL_TEXT;
+
+    if (socket_path != NULL) {
+        LOG_INFO("Metrics on unix:%s", socket_path);
+    } else {
+        LOG_INFO("Metrics on http://127.0.0.1:%d/metrics", port);
+    }
+    return true;
+}
+
+bool metrics_server_start(MetricsServer *server) {
+    const int err = pthread_create(&server->thread, NULL, metrics_thread_main, server);
+    if (err != 0) {
+        LOG_ERROR("pthread_create metrics: %s", strerror(err));
+        return false;
+    }
+    server->running = true;
+    return true;
+}
+
+void metrics_server_close(MetricsServer *server) {
+    if (server->running) {
+        const uint64_t one = 1;
+        if (write(server->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_ERROR("metrics stop: %s", strerror(errno));
+        }
+        pthread_join(server->thread, NULL);
+        server->running = false;
+    }
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+        server->listen_fd = -1;
+    }
+    if (server->stop_fd >= 0) {
+        close(server->stop_fd);
+        server->stop_fd = -1;
+    }
+    if (server->socket_path[0] != '\0') {
+        unlink(server->socket_path);
+        server->socket_path[0] = '\0';
+    }
+    free(server->text);
+    server->text = NULL;
+    server->text_capacity = 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters are indexed by the header's message type; larger types share slot 0
+#define METRICS_MESSAGE_TYPES 16
+
+// Power-of-two histogram buckets: bucket i counts values <= 2^i, the last one
+// everything larger (+Inf)
+#define METRICS_HISTOGRAM_BUCKETS 21
+
+/**
+ * A value written by exactly one thread and read by any other.
+ *
+ * The writer updates it with a relaxed load and store rather than an atomic
+ * read-modify-write, so counting costs the same as a plain increment and a
+ * reader never blocks or slows down the writer.
+ */
+typedef _Atomic uint64_t MetricValue;
+
+typedef struct {
+    MetricValue count;
+    MetricValue sum;
+    MetricValue buckets[METRICS_HISTOGRAM_BUCKETS];  // Not cumulative; the exporter adds them up
+} MetricHistogram;
+
+/**
+ * Everything one shard reports. Only the shard's own thread writes it.
+ *
+ * Counters on the hot path are updated as events happen. Values that are
+ * already kept elsewhere (queue depth, slow-consumer drops, rooms) are copied
+ * in on every housekeeping tick instead, so they may be up to a second old.
+ */
+typedef struct {
+    _Alignas(64) MetricValue accepts;    // Connections accepted, including refused ones
+    MetricValue connections;             // Live clients
+    MetricValue frames_in[METRICS_MESSAGE_TYPES];
+    MetricValue bytes_in[METRICS_MESSAGE_TYPES];
+    MetricValue frames_out[METRICS_MESSAGE_TYPES];  // Counted once the last byte is written
+    MetricValue bytes_out[METRICS_MESSAGE_TYPES];
+    MetricHistogram fanout;              // Local recipients per outbound message
+    MetricHistogram loop_us;             // Event loop iteration time, excluding the wait
+    // Published on the tick
+    MetricValue rooms;
+    MetricValue queued_frames;           // Across all clients
+    MetricValue queued_bytes;
+    MetricValue max_queued_bytes;        // Deepest single client queue
+    MetricValue frames_dropped;          // Shed by the slow-consumer policy
+    MetricValue slow_disconnects;
+} ShardMetrics;
+
+/**
+ * Serves the metrics of every shard in the Prometheus text format over HTTP,
+ * from a thread of its own. Scraping only reads the shards' counters.
+ */
+typedef struct {
+    int listen_fd;
+    int stop_fd;          // eventfd that ends the thread
+    char socket_path[108];  // Unix socket to unlink on close, empty for TCP
+    const ShardMetrics *shards;
+    int shard_count;
+    pthread_t thread;
+    bool running;
+    char *text;           // Response buffer, grown as needed
+    size_t text_capacity;
+} MetricsServer;
+
+/**
+ * @brief Adds n to a counter. Only the owning thread may call this.
+ */
+static inline void metric_add(MetricValue *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * @brief Sets a gauge. Only the owning thread may call this.
+ */
+static inline void metric_set(MetricValue *value, uint64_t n) {
+    atomic_store_explicit(value, n, memory_order_relaxed);
+}
+
+/**
+ * @brief Reads a value written by any thread.
+ */
+static inline uint64_t metric_get(const MetricValue *value) {
+    return atomic_load_explicit((MetricValue *)value, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds one sample to a histogram. Only the owning thread may call this.
+ */
+void metric_observe(MetricHistogram *histogram, uint64_t value);
+
+/**
+ * @brief Binds the metrics listener. Nothing is served until metrics_server_start.
+ * @param server The MetricsServer to initialize.
+ * @param port TCP port on 127.0.0.1, used when socket_path is NULL.
+ * @param socket_path Unix socket to listen on instead, or NULL.
+ * @param shards Metrics of every shard, read by the serving thread.
+ * @param shard_count Number of entries in shards.
+ * @return true on success, false on failure.
+ */
+bool metrics_server_init(MetricsServer *server, int port, const char *socket_path,
+                         const ShardMetrics *shards, int shard_count);
+
+/**
+ * @brief Starts the thread answering scrapes.
+ * @return true on success, false if the thread could not be created.
+ */
+bool metrics_server_start(MetricsServer *server);
+
+/**
+ * @brief Stops the thread if it runs, closes the listener and frees the buffer.
+ *        Safe to call on a server whose init failed.
+ */
+void metrics_server_close(MetricsServer *server);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * Lock-free intrusive multi-producer / single-consumer queue (Vyukov).
+ *
+ * Any thread may push; only the owning thread may pop. Nodes are embedded in
+ * the queued object, so pushing never allocates.
+ */
+typedef struct MpscNode {
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+typedef struct {
+    _Atomic(MpscNode *) head;  // Producers swap themselves in here
+    MpscNode *tail;            // Consumer side
+    MpscNode stub;
+} MpscQueue;
+
+/**
+ * @brief Initializes an empty queue. The queue must not be moved afterwards.
+ * @param queue The queue to initialize.
+ */
+void mpsc_queue_init(MpscQueue *queue);
+
+/**
+ * @brief Appends a node. Safe to call from any thread.
+ * @param queue The queue.
+ * @param node The node to append.
+ */
+void mpsc_queue_push(MpscQueue *queue, MpscNode *node);
+
+/**
+ * @brief Removes the oldest node. Must only be called by the consumer thread.
+ * @param queue The queue.
+ * @return The node, or NULL if the queue is empty (or a push is still in progress).
+ */
+MpscNode *mpsc_queue_pop(MpscQueue *queue);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief FNV-1a hash of the first len bytes of a name (room names, usernames).
+ */
+static inline uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief 64-bit FNV-1a of the first len bytes, for keys that are stored or
+ *        compared without the name itself.
+ */
+static inline uint64_t name_hash64(const char *name, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
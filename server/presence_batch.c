@@ -0,0 +1,107 @@
+#include "presence_batch.h"
+#include "name_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PRESENCE_BATCH_INITIAL_BUCKETS 64
+
+// Bucket holding the change for this user, or the empty bucket where it would go
+static size_t presence_batch_probe(const PresenceBatch *batch, const char *username, size_t len) {
+    const size_t mask = batch->bucket_count - 1;
+    size_t bucket = name_hash(username, len) & mask;
+    while (batch->buckets[bucket] != 0) {
+        const PresenceChange *change = &batch->changes[batch->buckets[bucket] - 1];
+        if (strncmp(change->username, username, len) == 0 && change->username[len] == '\0') {
+            break;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+static bool presence_batch_rehash(PresenceBatch *batch, size_t bucket_count) {
+    int *buckets = calloc(bucket_count, sizeof(int));
+    if (buckets == NULL) {
+        return false;
+    }
+    free(batch->buckets);
+    batch->buckets = buckets;
+    batch->bucket_count = bucket_count;
+
+    for (int i = 0; i < batch->count; i++) {
+        const char *username = batch->changes[i].username;
+        const size_t bucket = presence_batch_probe(batch, username, strlen(username));
+        batch->buckets[bucket] = i + 1;
+    }
+    return true;
+}
+
+bool presence_batch_init(PresenceBatch *batch) {
+    batch->changes = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->events = 0;
+    batch->buckets = calloc(PRESENCE_BATCH_INITIAL_BUCKETS, sizeof(int));
+    batch->bucket_count = PRESENCE_BATCH_INITIAL_BUCKETS;
+    return batch->buckets != NULL;
+}
+
+void presence_batch_destroy(PresenceBatch *batch) {
+    free(batch->changes);
+    free(batch->buckets);
+    batch->changes = NULL;
+    batch->buckets = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->bucket_count = 0;
+}
+
+bool presence_batch_add(PresenceBatch *batch, const char *username, PresenceAction action, uint64_t version) {
+    const size_t len = strnlen(username, MAX_USERNAME_LEN - 1);
+    size_t bucket = presence_batch_probe(batch, username, len);
+
+    if (batch->buckets[bucket] != 0) {
+        PresenceChange *change = &batch->changes[batch->buckets[bucket] - 1];
+        // Older than what is already recorded: overtaken on its way from another shard
+        if (version > change->last_version) {
+            change->last_action = (uint8_t)action;
+            change->last_version = version;
+        }
+        batch->events++;
+        return true;
+    }
+
+    if (batch->count >= batch->capacity) {
+        const int new_capacity = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        PresenceChange *new_changes = realloc(batch->changes, sizeof(PresenceChange) * new_capacity);
+        if (new_changes == NULL) {
+            return false;
+        }
+        batch->changes = new_changes;
+        batch->capacity = new_capacity;
+    }
+    // Keep the load factor at or below one half
+    if ((size_t)(batch->count + 1) * 2 > batch->bucket_count) {
+        if (!presence_batch_rehash(batch, batch->bucket_count * 2)) {
+            return false;
+        }
+        bucket = presence_batch_probe(batch, username, len);
+    }
+
+    PresenceChange *change = &batch->changes[batch->count];
+    memcpy(change->username, username, len);
+    change->username[len] = '\0';
+    change->first_action = change->last_action = (uint8_t)action;
+    change->first_version = change->last_version = version;
+    batch->buckets[bucket] = ++batch->count;
+    batch->events++;
+    return true;
+}
+
+void presence_batch_clear(PresenceBatch *batch) {
+    if (batch->count > 0) {
+        memset(batch->buckets, 0, batch->bucket_count * sizeof(int));
+    }
+    batch->count = 0;
+    batch->events = 0;
+}
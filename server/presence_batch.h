@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../common/protocol.h"
+
+/**
+ * Net presence change of one user within a coalescing window.
+ *
+ * Versions are the directory_version right after the change, so a user list
+ * snapshot built at version v reflects exactly the changes with version <= v.
+ */
+typedef struct {
+    char username[MAX_USERNAME_LEN];
+    uint8_t first_action;    // PresenceAction of the first change seen this window
+    uint8_t last_action;     // ... and of the latest one
+    uint64_t first_version;
+    uint64_t last_version;
+} PresenceChange;
+
+/**
+ * Presence changes gathered by one shard until its window closes.
+ *
+ * One entry per username, found through an open-addressing hash. Changes
+ * from other shards may arrive after newer ones for the same user; those are
+ * recognized by their version and ignored.
+ */
+typedef struct {
+    PresenceChange *changes;
+    int count;
+    int capacity;
+    int *buckets;          // Index into changes + 1, 0 for an empty bucket
+    size_t bucket_count;   // Power of two
+    uint64_t events;       // Changes added since the last clear, including ignored ones
+} PresenceBatch;
+
+/**
+ * @brief Initializes an empty batch.
+ * @return true on success, false if allocation failed.
+ */
+bool presence_batch_init(PresenceBatch *batch);
+
+/**
+ * @brief Frees the entries and the index.
+ */
+void presence_batch_destroy(PresenceBatch *batch);
+
+/**
+ * @brief Records that a user joined or left.
+ * @param version directory_version right after the change.
+ * @return false if allocation failed and the change was not recorded.
+ */
+bool presence_batch_add(PresenceBatch *batch, const char *username, PresenceAction action, uint64_t version);
+
+/**
+ * @brief Empties the batch, keeping its memory for the next window.
+ */
+void presence_batch_clear(PresenceBatch *batch);
+
+/**
+ * @brief A join followed by a leave, or a leave followed by a join, leaves
+ *        the user where it was before the window: nothing needs to be sent.
+ */
+static inline bool presence_change_cancelled(const PresenceChange *change) {
+    return change->first_action != change->last_action;
+}
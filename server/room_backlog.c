@@ -0,0 +1,68 @@
+#include "room_backlog.h"
+#include <stdlib.h>
+#include <string.h>
+
+void room_backlog_init(RoomBacklog *backlog, int max_frames, size_t capacity) {
+    backlog->data = NULL;
+    backlog->lengths = NULL;
+    backlog->capacity = capacity;
+    backlog->start = 0;
+    backlog->used = 0;
+    backlog->max_frames = max_frames;
+    backlog->first = 0;
+    backlog->count = 0;
+}
+
+void room_backlog_destroy(RoomBacklog *backlog) {
+    free(backlog->lengths); // Start of the block
+    backlog->data = NULL;
+    backlog->lengths = NULL;
+    backlog->used = 0;
+    backlog->count = 0;
+}
+
+static void room_backlog_evict(RoomBacklog *backlog) {
+    const uint32_t len = backlog->lengths[backlog->first];
+    backlog->start = (backlog->start + len) % backlog->capacity;
+    backlog->used -= len;
+    backlog->first = (backlog->first + 1) % backlog->max_frames;
+    backlog->count--;
+}
+
+bool room_backlog_append(RoomBacklog *backlog, const uint8_t *frame, size_t len) {
+    if (backlog->max_frames <= 0 || len > backlog->capacity) {
+        return false;
+    }
+    if (backlog->lengths == NULL) {
+        uint8_t *block = malloc(sizeof(uint32_t) * (size_t)backlog->max_frames + backlog->capacity);
+        if (block == NULL) {
+            return false;
+        }
+        backlog->lengths = (uint32_t *)block;
+        backlog->data = block + sizeof(uint32_t) * (size_t)backlog->max_frames;
+    }
+
+    while (backlog->count == backlog->max_frames || backlog->capacity - backlog->used < len) {
+        room_backlog_evict(backlog);
+    }
+
+    // Copy in, wrapping around the end of the ring
+    const size_t end = (backlog->start + backlog->used) % backlog->capacity;
+    const size_t first_part = len < backlog->capacity - end ? len : backlog->capacity - end;
+    memcpy(backlog->data + end, frame, first_part);
+    memcpy(backlog->data, frame + first_part, len - first_part);
+    backlog->used += len;
+    backlog->lengths[(backlog->first + backlog->count) % backlog->max_frames] = (uint32_t)len;
+    backlog->count++;
+    return true;
+}
+
+size_t room_backlog_copy(const RoomBacklog *backlog, uint8_t *buf) {
+    // Frames sit back to back in the ring, so its bytes from the oldest frame
+    // on, unwrapped, are the frames in order
+    const size_t tail = backlog->capacity - backlog->start;
+    const size_t first_part = backlog->used < tail ? backlog->used : tail;
+    memcpy(buf, backlog->data + backlog->start, first_part);
+    memcpy(buf + first_part, backlog->data, backlog->used - first_part);
+    return backlog->used;
+}
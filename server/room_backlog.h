@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Recent chat frames of one room, oldest first, for replay to clients that join.
+ *
+ * Frames are stored back to back in a byte ring, with their lengths in a
+ * second ring. Both live in one block allocated when the first frame is
+ * stored; after that, appending only copies and evicts the oldest frames to
+ * make room, so steady traffic allocates nothing.
+ */
+typedef struct {
+    uint8_t *data;          // Byte ring, NULL until the first append
+    uint32_t *lengths;      // Frame lengths, in the same block as data
+    size_t capacity;        // Bytes in data
+    size_t start;           // Offset of the oldest frame
+    size_t used;            // Bytes held
+    int max_frames;
+    int first;              // Index of the oldest length
+    int count;              // Frames held
+} RoomBacklog;
+
+/**
+ * @brief Initializes an empty backlog without allocating.
+ * @param max_frames Frames kept at most; 0 disables the backlog.
+ * @param capacity Bytes kept at most, fewer frames are kept when they do not fit.
+ */
+void room_backlog_init(RoomBacklog *backlog, int max_frames, size_t capacity);
+
+/**
+ * @brief Frees the storage.
+ */
+void room_backlog_destroy(RoomBacklog *backlog);
+
+/**
+ * @brief Appends a frame, evicting the oldest ones as needed.
+ * @return false if the backlog is disabled, the frame is larger than the
+ *         whole backlog, or the storage could not be allocated.
+ */
+bool room_backlog_append(RoomBacklog *backlog, const uint8_t *frame, size_t len);
+
+/**
+ * @brief Copies the frames, oldest first, back to back.
+ * @param buf Buffer of at least `used` bytes.
+ * @return Bytes copied.
+ */
+size_t room_backlog_copy(const RoomBacklog *backlog, uint8_t *buf);
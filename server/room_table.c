@@ -0,0 +1,175 @@
+#include "room_table.h"
+#include "name_hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ROOM_TABLE_INITIAL_BUCKETS 16
+
+static size_t room_name_len(const char *name) {
+    return strnlen(name, MAX_ROOM_NAME - 1);
+}
+
+// Bucket holding the room with this name, or the empty bucket where it would go
+static size_t room_table_probe(const RoomTable *table, const char *name, size_t len) {
+    const size_t mask = table->bucket_count - 1;
+    size_t bucket = name_hash(name, len) & mask;
+    while (table->buckets[bucket] != 0) {
+        const Room *room = &table->rooms[table->buckets[bucket] - 1];
+        if (strncmp(room->name, name, len) == 0 && room->name[len] == '\0') {
+            break;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+static bool room_table_rehash(RoomTable *table, size_t bucket_count) {
+    int *buckets = calloc(bucket_count, sizeof(int));
+    if (buckets == NULL) {
+        return false;
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+
+    // Names are unique, so every room lands in the first empty bucket of its chain
+    for (int id = 0; id < table->room_slots_used; id++) {
+        if (!table->rooms[id].in_use) {
+            continue;
+        }
+        const char *name = table->rooms[id].name;
+        const size_t bucket = room_table_probe(table, name, strlen(name));
+        table->buckets[bucket] = id + 1;
+    }
+    return true;
+}
+
+bool room_table_init(RoomTable *table) {
+    table->rooms = NULL;
+    table->room_count = 0;
+    table->room_slots_used = 0;
+    table->room_capacity = 0;
+    table->free_room = -1;
+    table->buckets = calloc(ROOM_TABLE_INITIAL_BUCKETS, sizeof(int));
+    table->bucket_count = ROOM_TABLE_INITIAL_BUCKETS;
+    return table->buckets != NULL;
+}
+
+void room_table_destroy(RoomTable *table) {
+    for (int id = 0; id < table->room_slots_used; id++) {
+        free(table->rooms[id].members); // NULL for free slots
+    }
+    free(table->rooms);
+    free(table->buckets);
+    table->rooms = NULL;
+    table->buckets = NULL;
+    table->room_count = 0;
+    table->room_slots_used = 0;
+    table->room_capacity = 0;
+    table->free_room = -1;
+    table->bucket_count = 0;
+}
+
+int room_table_find(const RoomTable *table, const char *name) {
+    const size_t bucket = room_table_probe(table, name, room_name_len(name));
+    return table->buckets[bucket] - 1;
+}
+
+int room_table_intern(RoomTable *table, const char *name) {
+    const size_t len = room_name_len(name);
+    size_t bucket = room_table_probe(table, name, len);
+    if (table->buckets[bucket] != 0) {
+        return table->buckets[bucket] - 1;
+    }
+
+    if (table->free_room < 0 && table->room_slots_used >= table->room_capacity) {
+        const int new_capacity = table->room_capacity > 0 ? table->room_capacity * 2 : 8;
+        Room *new_rooms = realloc(table->rooms, sizeof(Room) * new_capacity);
+        if (new_rooms == NULL) {
+            return -1;
+        }
+        table->rooms = new_rooms;
+        table->room_capacity = new_capacity;
+    }
+    // Keep the load factor at or below one half
+    if ((size_t)(table->room_count + 1) * 2 > table->bucket_count) {
+        if (!room_table_rehash(table, table->bucket_count * 2)) {
+            return -1;
+        }
+        bucket = room_table_probe(table, name, len);
+    }
+
+    // Reuse a released ID before handing out a new one
+    int id = table->free_room;
+    if (id >= 0) {
+        table->free_room = table->rooms[id].next_free;
+    } else {
+        id = table->room_slots_used++;
+    }
+    table->room_count++;
+    Room *room = &table->rooms[id];
+    memcpy(room->name, name, len);
+    room->name[len] = '\0';
+    room->members = NULL;
+    room->member_count = 0;
+    room->member_capacity = 0;
+    room->refs = 0;
+    room->in_use = true;
+    room->next_free = -1;
+    table->buckets[bucket] = id + 1;
+    return id;
+}
+
+bool room_table_release(RoomTable *table, int room_id) {
+    Room *room = &table->rooms[room_id];
+    if (--room->refs > 0 || room_id == GENERAL_ROOM_ID) {
+        return false;
+    }
+
+    // Backward-shift deletion: pull later entries of the probe chain into the
+    // hole unless that would move them before their home bucket
+    const size_t mask = table->bucket_count - 1;
+    size_t hole = room_table_probe(table, room->name, strlen(room->name));
+    for (size_t next = (hole + 1) & mask; table->buckets[next] != 0; next = (next + 1) & mask) {
+        const char *name = table->rooms[table->buckets[next] - 1].name;
+        const size_t home = name_hash(name, strlen(name)) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->buckets[hole] = table->buckets[next];
+            hole = next;
+        }
+    }
+    table->buckets[hole] = 0;
+
+    free(room->members);
+    room->members = NULL;
+    room->member_count = 0;
+    room->member_capacity = 0;
+    room->in_use = false;
+    room->next_free = table->free_room;
+    table->free_room = room_id;
+    table->room_count--;
+    return true;
+}
+
+int room_add_member(Room *room, int slot) {
+    if (room->member_count >= room->member_capacity) {
+        const int new_capacity = room->member_capacity > 0 ? room->member_capacity * 2 : 4;
+        int *new_members = realloc(room->members, sizeof(int) * new_capacity);
+        if (new_members == NULL) {
+            return -1;
+        }
+        room->members = new_members;
+        room->member_capacity = new_capacity;
+    }
+    room->members[room->member_count] = slot;
+    return room->member_count++;
+}
+
+int room_remove_member(Room *room, int pos) {
+    const int last = --room->member_count;
+    if (pos == last) {
+        return -1;
+    }
+    room->members[pos] = room->members[last];
+    return room->members[pos];
+}
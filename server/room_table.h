@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_ROOM_NAME 64
+#define GENERAL_ROOM_ID 0  // Interned first by every shard, never freed
+
+/**
+ * A chat room and the client slots currently in it.
+ *
+ * Broadcasts iterate `members` directly, so fan-out costs the room's size
+ * rather than the shard's. Removal swaps the last member into the freed
+ * position; callers keep each member's position so it can be updated.
+ */
+typedef struct {
+    char name[MAX_ROOM_NAME];
+    int *members;          // Client slots, in no particular order
+    int member_count;
+    int member_capacity;
+    int refs;              // Clients whose room this is, members or not yet registered
+    bool in_use;           // Slot holds a room
+    int next_free;         // Free slots only: next entry of the free list, -1 at the end
+} Room;
+
+/**
+ * Rooms of one shard, interned by name to integer IDs.
+ *
+ * IDs index `rooms` and stay the same while the room exists; an
+ * open-addressing hash over the names maps a name to its ID. A room is freed
+ * once the last client referring to it releases it, and its ID goes on a free
+ * list for the next new room, so the table only holds rooms someone is in.
+ */
+typedef struct {
+    Room *rooms;           // Indexed by room ID; may move when the table grows
+    int room_count;        // Live rooms
+    int room_slots_used;   // IDs handed out at least once; loops over rooms stop here
+    int room_capacity;
+    int free_room;         // Head of the free list of released IDs, -1 if empty
+    int *buckets;          // Room ID + 1, 0 for an empty bucket
+    size_t bucket_count;   // Power of two
+} RoomTable;
+
+/**
+ * @brief Initializes an empty table.
+ * @return true on success, false if allocation failed.
+ */
+bool room_table_init(RoomTable *table);
+
+/**
+ * @brief Frees every room and the index.
+ */
+void room_table_destroy(RoomTable *table);
+
+/**
+ * @brief Looks up a room by name. Names are compared up to MAX_ROOM_NAME - 1 bytes.
+ * @return The room ID, or -1 if no such room exists.
+ */
+int room_table_find(const RoomTable *table, const char *name);
+
+/**
+ * @brief Returns the ID of the named room, creating it if needed.
+ * @return The room ID, or -1 if allocation failed.
+ */
+int room_table_intern(RoomTable *table, const char *name);
+
+/**
+ * @brief Returns the room with the given ID. The pointer is only valid until the next intern.
+ */
+static inline Room *room_table_get(RoomTable *table, int room_id) {
+    return &table->rooms[room_id];
+}
+
+/**
+ * @brief Counts a client that refers to the room.
+ */
+static inline void room_table_retain(RoomTable *table, int room_id) {
+    table->rooms[room_id].refs++;
+}
+
+/**
+ * @brief Drops a reference taken with room_table_retain, freeing the room
+ *        and its ID when it was the last one (except GENERAL_ROOM_ID).
+ * @return true if the room was freed.
+ */
+bool room_table_release(RoomTable *table, int room_id);
+
+/**
+ * @brief Adds a client slot to the room.
+ * @return The member's position in `members`, or -1 if allocation failed.
+ */
+int room_add_member(Room *room, int slot);
+
+/**
+ * @brief Removes the member at a position by moving the last member into it.
+ * @return The slot that now occupies `pos`, or -1 if the removed member was last.
+ */
+int room_remove_member(Room *room, int pos);
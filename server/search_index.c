@@ -0,0 +1,589 @@
+#include "search_index.h"
+#include "logger.h"
+#include "name_hash.h"
+#include "../common/protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_INITIAL_TERMS 64    // Power of two
+#define SEARCH_INITIAL_DOCS 64
+#define SEARCH_INITIAL_DOC_BYTES 4096
+
+// A term of a query or message
+typedef struct {
+    uint8_t len;
+    char text[SEARCH_TERM_MAX];
+} SearchWord;
+
+// Position in a posting list
+typedef struct {
+    const SearchBlock *block;
+    uint32_t index;       // Of the current ID within the block
+    uint16_t pos;         // Of the next delta in the block's data
+    uint32_t id;
+    uint32_t count;       // Of the whole list, to order the cursors
+} SearchCursor;
+
+// Terms
+
+static bool search_is_word_byte(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Reads the next word of text, lowercased and cut to SEARCH_TERM_MAX bytes
+static bool search_next_word(const char **text, const char *end, SearchWord *word) {
+    const char *p = *text;
+    while (p < end && !search_is_word_byte((uint8_t)*p)) {
+        p++;
+    }
+    if (p == end) {
+        *text = p;
+        return false;
+    }
+    word->len = 0;
+    for (; p < end && search_is_word_byte((uint8_t)*p); p++) {
+        if (word->len < SEARCH_TERM_MAX) {
+            const char c = *p;
+            word->text[word->len++] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+        }
+    }
+    *text = p;
+    return true;
+}
+
+static uint64_t search_term_hash(uint64_t room, const SearchWord *word) {
+    const uint64_t hash = name_hash64(word->text, word->len) ^ (room * 0x9E3779B97F4A7C15ull);
+    return hash != 0 ? hash : 1;
+}
+
+// Slot of the term in the generation's table, or the empty slot it would take
+static SearchTerm *search_find_term(const SearchGeneration *gen, uint64_t room, uint64_t hash, const SearchWord *word) {
+    size_t slot = (size_t)hash & (gen->term_capacity - 1);
+    while (gen->terms[slot].hash != 0) {
+        const SearchTerm *term = &gen->terms[slot];
+        if (term->hash == hash && term->room == room && term->len == word->len &&
+            memcmp(term->text, word->text, word->len) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (gen->term_capacity - 1);
+    }
+    return &gen->terms[slot];
+}
+
+static bool search_grow_terms(SearchGeneration *gen) {
+    const size_t capacity = gen->term_capacity == 0 ? SEARCH_INITIAL_TERMS : gen->term_capacity * 2;
+    SearchTerm *terms = calloc(capacity, sizeof(SearchTerm));
+    if (terms == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < gen->term_capacity; i++) {
+        if (gen->terms[i].hash == 0) {
+            continue;
+        }
+        size_t slot = (size_t)gen->terms[i].hash & (capacity - 1);
+        while (terms[slot].hash != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        terms[slot] = gen->terms[i];
+    }
+    free(gen->terms);
+    gen->bytes += (capacity - gen->term_capacity) * sizeof(SearchTerm);
+    gen->terms = terms;
+    gen->term_capacity = capacity;
+    return true;
+}
+
+// Posting lists
+
+static SearchBlock *search_new_block(SearchGeneration *gen, uint16_t capacity, uint32_t id) {
+    SearchBlock *block = malloc(sizeof(SearchBlock) + capacity);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->first = id;
+    block->last = id;
+    block->count = 1;
+    block->len = 0;
+    block->capacity = capacity;
+    gen->bytes += sizeof(SearchBlock) + capacity;
+    return block;
+}
+
+static bool search_add_posting(SearchGeneration *gen, SearchTerm *term, uint32_t id) {
+    SearchBlock *tail = term->tail;
+    if (tail != NULL && tail->last == id) {
+        return true;  // Word repeated within the message
+    }
+
+    uint8_t varint[5];
+    int n = 0;
+    if (tail != NULL) {
+        uint32_t delta = id - tail->last;
+        while (delta >= 0x80) {
+            varint[n++] = (uint8_t)(delta | 0x80);
+            delta >>= 7;
+        }
+        varint[n++] = (uint8_t)delta;
+    }
+
+    if (tail == NULL || tail->len + n > tail->capacity) {
+        // Most terms are rare: start small and double the blocks of common ones
+        uint16_t capacity = SEARCH_BLOCK_MIN;
+        if (tail != NULL) {
+            capacity = tail->capacity * 2 <= SEARCH_BLOCK_MAX ? (uint16_t)(tail->capacity * 2) : SEARCH_BLOCK_MAX;
+        }
+        SearchBlock *block = search_new_block(gen, capacity, id);
+        if (block == NULL) {
+            return false;
+        }
+        if (tail == NULL) {
+            term->head = block;
+        } else {
+            tail->next = block;
+        }
+        term->tail = block;
+    } else {
+        memcpy(tail->data + tail->len, varint, (size_t)n);
+        tail->len += (uint16_t)n;
+        tail->last = id;
+        tail->count++;
+    }
+    term->count++;
+    return true;
+}
+
+static bool search_cursor_init(SearchCursor *cursor, const SearchTerm *term) {
+    cursor->block = term->head;
+    cursor->index = 0;
+    cursor->pos = 0;
+    cursor->id = term->head->first;
+    cursor->count = term->count;
+    return true;
+}
+
+static bool search_cursor_next(SearchCursor *cursor) {
+    const SearchBlock *block = cursor->block;
+    if (cursor->index + 1 < block->count) {
+        uint32_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = block->data[cursor->pos++];
+            delta |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        cursor->id += delta;
+        cursor->index++;
+        return true;
+    }
+    cursor->block = block->next;
+    if (cursor->block == NULL) {
+        return false;
+    }
+    cursor->index = 0;
+    cursor->pos = 0;
+    cursor->id = cursor->block->first;
+    return true;
+}
+
+// Moves to the first ID >= target. Blocks that end before it are skipped
+// without decoding.
+static bool search_cursor_seek(SearchCursor *cursor, uint32_t target) {
+    if (cursor->id >= target) {
+        return true;
+    }
+    while (cursor->block->last < target) {
+        cursor->block = cursor->block->next;
+        if (cursor->block == NULL) {
+            return false;
+        }
+        cursor->index = 0;
+        cursor->pos = 0;
+        cursor->id = cursor->block->first;
+    }
+    while (cursor->id < target) {
+        if (!search_cursor_next(cursor)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int search_compare_cursors(const void *a, const void *b) {
+    const uint32_t x = ((const SearchCursor *)a)->count;
+    const uint32_t y = ((const SearchCursor *)b)->count;
+    return (x > y) - (x < y);
+}
+
+// Generations
+
+static void search_generation_free(SearchGeneration *gen) {
+    for (size_t i = 0; i < gen->term_capacity; i++) {
+        SearchBlock *block = gen->terms[i].head;
+        while (block != NULL) {
+            SearchBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+    }
+    free(gen->terms);
+    free(gen->doc_offsets);
+    free(gen->docs);
+    memset(gen, 0, sizeof(*gen));
+}
+
+static void search_index_recount(SearchIndex *index) {
+    index->bytes = 0;
+    for (int i = 0; i < index->count; i++) {
+        index->bytes += index->generations[(index->oldest + i) % SEARCH_GENERATIONS].bytes;
+    }
+}
+
+static void search_index_evict(SearchIndex *index) {
+    search_generation_free(&index->generations[index->oldest]);
+    index->oldest = (index->oldest + 1) % SEARCH_GENERATIONS;
+    index->count--;
+    search_index_recount(index);
+}
+
+// Stores the frame in the generation and returns its ID there
+static bool search_store_doc(SearchGeneration *gen, const uint8_t *frame, size_t len, uint32_t *id) {
+    if (gen->doc_count == gen->doc_capacity) {
+        const uint32_t capacity = gen->doc_capacity == 0 ? SEARCH_INITIAL_DOCS : gen->doc_capacity * 2;
+        size_t *offsets = realloc(gen->doc_offsets, capacity * sizeof(size_t));
+        if (offsets == NULL) {
+            return false;
+        }
+        gen->bytes += (capacity - gen->doc_capacity) * sizeof(size_t);
+        gen->doc_offsets = offsets;
+        gen->doc_capacity = capacity;
+    }
+    if (gen->docs_len + len > gen->docs_capacity) {
+        size_t capacity = gen->docs_capacity == 0 ? SEARCH_INITIAL_DOC_BYTES : gen->docs_capacity * 2;
+        while (capacity < gen->docs_len + len) {
+            capacity *= 2;
+        }
+        uint8_t *docs = realloc(gen->docs, capacity);
+        if (docs == NULL) {
+            return false;
+        }
+        gen->bytes += capacity - gen->docs_capacity;
+        gen->docs = docs;
+        gen->docs_capacity = capacity;
+    }
+    memcpy(gen->docs + gen->docs_len, frame, len);
+    gen->doc_offsets[gen->doc_count] = gen->docs_len;
+    gen->docs_len += len;
+    *id = gen->doc_count++;
+    return true;
+}
+
+// Public API
+
+void search_index_init(SearchIndex *index, size_t memory_cap) {
+    memset(index, 0, sizeof(*index));
+    index->memory_cap = memory_cap;
+}
+
+void search_index_destroy(SearchIndex *index) {
+    while (index->count > 0) {
+        search_index_evict(index);
+    }
+}
+
+bool search_index_add(SearchIndex *index, uint64_t room, const uint8_t *frame, size_t len,
+                      const char *text, size_t text_len) {
+    SearchGeneration *gen = index->count > 0 ?
+        &index->generations[(index->oldest + index->count - 1) % SEARCH_GENERATIONS] : NULL;
+    if (gen == NULL || gen->bytes >= index->memory_cap / SEARCH_GENERATIONS) {
+        if (index->count == SEARCH_GENERATIONS) {
+            search_index_evict(index);
+        }
+        gen = &index->generations[(index->oldest + index->count) % SEARCH_GENERATIONS];
+        memset(gen, 0, sizeof(*gen));
+        gen->first_id = index->next_id;
+        index->count++;
+    }
+
+    uint32_t id;
+    if (!search_store_doc(gen, frame, len, &id)) {
+        return false;
+    }
+    index->next_id++;
+
+    const char *p = text;
+    SearchWord word;
+    while (search_next_word(&p, text + text_len, &word)) {
+        if ((gen->term_count + 1) * 2 > gen->term_capacity && !search_grow_terms(gen)) {
+            return false;
+        }
+        const uint64_t hash = search_term_hash(room, &word);
+        SearchTerm *term = search_find_term(gen, room, hash, &word);
+        if (term->hash == 0) {
+            term->room = room;
+            term->hash = hash;
+            term->len = word.len;
+            memcpy(term->text, word.text, word.len);
+            gen->term_count++;
+        }
+        if (!search_add_posting(gen, term, id)) {
+            return false;
+        }
+    }
+
+    search_index_recount(index);
+    while (index->bytes > index->memory_cap && index->count > 1) {
+        search_index_evict(index);
+    }
+    return true;
+}
+
+int search_index_query(const SearchIndex *index, uint64_t room, const char *query, size_t query_len,
+                       int limit, uint8_t *out, size_t capacity, size_t *used) {
+    SearchWord words[SEARCH_MAX_TERMS];
+    int word_count = 0;
+    const char *p = query;
+    SearchWord word;
+    while (word_count < SEARCH_MAX_TERMS && search_next_word(&p, query + query_len, &word)) {
+        bool repeated = false;
+        for (int i = 0; i < word_count; i++) {
+            repeated |= words[i].len == word.len && memcmp(words[i].text, word.text, word.len) == 0;
+        }
+        if (!repeated) {
+            words[word_count++] = word;
+        }
+    }
+    *used = 0;
+    if (word_count == 0) {
+        return -1;
+    }
+    if (limit > SEARCH_MAX_RESULTS) {
+        limit = SEARCH_MAX_RESULTS;
+    }
+
+    // Newest generation first; within one, the last matches are kept in a ring
+    struct {
+        const SearchGeneration *gen;
+        uint32_t id;
+    } hits[SEARCH_MAX_RESULTS];
+    int first_hit = limit;
+    for (int g = index->count - 1; g >= 0 && first_hit > 0; g--) {
+        const SearchGeneration *gen = &index->generations[(index->oldest + g) % SEARCH_GENERATIONS];
+        if (gen->term_capacity == 0) {
+            continue;
+        }
+        SearchCursor cursors[SEARCH_MAX_TERMS];
+        bool complete = true;
+        for (int i = 0; i < word_count && complete; i++) {
+            const SearchTerm *term = search_find_term(gen, room, search_term_hash(room, &words[i]), &words[i]);
+            complete = term->hash != 0 && search_cursor_init(&cursors[i], term);
+        }
+        if (!complete) {
+            continue;  // A term does not occur in this generation
+        }
+        // Leapfrog from the rarest term
+        qsort(cursors, (size_t)word_count, sizeof(SearchCursor), search_compare_cursors);
+
+        uint32_t ring[SEARCH_MAX_RESULTS];
+        const int wanted = first_hit;
+        int found = 0;
+        uint32_t candidate = cursors[0].id;
+        while (1) {
+            bool agreed = true;
+            bool exhausted = false;
+            for (int i = 1; i < word_count; i++) {
+                if (!search_cursor_seek(&cursors[i], candidate)) {
+                    exhausted = true;
+                    break;
+                }
+                if (cursors[i].id > candidate) {
+                    candidate = cursors[i].id;
+                    agreed = false;
+                    break;
+                }
+            }
+            if (exhausted) {
+                break;
+            }
+            if (agreed) {
+                ring[found++ % wanted] = candidate;
+                if (!search_cursor_next(&cursors[0])) {
+                    break;
+                }
+            } else if (!search_cursor_seek(&cursors[0], candidate)) {
+                break;
+            }
+            candidate = cursors[0].id;
+        }
+
+        // Newest match last in the hits array
+        const int kept = found < wanted ? found : wanted;
+        for (int i = 0; i < kept; i++) {
+            hits[--first_hit].gen = gen;
+            hits[first_hit].id = ring[(found - 1 - i) % wanted];
+        }
+    }
+
+    int matches = 0;
+    for (int i = first_hit; i < limit; i++) {
+        const SearchGeneration *gen = hits[i].gen;
+        const uint32_t id = hits[i].id;
+        const size_t start = gen->doc_offsets[id];
+        const size_t end = id + 1 < gen->doc_count ? gen->doc_offsets[id + 1] : gen->docs_len;
+        if (end - start > capacity - *used) {
+            break;
+        }
+        memcpy(out + *used, gen->docs + start, end - start);
+        *used += end - start;
+        matches++;
+    }
+    return matches;
+}
+
+// Search thread
+
+static void search_service_run(SearchService *service, SearchJob *job, uint8_t *results, size_t capacity) {
+    if (job->type == SEARCH_JOB_INDEX) {
+        MessageView view;
+        if (protocol_view_message(job->data, job->len, &view) && view.header.type == MSG_TYPE_CHAT &&
+            !search_index_add(&service->index, job->room, job->data, job->len,
+                              view.chat.message.data, view.chat.message.len)) {
+            LOG_ERROR("Failed to allocate search index memory");
+        }
+        return;
+    }
+
+    size_t len;
+    const int matches = search_index_query(&service->index, job->room, (const char *)job->data, job->len,
+                                           job->limit, results, capacity, &len);
+    atomic_fetch_add(&service->queries, 1);
+    service->reply(service->reply_context, job->shard, job->reply_to, (const char *)job->data, job->len,
+                   results, len, matches);
+}
+
+static void *search_thread_main(void *arg) {
+    SearchService *service = arg;
+    const size_t capacity = (size_t)SEARCH_MAX_RESULTS * MAX_MESSAGE_SIZE;
+    uint8_t *results = malloc(capacity);
+    if (results == NULL) {
+        LOG_ERROR("Failed to allocate search results buffer");
+    }
+    while (1) {
+        wake_signal_clear(&service->queue.wake);
+        bool worked = false;
+        MpscNode *node;
+        while ((node = wake_queue_pop(&service->queue)) != NULL) {
+            SearchJob *job = (SearchJob *)node;
+            if (results != NULL && !atomic_load(&service->stopping)) {
+                search_service_run(service, job, results, capacity);
+            }
+            atomic_fetch_sub(&service->pending_bytes, sizeof(SearchJob) + job->len);
+            free(job);
+            worked = true;
+        }
+        if (worked) {
+            const SearchIndex *index = &service->index;
+            uint64_t messages = 0;
+            for (int i = 0; i < index->count; i++) {
+                messages += index->generations[(index->oldest + i) % SEARCH_GENERATIONS].doc_count;
+            }
+            atomic_store(&service->indexed, messages);
+            atomic_store(&service->evicted, index->next_id - messages);
+            atomic_store(&service->bytes, index->bytes);
+            continue;
+        }
+        if (atomic_load(&service->stopping)) {
+            break;
+        }
+        wake_signal_wait(&service->queue.wake, -1);
+    }
+    free(results);
+    return NULL;
+}
+
+static bool search_service_push(SearchService *service, SearchJobType type, uint64_t room,
+                                const void *data, size_t len, SearchJob **out) {
+    const size_t size = sizeof(SearchJob) + len;
+    if (atomic_fetch_add(&service->pending_bytes, size) + size > SEARCH_MAX_PENDING) {
+        atomic_fetch_sub(&service->pending_bytes, size);
+        atomic_fetch_add(&service->dropped, 1);
+        return false;
+    }
+    SearchJob *job = malloc(size);
+    if (job == NULL) {
+        atomic_fetch_sub(&service->pending_bytes, size);
+        atomic_fetch_add(&service->dropped, 1);
+        return false;
+    }
+    job->type = (uint8_t)type;
+    job->room = room;
+    job->shard = 0;
+    job->reply_to = 0;
+    job->limit = 0;
+    job->len = len;
+    memcpy(job->data, data, len);
+    *out = job;
+    return true;
+}
+
+bool search_service_init(SearchService *service, size_t memory_cap, SearchReplyFn reply, void *context) {
+    search_index_init(&service->index, memory_cap);
+    service->reply = reply;
+    service->reply_context = context;
+    atomic_init(&service->pending_bytes, 0);
+    service->running = false;
+    atomic_init(&service->stopping, false);
+    atomic_init(&service->indexed, 0);
+    atomic_init(&service->evicted, 0);
+    atomic_init(&service->queries, 0);
+    atomic_init(&service->dropped, 0);
+    atomic_init(&service->bytes, 0);
+    return wake_queue_init(&service->queue);
+}
+
+bool search_service_start(SearchService *service) {
+    const int err = pthread_create(&service->thread, NULL, search_thread_main, service);
+    if (err != 0) {
+        LOG_ERROR("pthread_create search: %s", strerror(err));
+        return false;
+    }
+    service->running = true;
+    return true;
+}
+
+bool search_service_index(SearchService *service, uint64_t room, const uint8_t *frame, size_t len) {
+    SearchJob *job;
+    if (!search_service_push(service, SEARCH_JOB_INDEX, room, frame, len, &job)) {
+        return false;
+    }
+    wake_queue_push(&service->queue, &job->node);
+    return true;
+}
+
+bool search_service_query(SearchService *service, uint64_t room, const char *query, size_t len,
+                          int limit, int shard, uint64_t reply_to) {
+    SearchJob *job;
+    if (!search_service_push(service, SEARCH_JOB_QUERY, room, query, len, &job)) {
+        return false;
+    }
+    job->shard = shard;
+    job->reply_to = reply_to;
+    job->limit = limit;
+    wake_queue_push(&service->queue, &job->node);
+    return true;
+}
+
+void search_service_close(SearchService *service) {
+    if (service->queue.wake.fd < 0) {
+        return;
+    }
+    if (service->running) {
+        atomic_store(&service->stopping, true);
+        wake_signal_force(&service->queue.wake);
+        pthread_join(service->thread, NULL);
+        service->running = false;
+    }
+    wake_queue_destroy(&service->queue);
+    search_index_destroy(&service->index);
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "wake_queue.h"
+
+#define SEARCH_TERM_MAX 32          // Longer words are indexed by their first bytes
+#define SEARCH_MAX_TERMS 8          // Terms a query may combine
+#define SEARCH_MAX_RESULTS 64       // Most matches one query returns
+#define SEARCH_GENERATIONS 8        // The index is split into this many by age
+#define SEARCH_BLOCK_MIN 16         // Posting bytes in a term's first block
+#define SEARCH_BLOCK_MAX 512        // ... doubling per block up to this
+#define SEARCH_MAX_PENDING (16 * 1024 * 1024)  // Bytes queued for the search thread before jobs are dropped
+
+/**
+ * Full-text index of recent chat messages.
+ *
+ * Words are lowercased and filed per room: each (room, term) pair has a
+ * posting list of the IDs of the messages containing it. A list is a chain
+ * of blocks holding the IDs as varint deltas. Each block header carries its
+ * first and last ID, so an intersection skips whole blocks without decoding
+ * them.
+ *
+ * The index is split into generations by age, and each generation keeps its
+ * own copy of the messages. Once the index outgrows its memory cap, the
+ * oldest generation is dropped as a whole.
+ */
+
+// Part of a posting list: `count` IDs, the first stored in the header and the
+// rest as varint deltas in data
+typedef struct SearchBlock {
+    struct SearchBlock *next;
+    uint32_t first;       // Message IDs relative to the generation
+    uint32_t last;
+    uint32_t count;
+    uint16_t len;         // Bytes of data used
+    uint16_t capacity;
+    uint8_t data[];
+} SearchBlock;
+
+// A (room, term) pair and its posting list
+typedef struct {
+    uint64_t room;
+    uint64_t hash;        // Of room and term; 0 marks an empty slot
+    SearchBlock *head;
+    SearchBlock *tail;
+    uint32_t count;       // Messages containing the term
+    uint8_t len;
+    char text[SEARCH_TERM_MAX];
+} SearchTerm;
+
+// The index of a contiguous range of messages
+typedef struct {
+    uint64_t first_id;    // Global ID of its first message
+    uint32_t doc_count;
+    uint32_t doc_capacity;
+    size_t *doc_offsets;  // Start of each message in docs; the next one's start ends it
+    uint8_t *docs;        // The messages' frames back to back
+    size_t docs_len;
+    size_t docs_capacity;
+    SearchTerm *terms;    // Open addressing by hash
+    size_t term_capacity; // Power of two
+    size_t term_count;
+    size_t bytes;         // Memory held
+} SearchGeneration;
+
+typedef struct {
+    SearchGeneration generations[SEARCH_GENERATIONS];  // Ring, oldest at `oldest`
+    int oldest;
+    int count;
+    size_t memory_cap;
+    size_t bytes;
+    uint64_t next_id;
+} SearchIndex;
+
+/**
+ * Called on the search thread with the result of a query: the query text,
+ * then the matching frames back to back, oldest first, as they were indexed.
+ * matches is -1 if the query had no terms.
+ */
+typedef void (*SearchReplyFn)(void *context, int shard, uint64_t reply_to, const char *query, size_t query_len,
+                              const uint8_t *frames, size_t len, int matches);
+
+typedef enum {
+    SEARCH_JOB_INDEX,
+    SEARCH_JOB_QUERY
+} SearchJobType;
+
+// Work for the search thread
+typedef struct {
+    MpscNode node;        // Must be first
+    uint8_t type;         // SearchJobType
+    uint64_t room;
+    int shard;            // SEARCH_JOB_QUERY: who gets the reply
+    uint64_t reply_to;
+    int limit;
+    size_t len;
+    uint8_t data[];       // The frame, or the query text
+} SearchJob;
+
+/**
+ * Owns a SearchIndex and the thread that maintains and queries it. Shards
+ * hand it messages and queries through a lock-free queue, so neither
+ * indexing nor searching ever runs on an event loop.
+ */
+typedef struct {
+    SearchIndex index;
+    SearchReplyFn reply;
+    void *reply_context;
+
+    WakeQueue queue;
+    _Atomic size_t pending_bytes;
+
+    pthread_t thread;
+    bool running;
+    atomic_bool stopping;
+
+    // Statistics, written by the search thread (dropped by producers)
+    _Atomic uint64_t indexed;     // Messages in the index
+    _Atomic uint64_t evicted;     // Messages dropped with their generation
+    _Atomic uint64_t queries;
+    _Atomic uint64_t dropped;     // Jobs refused while the thread was behind
+    _Atomic uint64_t bytes;       // Memory held by the index
+} SearchService;
+
+/**
+ * @brief Initializes an empty index.
+ * @param index The SearchIndex to initialize.
+ * @param memory_cap Bytes the index may hold before old messages are dropped.
+ */
+void search_index_init(SearchIndex *index, size_t memory_cap);
+
+/**
+ * @brief Frees every generation.
+ */
+void search_index_destroy(SearchIndex *index);
+
+/**
+ * @brief Adds a message, dropping the oldest generation if over the cap.
+ * @param index The SearchIndex.
+ * @param room Room key the message was posted to.
+ * @param frame The chat frame, kept for results.
+ * @param len Length of frame.
+ * @param text The text to index.
+ * @param text_len Length of text.
+ * @return true on success, false if memory ran out.
+ */
+bool search_index_add(SearchIndex *index, uint64_t room, const uint8_t *frame, size_t len,
+                      const char *text, size_t text_len);
+
+/**
+ * @brief Finds the newest messages of a room containing every term of a query.
+ * @param index The SearchIndex.
+ * @param room Room key.
+ * @param query The query text, split into terms like indexed text.
+ * @param query_len Length of query.
+ * @param limit Most messages to return, at most SEARCH_MAX_RESULTS.
+ * @param out Receives the matching frames back to back, oldest first.
+ * @param capacity Size of out.
+ * @param used Set to the bytes of out filled.
+ * @return The number of matches, or -1 if the query has no terms.
+ */
+int search_index_query(const SearchIndex *index, uint64_t room, const char *query, size_t query_len,
+                       int limit, uint8_t *out, size_t capacity, size_t *used);
+
+/**
+ * @brief Sets up the service. Nothing is indexed until search_service_start.
+ * @param service The SearchService to initialize.
+ * @param memory_cap Memory cap of the index.
+ * @param reply Called on the search thread with each query's result.
+ * @param context Passed to reply.
+ * @return true on success, false on failure.
+ */
+bool search_service_init(SearchService *service, size_t memory_cap, SearchReplyFn reply, void *context);
+
+/**
+ * @brief Starts the search thread.
+ * @return true on success, false if the thread could not be created.
+ */
+bool search_service_start(SearchService *service);
+
+/**
+ * @brief Queues a chat frame for indexing. Safe to call from any thread.
+ * @param service The SearchService.
+ * @param room Room key the message was posted to.
+ * @param frame The chat frame, in the current protocol version.
+ * @param len Length of frame.
+ * @return true if queued, false if it was dropped.
+ */
+bool search_service_index(SearchService *service, uint64_t room, const uint8_t *frame, size_t len);
+
+/**
+ * @brief Queues a query. The reply callback gets its result. Safe to call
+ *        from any thread.
+ * @param service The SearchService.
+ * @param room Room key to search.
+ * @param query The query text.
+ * @param len Length of query.
+ * @param limit Most messages to return.
+ * @param shard Passed to the reply callback.
+ * @param reply_to Passed to the reply callback.
+ * @return true if queued, false if it was dropped.
+ */
+bool search_service_query(SearchService *service, uint64_t room, const char *query, size_t len,
+                          int limit, int shard, uint64_t reply_to);
+
+/**
+ * @brief Stops the search thread and frees the index. Jobs still queued are
+ *        discarded unanswered. Safe to call on a service whose init failed.
+ */
+void search_service_close(SearchService *service);
@@ -1,37 +1,398 @@
 #include "server.h"
+#include "name_hash.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+// io_uring user_data layout: operation in the top byte, payload below
+enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_TIMER,
+    URING_OP_PRESENCE_TIMER,
+    URING_OP_SIGNAL,
+    URING_OP_WAKE,
+    URING_OP_CANCEL
+};
+#define URING_DATA(op, payload) (((uint64_t)(op) << 56) | (uint64_t)(payload))
+#define URING_DATA_OP(data) ((int)((data) >> 56))
+#define URING_DATA_PAYLOAD(data) ((data) & ((1ULL << 56) - 1))
+// Client recv/send payload: the client handle, generation in bits 24..55, slot in bits 0..23
+#define URING_HANDLE_PAYLOAD(handle) (((uint64_t)(handle).generation << 24) | (uint64_t)(handle).slot)
+#define URING_PAYLOAD_HANDLE(payload) \
+    ((ClientHandle){ .slot = (uint32_t)((payload) & 0xFFFFFF), .generation = (uint32_t)((payload) >> 24) })
+
+// Queued frames are tagged with their message type; these are the ones the
+// slow-consumer policies may shed. System and error frames are never dropped.
+#define FRAME_MASK(type) (1u << (type))
+#define CHAT_FRAMES FRAME_MASK(MSG_TYPE_CHAT)
+#define NON_CONTROL_FRAMES (FRAME_MASK(MSG_TYPE_CHAT) | FRAME_MASK(MSG_TYPE_USERLIST) | FRAME_MASK(MSG_TYPE_PRESENCE))
+#define PRESENCE_FRAMES (FRAME_MASK(MSG_TYPE_USERLIST) | FRAME_MASK(MSG_TYPE_PRESENCE))
+
+// --- Static Helper Function Declarations ---
+static void set_nonblocking(int fd);
+static bool server_watch_fd(Server *server, int fd, uint32_t events);
+static bool server_map_fd(Server *server, int fd, int client_index);
+static void server_handle_tick(Server *server);
+static void server_handle_presence_timer(Server *server);
+static void server_arm_keepalive(Server *server, int client_index);
+static void server_keepalive_expired(void *context, uint32_t client_index);
+static bool server_send_keepalive(Server *server, int client_index, MessageType type);
+static void server_handle_signal(Server *server);
+static void server_handle_wake(Server *server);
+static void *server_thread_main(void *arg);
+static void server_post(Server *target, ShardRoute route, const char *name, const uint8_t *data, size_t len,
+                        uint64_t received_us);
+static void server_post_message(Server *target, ShardMessage *msg);
+static void server_forward(Server *server, ShardRoute route, const char *name, const uint8_t *data, size_t len);
+static void server_deliver_local(Server *server, ShardRoute route, const char *name, const uint8_t *data, size_t len);
+static void server_deliver_client(Server *server, ClientHandle handle, const uint8_t *data, size_t len);
+static int server_find_client(Server *server, const char *username);
+static bool server_join_room(Server *server, int client_index, int room_id);
+static void server_leave_room(Server *server, int client_index);
+static void server_set_room(Server *server, int client_index, int room_id);
+static const uint8_t *server_current_version(const uint8_t *data, size_t *len, uint8_t *buf);
+static void server_remember_chat(Server *server, int room_id, const uint8_t *data, size_t len);
+static void server_archive_chat(Server *server, int room_id, const uint8_t *data, size_t len);
+static void server_replay_backlog(Server *server, int client_index, int room_id);
+static void server_send_replay(Server *server, int client_index, const uint8_t *data, size_t len);
+static void server_send_replay_frame(Server *server, int client_index, SharedFrame *frame);
+static void server_post_reply(ServerGroup *group, int shard, uint64_t reply_to, const uint8_t *frames, size_t len,
+                              const char *text);
+static void server_search_reply(void *context, int shard, uint64_t reply_to, const char *query, size_t query_len,
+                                const uint8_t *frames, size_t len, int matches);
+static void server_history_reply(void *context, int shard, uint64_t reply_to, const char *room,
+                                 const uint8_t *frames, size_t len, int found);
+static bool directory_add(ServerGroup *group, const char *username, int shard, ClientHandle handle, uint64_t *version);
+static bool directory_remove(ServerGroup *group, const char *username, int shard, ClientHandle handle, uint64_t *version);
+static bool directory_find(ServerGroup *group, const char *username, DirectoryEntry *entry);
+static size_t directory_probe(const ServerGroup *group, const char *username);
+static bool directory_rehash(ServerGroup *group, size_t bucket_count);
+static void server_poll_epoll(Server *server);
+static bool server_uring_init(Server *server);
+static void server_poll_uring(Server *server);
+static void server_uring_arm(Server *server, int op, int fd, uint64_t payload);
+static void server_handle_completion(Server *server, const struct io_uring_cqe *cqe);
+static int server_add_client(Server *server, int client_fd);
+static void server_accept_new_clients(Server *server);
+static bool server_handle_client_data(Server *server, int client_index);
+static bool server_consume_bytes(Server *server, int client_index, const uint8_t *data, size_t len);
+static bool server_parse_ring(Server *server, int client_index);
+static size_t server_frame_size(const Client *client, const uint8_t *raw_header);
+static bool server_acquire_recv_buffer(Server *server, Client *client);
+static void server_release_recv_buffer(Server *server, Client *client);
+static void server_client_disconnected(Server *server, int client_index);
+static bool server_send_to_client(Server *server, int client_index, const uint8_t *data, size_t len);
+static SharedFrame *server_create_frame(const uint8_t *data, size_t len);
+static SharedFrame *server_create_built_frame(const MessageBuilder *builder);
+static bool server_send_text(Server *server, int client_index, MessageType type, const char *text);
+static void server_announce(Server *server, const char *text, int sender_index);
+static void server_broadcast_outbound(Server *server, OutboundMessage *msg, int sender_index);
+static bool server_send_frame(Server *server, int client_index, SharedFrame *frame);
+static void outbound_init(OutboundMessage *msg, const uint8_t *data, size_t len);
+static bool outbound_init_built(OutboundMessage *msg, const MessageBuilder *builder);
+static SharedFrame *outbound_frame(OutboundMessage *msg, uint8_t version);
+static void outbound_release(Server *server, OutboundMessage *msg);
+static bool server_send_message(Server *server, int client_index, OutboundMessage *msg);
+static void server_flush_client(Server *server, int client_index);
+static void server_mark_dirty(Server *server, int client_index);
+static void server_flush_dirty(Server *server);
+static void server_check_flush_budget(Server *server);
+static bool client_handle_append(ClientHandle **list, int *count, int *capacity, ClientHandle handle);
+static ClientHandle server_client_handle(const Server *server, int client_index);
+static int server_resolve_client(const Server *server, ClientHandle handle);
+static int server_alloc_slot(Server *server);
+static void server_free_slot(Server *server, int index);
+static uint64_t server_now_us(void);
+static void server_update_clock(Server *server);
+static void server_record_latency(Server *server, int room_id, LatencyPhase phase, uint64_t value_us);
+static void server_decay_room_latency(Server *server);
+static void server_frame_written(void *context, const SharedFrame *frame, uint64_t queued_at);
+static void server_append_latency(char *msg, const char *label, const LatencyStats *stats);
+static bool server_admit_frame(Server *server, int client_index, uint8_t type, size_t len);
+static void server_check_grace(Server *server);
+static void server_publish_metrics(Server *server);
+static void server_uring_submit_send(Server *server, int client_index);
+static void orphan_send_free(OrphanSend *orphan);
+static void server_schedule_close(Server *server, int client_index);
+static void server_reap_closed(Server *server);
+static void server_remove_client(Server *server, int client_index);
+static void client_process_message(Server *server, int client_index, const uint8_t *message, size_t total_message_size);
+static void send_error_message(Server *server, int client_index, const char *message);
+/**
+ * @brief Sends the full user list to one client. The serialized list is cached
+ *        per shard and only rebuilt after the directory has changed.
+ * @param server A pointer to the Server struct.
+ * @param client_index The client to send it to.
+ */
+static void server_send_user_list(Server *server, int client_index);
+/**
+ * @brief Announces a join or leave to every shard. Each shard adds it to its
+ *        presence window, which is flushed when presence_window_ms runs out.
+ * @param server A pointer to the Server struct.
+ * @param action PRESENCE_JOIN or PRESENCE_LEAVE.
+ * @param username The user who joined or left.
+ * @param version directory_version right after the change.
+ */
+static void server_broadcast_presence(Server *server, PresenceAction action, const char *username, uint64_t version);
+static void server_queue_presence(Server *server, const PresenceEvent *event);
+/**
+ * @brief Closes the presence window: sends the net joins and leaves to every
+ *        registered client as one update. Users who joined and left again are
+ *        left out; clients whose user list was taken between those two
+ *        changes get a fresh list instead.
+ * @param server A pointer to the Server struct.
+ */
+static void server_flush_presence(Server *server);
+static SharedFrame *server_presence_frame(const PresenceEntry *entries, int count, uint8_t version);
+static void server_mark_presence_stale(Server *server, int client_index);
+static void server_resync_presence(Server *server);
 
 // --- Public Function Definitions ---
 
-bool server_init(Server *server, int port) {
+bool server_group_init(ServerGroup *group, const ServerConfig *config) {
+    group->config = *config;
+    group->shard_count = config->threads;
+    group->directory = NULL;
+    group->directory_count = 0;
+    group->directory_capacity = 0;
+    group->directory_buckets = NULL;
+    group->directory_bucket_count = 0;
+    group->directory_version = 0;
+    group->threads = NULL;
+    group->metrics = NULL;
+    group->metrics_server = (MetricsServer){ .listen_fd = -1, .stop_fd = -1 };
+    group->message_log = (MessageLog){ .fd = -1, .dir_fd = -1, .queue.wake.fd = -1 };
+    group->search = (SearchService){ .queue.wake.fd = -1 };
+    group->backlog.buckets = NULL;
+    pthread_mutex_init(&group->directory_lock, NULL);
+
+    // Block SIGINT/SIGTERM before any worker thread exists so every thread
+    // inherits the mask; shard 0 receives them through its signalfd.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    const int err = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (err != 0) {
+        LOG_ERROR("Error: pthread_sigmask failed: %s", strerror(err));
+        return false;
+    }
+
+    // Cache-line aligned so shards counting side by side do not share lines
+    group->metrics = aligned_alloc(_Alignof(ShardMetrics), sizeof(ShardMetrics) * (size_t)group->shard_count);
+    if (group->metrics == NULL) {
+        LOG_ERROR("Failed to allocate metrics: %s", strerror(errno));
+        return false;
+    }
+    memset(group->metrics, 0, sizeof(ShardMetrics) * (size_t)group->shard_count);
+
+    group->shards = calloc(group->shard_count, sizeof(Server));
+    if (group->shards == NULL) {
+        LOG_ERROR("Failed to allocate shards: %s", strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < group->shard_count; i++) {
+        if (!server_init(&group->shards[i], group, i)) {
+            // Only the shards initialized so far need shutting down
+            group->shard_count = i + 1;
+            return false;
+        }
+    }
+
+    if (config->backlog_frames > 0) {
+        // Room for the configured number of typical chat frames, and at least one of the largest
+        size_t backlog_bytes = (size_t)config->backlog_frames * BACKLOG_BYTES_PER_FRAME;
+        if (backlog_bytes < MAX_MESSAGE_SIZE) {
+            backlog_bytes = MAX_MESSAGE_SIZE;
+        }
+        if (!backlog_store_init(&group->backlog, config->backlog_frames, backlog_bytes, config->backlog_memory)) {
+            LOG_ERROR("Failed to allocate backlog store: %s", strerror(errno));
+            return false;
+        }
+    }
+    if ((config->metrics_port > 0 || config->metrics_socket != NULL) &&
+        !metrics_server_init(&group->metrics_server, config->metrics_port, config->metrics_socket,
+                             group->metrics, group->shard_count)) {
+        return false;
+    }
+    if (config->log_dir != NULL &&
+        !message_log_open(&group->message_log, config->log_dir, config->log_segment_size, server_history_reply, group)) {
+        return false;
+    }
+    if (config->search_memory > 0 &&
+        !search_service_init(&group->search, config->search_memory, server_search_reply, group)) {
+        return false;
+    }
+    return true;
+}
+
+bool server_group_run(ServerGroup *group) {
+    group->threads = calloc(group->shard_count, sizeof(pthread_t));
+    if (group->threads == NULL) {
+        LOG_ERROR("Failed to allocate worker threads: %s", strerror(errno));
+        return false;
+    }
+    if (group->metrics_server.listen_fd >= 0 && !metrics_server_start(&group->metrics_server)) {
+        LOG_INFO("Continuing without metrics");
+    }
+    if (group->config.log_dir != NULL && !message_log_start(&group->message_log)) {
+        return false;
+    }
+    if (group->config.search_memory > 0 && !search_service_start(&group->search)) {
+        return false;
+    }
+
+    int started = 1;
+    for (int i = 1; i < group->shard_count; i++) {
+        const int err = pthread_create(&group->threads[i], NULL, server_thread_main, &group->shards[i]);
+        if (err != 0) {
+            LOG_ERROR("pthread_create: %s", strerror(err));
+            break;
+        }
+        started++;
+    }
+
+    if (started == group->shard_count) {
+        server_thread_main(&group->shards[0]);
+    } else {
+        // Could not start every worker: stop the ones that did start
+        for (int i = 1; i < started; i++) {
+            server_post(&group->shards[i], SHARD_ROUTE_STOP, NULL, NULL, 0, 0);
+        }
+    }
+
+    for (int i = 1; i < started; i++) {
+        pthread_join(group->threads[i], NULL);
+    }
+    return started == group->shard_count;
+}
+
+void server_group_shutdown(ServerGroup *group) {
+    // The metrics thread reads the shards' counters; stop it first
+    metrics_server_close(&group->metrics_server);
+    // The search and history threads post replies to shard inboxes. The shard
+    // threads are joined, so no new queries or appends arrive; replies still
+    // posted are freed with the inboxes below, and the log writes out what
+    // the shards queued.
+    search_service_close(&group->search);
+    message_log_close(&group->message_log);
+    backlog_store_destroy(&group->backlog);
+    if (group->shards != NULL) {
+        for (int i = 0; i < group->shard_count; i++) {
+            server_shutdown(&group->shards[i]);
+        }
+        free(group->shards);
+        group->shards = NULL;
+    }
+    free(group->threads);
+    group->threads = NULL;
+    free(group->metrics);
+    group->metrics = NULL;
+    free(group->directory);
+    group->directory = NULL;
+    group->directory_count = 0;
+    free(group->directory_buckets);
+    group->directory_buckets = NULL;
+    group->directory_bucket_count = 0;
+    pthread_mutex_destroy(&group->directory_lock);
+}
+
+bool server_init(Server *server, ServerGroup *group, int shard_id) {
+    const ServerConfig *config = &group->config;
+    const int port = config->port;
+    server->group = group;
+    server->shard_id = shard_id;
+    server->backend = SERVER_BACKEND_EPOLL;
+    server->server_fd = -1;
+    server->epoll_fd = -1;
+    server->timer_fd = -1;
+    server->presence_timer_fd = -1;
+    server->signal_fd = -1;
+    server->inbox.wake.fd = -1;
+    server->running = true;
+    server->tick_count = 0;
+    server->fd_to_index = NULL;
+    server->fd_map_capacity = 0;
+    server->pending_close = NULL;
+    server->pending_close_count = 0;
+    server->pending_close_capacity = 0;
+    server->dirty = NULL;
+    server->dirty_count = 0;
+    server->dirty_capacity = 0;
+    server->phase_start_us = 0;
+    server->loop_start_us = 0;
+    server->clock_us = 0;
+    server->wall_clock_us = 0;
+    server->received_us = 0;
+    memset(&server->latency, 0, sizeof(server->latency));
+    for (int i = 0; i < LATENCY_TRACKED_ROOMS; i++) {
+        server->room_latency[i].room_id = -1;
+        server->room_latency[i].recent = 0;
+    }
+    memset(&server->flush_stats, 0, sizeof(server->flush_stats));
+    server->metrics = &group->metrics[shard_id];
+    server->orphan_sends = NULL;
+    memset(&server->slow_stats, 0, sizeof(server->slow_stats));
+    memset(server->userlist_snapshot, 0, sizeof(server->userlist_snapshot));
+    server->userlist_version = 0;
+    server->presence_stale_count = 0;
+    memset(&server->presence_stats, 0, sizeof(server->presence_stats));
+    timer_wheel_init(&server->keepalive, 0);
+    memset(&server->keepalive_stats, 0, sizeof(server->keepalive_stats));
+    buffer_pool_init(&server->recv_pool, RECV_BUFFER_SIZE, RECV_POOL_SLAB_BUFFERS);
+    server->recv_scratch = NULL;
     server->client_count = 0;
-    server->client_capacity = DEFAULT_CLIENT_COUNT;
+    server->client_slots_used = 0;
+    server->free_slot = -1;
+    // With --max-clients every slot is reserved up front and the array never moves
+    server->client_capacity = config->max_clients > 0 ? config->max_clients : DEFAULT_CLIENT_COUNT;
     server->clients = malloc(sizeof(Client) * server->client_capacity);
-    if (server->clients == NULL) {
-        perror("Failed to allocate initial client array");
+    if (server->clients == NULL || !timer_wheel_reserve(&server->keepalive, (uint32_t)server->client_capacity)) {
+        LOG_ERROR("Failed to allocate client slots: %s", strerror(errno));
+        return false;
+    }
+    server->recv_scratch = malloc(RECV_SCRATCH_SIZE);
+    if (server->recv_scratch == NULL) {
+        LOG_ERROR("Failed to allocate receive scratch buffer: %s", strerror(errno));
         return false;
     }
 
-    // Initialize default room
-    server->room_count = 1;
-    strncpy(server->rooms[0].name, "general", MAX_ROOM_NAME - 1);
-    server->rooms[0].client_count = 0;
+    // Initialize default room, which always gets GENERAL_ROOM_ID
+    if (!room_table_init(&server->rooms) || room_table_intern(&server->rooms, "general") != GENERAL_ROOM_ID) {
+        LOG_ERROR("Failed to allocate room table: %s", strerror(errno));
+        return false;
+    }
+    if (!presence_batch_init(&server->presence)) {
+        LOG_ERROR("Failed to allocate presence batch: %s", strerror(errno));
+        return false;
+    }
 
     server->server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server->server_fd < 0) {
-        perror("Error: Socket is not created");
+        LOG_ERROR("Error: Socket is not created: %s", strerror(errno));
         return false;
     }
 
     int opt = 1;
     if (setsockopt(server->server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
+        LOG_ERROR("setsockopt: %s", strerror(errno));
+    }
+    // Every shard binds its own listener; the kernel spreads connections between them
+    if (setsockopt(server->server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        LOG_ERROR("setsockopt SO_REUSEPORT: %s", strerror(errno));
     }
 
     struct sockaddr_in server_addr;
@@ -41,166 +402,1620 @@ bool server_init(Server *server, int port) {
     server_addr.sin_port = htons(port);
 
     if (bind(server->server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error: bind was not successful");
-        close(server->server_fd);
+        LOG_ERROR("Error: bind was not successful: %s", strerror(errno));
         return false;
     }
 
-    if (listen(server->server_fd, 10) < 0) {
-        perror("Error: listen was not successful");
-        close(server->server_fd);
+    if (listen(server->server_fd, SOMAXCONN) < 0) {
+        LOG_ERROR("Error: listen was not successful: %s", strerror(errno));
         return false;
     }
 
     set_nonblocking(server->server_fd);
-    printf("Bind successful, start listening on port %d\n", port);
+
+    // Periodic tick for housekeeping, delivered through epoll like any other fd
+    server->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (server->timer_fd < 0) {
+        LOG_ERROR("Error: timerfd_create failed: %s", strerror(errno));
+        return false;
+    }
+    struct itimerspec tick = {
+        .it_interval = { SERVER_TICK_MS / 1000, (SERVER_TICK_MS % 1000) * 1000000L },
+        .it_value    = { SERVER_TICK_MS / 1000, (SERVER_TICK_MS % 1000) * 1000000L }
+    };
+    if (timerfd_settime(server->timer_fd, 0, &tick, NULL) < 0) {
+        LOG_ERROR("Error: timerfd_settime failed: %s", strerror(errno));
+        return false;
+    }
+
+    // Armed when the first join or leave of a presence window arrives
+    server->presence_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (server->presence_timer_fd < 0) {
+        LOG_ERROR("Error: timerfd_create failed: %s", strerror(errno));
+        return false;
+    }
+
+    // SIGINT/SIGTERM are blocked by server_group_init; shard 0 receives them
+    // through a signalfd instead of a handler
+    if (shard_id == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        server->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (server->signal_fd < 0) {
+            LOG_ERROR("Error: signalfd failed: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    if (!wake_queue_init(&server->inbox)) {
+        return false;
+    }
+
+    if (config->backend == SERVER_BACKEND_IO_URING) {
+        if (server_uring_init(server)) {
+            server->backend = SERVER_BACKEND_IO_URING;
+        } else {
+            LOG_INFO("io_uring not available, falling back to epoll");
+        }
+    }
+
+    if (server->backend == SERVER_BACKEND_EPOLL) {
+        server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (server->epoll_fd < 0) {
+            LOG_ERROR("Error: epoll_create1 failed: %s", strerror(errno));
+            return false;
+        }
+
+        if (!server_watch_fd(server, server->server_fd, EPOLLIN | EPOLLET) ||
+            !server_watch_fd(server, server->timer_fd, EPOLLIN) ||
+            !server_watch_fd(server, server->presence_timer_fd, EPOLLIN) ||
+            !server_watch_fd(server, server->inbox.wake.fd, EPOLLIN) ||
+            (server->signal_fd >= 0 && !server_watch_fd(server, server->signal_fd, EPOLLIN))) {
+            return false;
+        }
+    }
+
+    LOG_INFO("Shard %d: bind successful, start listening on port %d (%s backend)", shard_id, port,
+           server->backend == SERVER_BACKEND_IO_URING ? "io_uring" : "epoll");
+    return true;
+}
+
+void server_shutdown(Server *server) {
+    LOG_INFO("Shard %d shutting down...", server->shard_id);
+    if (server->backend == SERVER_BACKEND_IO_URING) {
+        // Tear the ring down first so the kernel no longer references send buffers
+        uring_destroy(&server->uring);
+    }
+    if (server->clients != NULL) {
+        for (int i = 0; i < server->client_slots_used; i++) {
+            if (!server->clients[i].in_use) {
+                continue;
+            }
+            write_queue_clear(&server->clients[i].out);
+            free(server->clients[i].send_buf);
+            close(server->clients[i].fd);
+        }
+        free(server->clients);
+        server->clients = NULL;
+    }
+    while (server->orphan_sends != NULL) {
+        OrphanSend *orphan = server->orphan_sends;
+        server->orphan_sends = orphan->next;
+        orphan_send_free(orphan);
+    }
+    free(server->pending_close);
+    server->pending_close = NULL;
+    server->pending_close_count = 0;
+    for (int v = 0; v <= PROTOCOL_VERSION; v++) {
+        shared_frame_release(server->userlist_snapshot[v]);
+        server->userlist_snapshot[v] = NULL;
+    }
+    presence_batch_destroy(&server->presence);
+    timer_wheel_destroy(&server->keepalive);
+    buffer_pool_destroy(&server->recv_pool);
+    free(server->recv_scratch);
+    server->recv_scratch = NULL;
+    free(server->dirty);
+    server->dirty = NULL;
+    server->dirty_count = 0;
+    free(server->fd_to_index);
+    server->fd_to_index = NULL;
+    server->fd_map_capacity = 0;
+
+    if (server->server_fd >= 0) {
+        close(server->server_fd);
+        server->server_fd = -1;
+    }
+    if (server->timer_fd >= 0) {
+        close(server->timer_fd);
+        server->timer_fd = -1;
+    }
+    if (server->presence_timer_fd >= 0) {
+        close(server->presence_timer_fd);
+        server->presence_timer_fd = -1;
+    }
+    if (server->signal_fd >= 0) {
+        close(server->signal_fd);
+        server->signal_fd = -1;
+    }
+    wake_queue_destroy(&server->inbox);
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+        server->epoll_fd = -1;
+    }
+    room_table_destroy(&server->rooms);
+}
+
+void server_poll_events(Server *server) {
+    server->loop_start_us = 0;
+    if (server->backend == SERVER_BACKEND_IO_URING) {
+        server_poll_uring(server);
+    } else {
+        server_poll_epoll(server);
+    }
+
+    // Second phase: one gathered write per client that had output queued.
+    // Connections whose writes failed are removed here, outside any loop over
+    // clients; their disconnect announcements queue more output, so repeat
+    // until neither list has entries.
+    if (server->dirty_count > 0) {
+        server_update_clock(server);
+    }
+    while (server->dirty_count > 0 || server->pending_close_count > 0) {
+        server_flush_dirty(server);
+        server_reap_closed(server);
+    }
+
+    if (server->loop_start_us != 0) {
+        metric_observe(&server->metrics->loop_us, server_now_us() - server->loop_start_us);
+    }
+}
+
+void server_broadcast_message(Server *server, const uint8_t *data, const int len, int sender_index) {
+    // Encoded once per protocol version; recipients of a version share one frame
+    OutboundMessage msg;
+    outbound_init(&msg, data, (size_t)len);
+    server_broadcast_outbound(server, &msg, sender_index);
+    outbound_release(server, &msg);
+}
+
+// --- Static Helper Function Definitions ---
+
+// Event Loop Backends
+
+static void server_poll_epoll(Server *server) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    int ready = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+
+    if (ready < 0) {
+        if (errno == EINTR) {
+            return; // Interrupted by signal, just loop again
+        }
+        LOG_ERROR("epoll_wait error: %s", strerror(errno));
+        return;
+    }
+
+    server_update_clock(server);
+    server->phase_start_us = server->clock_us;
+    server->loop_start_us = server->clock_us;
+    for (int i = 0; i < ready; i++) {
+        const int fd = events[i].data.fd;
+
+        if (fd == server->server_fd) {
+            server_accept_new_clients(server);
+        } else if (fd == server->timer_fd) {
+            server_handle_tick(server);
+        } else if (fd == server->presence_timer_fd) {
+            server_handle_presence_timer(server);
+        } else if (fd == server->signal_fd) {
+            server_handle_signal(server);
+        } else if (fd == server->inbox.wake.fd) {
+            server_handle_wake(server);
+        } else {
+            // The client may already have been removed earlier in this batch
+            if (fd >= server->fd_map_capacity || server->fd_to_index[fd] < 0) {
+                continue;
+            }
+            const int index = server->fd_to_index[fd];
+            if (server->clients[index].closing) {
+                continue;
+            }
+
+            // Socket writable again: push out what earlier sends left queued
+            if (events[i].events & EPOLLOUT) {
+                server->clients[index].write_blocked = false;
+                server_flush_client(server, index);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                server_handle_client_data(server, index);
+            }
+        }
+        server_check_flush_budget(server);
+    }
+}
+
+static bool server_uring_init(Server *server) {
+    if (!uring_init(&server->uring, URING_ENTRIES)) {
+        return false;
+    }
+    // Provided buffer rings (5.19+) are the last feature multishot recv needs
+    if (!uring_setup_buffers(&server->uring, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE)) {
+        uring_destroy(&server->uring);
+        return false;
+    }
+
+    server_uring_arm(server, URING_OP_ACCEPT, server->server_fd, 0);
+    server_uring_arm(server, URING_OP_TIMER, server->timer_fd, 0);
+    server_uring_arm(server, URING_OP_PRESENCE_TIMER, server->presence_timer_fd, 0);
+    server_uring_arm(server, URING_OP_WAKE, server->inbox.wake.fd, 0);
+    if (server->signal_fd >= 0) {
+        server_uring_arm(server, URING_OP_SIGNAL, server->signal_fd, 0);
+    }
     return true;
 }
 
-void server_shutdown(Server *server) {
-    printf("Server shutting down...\n");
-    if (server->clients != NULL) {
-        for (int i = 0; i < server->client_count; i++) {
-            close(server->clients[i].fd);
-        }
-        free(server->clients);
-        server->clients = NULL;
+static void server_uring_arm(Server *server, int op, int fd, uint64_t payload) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, cannot arm fd %d", fd);
+        return;
+    }
+
+    switch (op) {
+        case URING_OP_ACCEPT:
+            uring_prep_multishot_accept(sqe, fd, URING_DATA(op, 0));
+            break;
+        case URING_OP_RECV:
+            uring_prep_multishot_recv(sqe, fd, URING_BUFFER_GROUP, URING_DATA(op, payload));
+            break;
+        case URING_OP_TIMER:
+        case URING_OP_PRESENCE_TIMER:
+        case URING_OP_SIGNAL:
+        case URING_OP_WAKE:
+            uring_prep_poll_multishot(sqe, fd, POLLIN, URING_DATA(op, 0));
+            break;
+        default:
+            break;
+    }
+}
+
+static void server_poll_uring(Server *server) {
+    // One syscall both submits everything queued since the last iteration
+    // (re-arms, sends) and waits for the next completion.
+    int ret = uring_submit_and_wait(&server->uring, 1);
+    if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+        LOG_ERROR("io_uring_enter failed: %s", strerror(-ret));
+        return;
+    }
+
+    server_update_clock(server);
+    server->phase_start_us = server->clock_us;
+    server->loop_start_us = server->clock_us;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&server->uring)) != NULL) {
+        const struct io_uring_cqe completion = *cqe;
+        uring_cqe_seen(&server->uring);
+        server_handle_completion(server, &completion);
+        server_check_flush_budget(server);
+    }
+}
+
+static void server_handle_completion(Server *server, const struct io_uring_cqe *cqe) {
+    const int op = URING_DATA_OP(cqe->user_data);
+    const uint64_t payload = URING_DATA_PAYLOAD(cqe->user_data);
+    const bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    switch (op) {
+        case URING_OP_ACCEPT:
+            if (cqe->res >= 0) {
+                server_add_client(server, cqe->res);
+            } else {
+                LOG_ERROR("accept failed: %s", strerror(-cqe->res));
+            }
+            if (!more) {
+                server_uring_arm(server, URING_OP_ACCEPT, server->server_fd, 0);
+            }
+            break;
+
+        case URING_OP_RECV: {
+            const bool has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+            const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+            // Completions can still arrive for a connection we already closed
+            const int index = server_resolve_client(server, URING_PAYLOAD_HANDLE(payload));
+            if (index < 0) {
+                if (has_buffer) {
+                    uring_recycle_buffer(&server->uring, bid);
+                }
+                break;
+            }
+
+            const int fd = server->clients[index].fd;
+            bool removed = false;
+            if (cqe->res > 0 && has_buffer) {
+                removed = server_consume_bytes(server, index, uring_buffer(&server->uring, bid), (size_t)cqe->res);
+            } else if (cqe->res == 0) {
+                server_client_disconnected(server, index);
+                removed = true;
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                // -ENOBUFS only means the buffer ring ran dry; anything else is fatal
+                LOG_ERROR("recv failed for client %d: %s", fd, strerror(-cqe->res));
+                server_remove_client(server, index);
+                removed = true;
+            }
+
+            if (has_buffer) {
+                uring_recycle_buffer(&server->uring, bid);
+            }
+            if (!removed && !more) {
+                server_uring_arm(server, URING_OP_RECV, fd, payload);
+            }
+            break;
+        }
+
+        case URING_OP_SEND: {
+            const int index = server_resolve_client(server, URING_PAYLOAD_HANDLE(payload));
+            if (index < 0) {
+                // The connection was removed while this send was in flight
+                for (OrphanSend **link = &server->orphan_sends; *link != NULL; link = &(*link)->next) {
+                    if ((*link)->payload == payload) {
+                        OrphanSend *orphan = *link;
+                        *link = orphan->next;
+                        orphan_send_free(orphan);
+                        break;
+                    }
+                }
+                break;
+            }
+
+            Client *client = &server->clients[index];
+            client->send_frames = 0;
+            if (cqe->res < 0) {
+                LOG_ERROR("send failed for client %d: %s", client->fd, strerror(-cqe->res));
+                server_schedule_close(server, index);
+                break;
+            }
+
+            // A short write leaves the rest of the last frame queued
+            FrameWriteContext written = { server, client->room_id };
+            server->flush_stats.frames += write_queue_consume(&client->out, (size_t)cqe->res,
+                                                              server_frame_written, &written);
+            server_uring_submit_send(server, index);
+            break;
+        }
+
+        case URING_OP_TIMER:
+            server_handle_tick(server);
+            if (!more) {
+                server_uring_arm(server, URING_OP_TIMER, server->timer_fd, 0);
+            }
+            break;
+
+        case URING_OP_PRESENCE_TIMER:
+            server_handle_presence_timer(server);
+            if (!more) {
+                server_uring_arm(server, URING_OP_PRESENCE_TIMER, server->presence_timer_fd, 0);
+            }
+            break;
+
+        case URING_OP_SIGNAL:
+            server_handle_signal(server);
+            if (!more) {
+                server_uring_arm(server, URING_OP_SIGNAL, server->signal_fd, 0);
+            }
+            break;
+
+        case URING_OP_WAKE:
+            server_handle_wake(server);
+            if (!more) {
+                server_uring_arm(server, URING_OP_WAKE, server->inbox.wake.fd, 0);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void server_uring_submit_send(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (client->send_frames > 0 || client->closing || write_queue_empty(&client->out)) {
+        return;
+    }
+
+    if (client->send_buf == NULL) {
+        client->send_buf = malloc(sizeof(UringSendBuf));
+        if (client->send_buf == NULL) {
+            LOG_ERROR("Failed to allocate send buffer for client %d", client->fd);
+            server_schedule_close(server, client_index);
+            return;
+        }
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+    if (sqe == NULL) {
+        LOG_ERROR("io_uring submission queue full, cannot send to client %d", client->fd);
+        server_schedule_close(server, client_index);
+        return;
+    }
+
+    // One send per client is in flight at a time to preserve frame order; it
+    // gathers everything queued since the last one, up to URING_SEND_IOV_MAX frames.
+    UringSendBuf *buf = client->send_buf;
+    memset(&buf->msg, 0, sizeof(buf->msg));
+    buf->msg.msg_iov = buf->iov;
+    buf->msg.msg_iovlen = (size_t)write_queue_fill_iov(&client->out, buf->iov, URING_SEND_IOV_MAX);
+    uring_prep_sendmsg(sqe, client->fd, &buf->msg,
+                       URING_DATA(URING_OP_SEND, URING_HANDLE_PAYLOAD(server_client_handle(server, client_index))));
+    client->send_frames = (int)buf->msg.msg_iovlen;
+    server->flush_stats.writes++;
+}
+
+static void orphan_send_free(OrphanSend *orphan) {
+    for (int i = 0; i < orphan->frame_count; i++) {
+        shared_frame_release(orphan->frames[i]);
+    }
+    free(orphan->send_buf);
+    free(orphan);
+}
+
+static void server_broadcast_outbound(Server *server, OutboundMessage *msg, int sender_index) {
+    // sender_index == -1 means broadcast to ALL (system messages)
+    if (sender_index < 0 || sender_index >= server->client_slots_used || !server->clients[sender_index].in_use) {
+        for (int j = 0; j < server->client_slots_used; j++) {
+            if (server->clients[j].in_use && !server_send_message(server, j, msg)) {
+                LOG_WARN("Failed to send to client %d", server->clients[j].fd);
+            }
+        }
+        server_forward(server, SHARD_ROUTE_ALL, NULL, msg->data, msg->len);
+        return;
+    }
+
+    // Broadcast only to members of the sender's room
+    const Room *room = room_table_get(&server->rooms, server->clients[sender_index].room_id);
+    LOG_DEBUG("Broadcasting to room '%s' (sender index %d)", room->name, sender_index);
+    server_forward(server, SHARD_ROUTE_ROOM, room->name, msg->data, msg->len);
+
+    for (int i = 0; i < room->member_count; i++) {
+        const int j = room->members[i];
+        if (j != sender_index && !server_send_message(server, j, msg)) {
+            LOG_WARN("Failed to send to client %d", server->clients[j].fd);
+        }
+    }
+}
+
+// System message to everyone the sender's messages reach, built straight into its frame
+static void server_announce(Server *server, const char *text, int sender_index) {
+    MessageBuilder builder;
+    OutboundMessage msg;
+    if (!protocol_build_text(&builder, PROTOCOL_VERSION, MSG_TYPE_SYSTEM, protocol_string_view(text)) ||
+        !outbound_init_built(&msg, &builder)) {
+        LOG_ERROR("Failed to create system message");
+        return;
+    }
+    server_broadcast_outbound(server, &msg, sender_index);
+    outbound_release(server, &msg);
+}
+
+// Reply in the client's protocol version, built straight into its frame
+static bool server_send_text(Server *server, int client_index, MessageType type, const char *text) {
+    MessageBuilder builder;
+    if (!protocol_build_text(&builder, server->clients[client_index].protocol_version, type,
+                             protocol_string_view(text))) {
+        LOG_ERROR("Failed to create %s message", protocol_get_type_name(type));
+        return false;
+    }
+    SharedFrame *frame = server_create_built_frame(&builder);
+    const bool ok = frame != NULL && server_send_frame(server, client_index, frame);
+    shared_frame_release(frame);
+    return ok;
+}
+
+static bool server_send_to_client(Server *server, int client_index, const uint8_t *data, size_t len) {
+    OutboundMessage msg;
+    outbound_init(&msg, data, len);
+    const bool ok = server_send_message(server, client_index, &msg);
+    outbound_release(server, &msg);
+    return ok;
+}
+
+static SharedFrame *server_create_frame(const uint8_t *data, size_t len) {
+    SharedFrame *frame = shared_frame_create(data, len, ((const MessageHeader *)data)->type);
+    if (frame == NULL) {
+        LOG_ERROR("Failed to allocate %zu byte frame", len);
+    }
+    return frame;
+}
+
+static SharedFrame *server_create_built_frame(const MessageBuilder *builder) {
+    SharedFrame *frame = shared_frame_create_gather(builder->iov, builder->iov_count,
+                                                    ((const MessageHeader *)builder->head)->type);
+    if (frame == NULL) {
+        LOG_ERROR("Failed to allocate %zu byte frame", builder->len);
+    }
+    return frame;
+}
+
+static void outbound_init(OutboundMessage *msg, const uint8_t *data, size_t len) {
+    msg->data = data;
+    msg->len = len;
+    memset(msg->frames, 0, sizeof(msg->frames));
+    msg->recipients = 0;
+}
+
+// The built frame is the message's encoding in its version and the source of the others
+static bool outbound_init_built(OutboundMessage *msg, const MessageBuilder *builder) {
+    SharedFrame *frame = server_create_built_frame(builder);
+    if (frame == NULL) {
+        return false;
+    }
+    outbound_init(msg, frame->data, frame->len);
+    msg->frames[((const MessageHeader *)frame->data)->version] = frame;
+    return true;
+}
+
+static SharedFrame *outbound_frame(OutboundMessage *msg, uint8_t version) {
+    if (msg->frames[version] != NULL) {
+        return msg->frames[version];
+    }
+    if (((const MessageHeader *)msg->data)->version == version) {
+        msg->frames[version] = server_create_frame(msg->data, msg->len);
+    } else {
+        uint8_t buf[MAX_MESSAGE_SIZE];
+        const int len = protocol_convert_message(msg->data, msg->len, version, buf);
+        if (len < 0) {
+            LOG_ERROR("Failed to encode message type 0x%02x as protocol v%d",
+                   ((const MessageHeader *)msg->data)->type, version);
+            return NULL;
+        }
+        msg->frames[version] = server_create_frame(buf, (size_t)len);
+    }
+    return msg->frames[version];
+}
+
+static void outbound_release(Server *server, OutboundMessage *msg) {
+    metric_observe(&server->metrics->fanout, (uint64_t)msg->recipients);
+    for (int v = 0; v <= PROTOCOL_VERSION; v++) {
+        shared_frame_release(msg->frames[v]);
+        msg->frames[v] = NULL;
+    }
+}
+
+static bool server_send_message(Server *server, int client_index, OutboundMessage *msg) {
+    SharedFrame *frame = outbound_frame(msg, server->clients[client_index].protocol_version);
+    if (frame == NULL) {
+        return false;
+    }
+    msg->recipients++;
+    return server_send_frame(server, client_index, frame);
+}
+
+static bool server_send_frame(Server *server, int client_index, SharedFrame *frame) {
+    Client *client = &server->clients[client_index];
+    if (client->closing) {
+        return false;
+    }
+
+    if (!server_admit_frame(server, client_index, frame->tag, frame->len)) {
+        return !client->closing; // Shed by the slow-consumer policy
+    }
+    if (frame->tag == MSG_TYPE_CHAT) {
+        const uint64_t waited = server->clock_us > server->received_us ? server->clock_us - server->received_us : 0;
+        server_record_latency(server, client->room_id, LATENCY_DISPATCH, waited);
+    }
+    // The queue's reference keeps the frame alive until it has been written
+    if (!write_queue_push(&client->out, frame, server->clock_us)) {
+        server_schedule_close(server, client_index);
+        return false;
+    }
+
+    // Coalesced into the end-of-iteration flush unless plenty is already queued
+    if (client->out.bytes_pending >= server->group->config.flush_bytes) {
+        server_flush_client(server, client_index);
+    } else {
+        server_mark_dirty(server, client_index);
+    }
+    return true;
+}
+
+static bool server_admit_frame(Server *server, int client_index, uint8_t type, size_t len) {
+    Client *client = &server->clients[client_index];
+    WriteQueue *out = &client->out;
+    const ServerConfig *config = &server->group->config;
+    const size_t budget = config->output_budget;
+
+    if (out->bytes_pending + len <= budget) {
+        return true;
+    }
+
+    // An io_uring send owns the frames it covers until it completes
+    const size_t keep = (size_t)client->send_frames;
+    SlowConsumerStats *stats = &server->slow_stats;
+    uint32_t droppable = 0;
+
+    switch (config->slow_policy) {
+        case SLOW_POLICY_DROP_OLDEST_CHAT:
+            droppable = CHAT_FRAMES;
+            stats->chat_dropped += write_queue_drop(out, droppable, out->bytes_pending + len - budget, keep);
+            break;
+
+        case SLOW_POLICY_DROP_NON_CONTROL:
+            droppable = NON_CONTROL_FRAMES;
+            const size_t dropped = write_queue_drop(out, droppable, SIZE_MAX, keep);
+            stats->non_control_dropped += dropped;
+            if (dropped > 0) {
+                server_mark_presence_stale(server, client_index); // Some of them may have been presence frames
+            }
+            break;
+
+        case SLOW_POLICY_DISCONNECT:
+            // The grace timer runs from the first frame over budget; the hard
+            // limit still bounds memory while it runs.
+            if (!client->over_budget) {
+                client->over_budget = true;
+                client->over_budget_tick = server->tick_count;
+            }
+            if (out->bytes_pending + len <= budget * SLOW_CONSUMER_HARD_LIMIT) {
+                return true;
+            }
+            break;
+    }
+
+    if (out->bytes_pending + len <= budget) {
+        return true;
+    }
+    if (droppable & FRAME_MASK(type)) {
+        if (PRESENCE_FRAMES & FRAME_MASK(type)) {
+            server_mark_presence_stale(server, client_index);
+        }
+        if (config->slow_policy == SLOW_POLICY_DROP_OLDEST_CHAT) {
+            stats->chat_dropped++;
+        } else {
+            stats->non_control_dropped++;
+        }
+        return false;
+    }
+
+    // Only frames the policy may not shed are left and they still do not fit
+    LOG_INFO("Client %d (%s) exceeded its output budget (%zu bytes pending), disconnecting",
+           client->fd, client->username[0] ? client->username : "unknown", out->bytes_pending);
+    stats->overflow_disconnects++;
+    server_schedule_close(server, client_index);
+    return false;
+}
+
+static void server_check_grace(Server *server) {
+    const ServerConfig *config = &server->group->config;
+    if (config->slow_policy != SLOW_POLICY_DISCONNECT) {
+        return;
+    }
+
+    for (int i = 0; i < server->client_slots_used; i++) {
+        Client *client = &server->clients[i];
+        if (!client->in_use || !client->over_budget || client->closing) {
+            continue;
+        }
+        if (client->out.bytes_pending <= config->output_budget) {
+            client->over_budget = false; // Caught up
+            continue;
+        }
+        if ((server->tick_count - client->over_budget_tick) * SERVER_TICK_MS >= (uint64_t)config->slow_grace_ms) {
+            LOG_INFO("Client %d (%s) stayed over its output budget for %d ms, disconnecting",
+                   client->fd, client->username[0] ? client->username : "unknown", config->slow_grace_ms);
+            server->slow_stats.grace_disconnects++;
+            server_schedule_close(server, i);
+        }
+    }
+}
+
+// Copies the state kept elsewhere into the shard's metrics for the exporter
+static void server_publish_metrics(Server *server) {
+    uint64_t queued_frames = 0;
+    uint64_t queued_bytes = 0;
+    uint64_t max_queued_bytes = 0;
+    for (int i = 0; i < server->client_slots_used; i++) {
+        const Client *client = &server->clients[i];
+        if (!client->in_use) {
+            continue;
+        }
+        queued_frames += client->out.depth;
+        queued_bytes += client->out.bytes_pending;
+        if (client->out.bytes_pending > max_queued_bytes) {
+            max_queued_bytes = client->out.bytes_pending;
+        }
+    }
+
+    ShardMetrics *metrics = server->metrics;
+    const SlowConsumerStats *stats = &server->slow_stats;
+    metric_set(&metrics->queued_frames, queued_frames);
+    metric_set(&metrics->queued_bytes, queued_bytes);
+    metric_set(&metrics->max_queued_bytes, max_queued_bytes);
+    metric_set(&metrics->frames_dropped, stats->chat_dropped + stats->non_control_dropped);
+    metric_set(&metrics->slow_disconnects, stats->grace_disconnects + stats->overflow_disconnects);
+    metric_set(&metrics->rooms, (uint64_t)server->rooms.room_count);
+}
+
+static void server_flush_client(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (client->closing) {
+        return;
+    }
+
+    if (server->backend == SERVER_BACKEND_IO_URING) {
+        server_uring_submit_send(server, client_index);
+        return;
+    }
+    if (client->write_blocked) {
+        return; // The next EPOLLOUT edge resumes the flush
+    }
+
+    while (!write_queue_empty(&client->out)) {
+        struct iovec iov[FLUSH_IOV_MAX];
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)write_queue_fill_iov(&client->out, iov, FLUSH_IOV_MAX);
+
+        ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        server->flush_stats.writes++;
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client->write_blocked = true;
+            } else {
+                LOG_ERROR("send failed for client %d: %s", client->fd, strerror(errno));
+                server_schedule_close(server, client_index);
+            }
+            return;
+        }
+        FrameWriteContext written = { server, client->room_id };
+        server->flush_stats.frames += write_queue_consume(&client->out, (size_t)sent,
+                                                          server_frame_written, &written);
+    }
+}
+
+static void server_mark_dirty(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (client->dirty) {
+        return;
+    }
+    if (!client_handle_append(&server->dirty, &server->dirty_count, &server->dirty_capacity,
+                              server_client_handle(server, client_index))) {
+        server_flush_client(server, client_index); // No room to defer it
+        return;
+    }
+    client->dirty = true;
+}
+
+static void server_flush_dirty(Server *server) {
+    for (int i = 0; i < server->dirty_count; i++) {
+        const int index = server_resolve_client(server, server->dirty[i]);
+        if (index < 0) {
+            continue; // Removed since it was queued
+        }
+        server->clients[index].dirty = false;
+        server_flush_client(server, index);
+    }
+    server->dirty_count = 0;
+}
+
+static void server_check_flush_budget(Server *server) {
+    if (server->dirty_count == 0) {
+        return;
+    }
+    const uint64_t now = server_now_us();
+    if (now - server->phase_start_us >= (uint64_t)server->group->config.flush_budget_us) {
+        // A long batch would otherwise hold every queued frame until it ends
+        server_update_clock(server);
+        server_flush_dirty(server);
+        if (server->backend == SERVER_BACKEND_IO_URING) {
+            uring_submit_and_wait(&server->uring, 0); // Hand the prepared sends to the kernel now
+        }
+        server->phase_start_us = now;
+    }
+}
+
+static bool client_handle_append(ClientHandle **list, int *count, int *capacity, ClientHandle handle) {
+    if (*count >= *capacity) {
+        int new_capacity = *capacity > 0 ? *capacity * 2 : DEFAULT_CLIENT_COUNT;
+        ClientHandle *new_list = realloc(*list, sizeof(ClientHandle) * new_capacity);
+        if (new_list == NULL) {
+            LOG_ERROR("error while reallocating client list: %s", strerror(errno));
+            return false;
+        }
+        *list = new_list;
+        *capacity = new_capacity;
+    }
+    (*list)[(*count)++] = handle;
+    return true;
+}
+
+static ClientHandle server_client_handle(const Server *server, int client_index) {
+    return (ClientHandle){ .slot = (uint32_t)client_index, .generation = server->clients[client_index].generation };
+}
+
+static int server_resolve_client(const Server *server, ClientHandle handle) {
+    if (handle.slot >= (uint32_t)server->client_slots_used) {
+        return -1;
+    }
+    const Client *client = &server->clients[handle.slot];
+    if (!client->in_use || client->generation != handle.generation) {
+        return -1;
+    }
+    return (int)handle.slot;
+}
+
+static uint64_t server_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Read once per loop iteration; everything handled in the iteration shares the value
+static void server_update_clock(Server *server) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    server->wall_clock_us = (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+    server->clock_us = server_now_us();
+    protocol_cache_timestamp(server->wall_clock_us / 1000u);
+}
+
+// Counts the sample for all rooms and, if it has a slot or can take one, for
+// room_id (unless it is negative). A room takes a free slot or one whose room
+// has gone quiet, so the slots settle on the busiest rooms.
+static void server_record_latency(Server *server, int room_id, LatencyPhase phase, uint64_t value_us) {
+    latency_record(&server->latency.phases[phase], value_us);
+    if (room_id < 0) {
+        return;
+    }
+    RoomLatency *slot = NULL;
+    RoomLatency *quiet = NULL;
+    for (int i = 0; i < LATENCY_TRACKED_ROOMS; i++) {
+        RoomLatency *entry = &server->room_latency[i];
+        if (entry->room_id == room_id) {
+            slot = entry;
+            break;
+        }
+        if (quiet == NULL && (entry->room_id < 0 || entry->recent == 0)) {
+            quiet = entry;
+        }
+    }
+    if (slot == NULL) {
+        if (quiet == NULL) {
+            return; // Every slot is taken by a busy room; still counted for all rooms
+        }
+        slot = quiet;
+        slot->room_id = room_id;
+        memset(&slot->stats, 0, sizeof(slot->stats));
+    }
+    slot->recent++;
+    latency_record(&slot->stats.phases[phase], value_us);
+}
+
+// Ages the per-room sample counts, so a room that stops sending soon gives up its slot
+static void server_decay_room_latency(Server *server) {
+    for (int i = 0; i < LATENCY_TRACKED_ROOMS; i++) {
+        server->room_latency[i].recent /= 2;
+    }
+}
+
+static void server_frame_written(void *context, const SharedFrame *frame, uint64_t queued_at) {
+    const FrameWriteContext *written = context;
+    Server *server = written->server;
+    const int type = frame->tag < METRICS_MESSAGE_TYPES ? frame->tag : 0;
+    metric_add(&server->metrics->frames_out[type], 1);
+    metric_add(&server->metrics->bytes_out[type], frame->len);
+    if (frame->tag == MSG_TYPE_CHAT) {
+        server_record_latency(server, written->room_id, LATENCY_FLUSH, server->clock_us - queued_at);
+    }
+}
+
+// One line of p50/p99/p999 per phase that has samples
+static void server_append_latency(char *msg, const char *label, const LatencyStats *stats) {
+    char line[256];
+    int len = snprintf(line, sizeof(line), "  %s:", label);
+    bool any = false;
+    for (int phase = 0; phase < LATENCY_PHASES; phase++) {
+        const LatencyHistogram *histogram = &stats->phases[phase];
+        if (histogram->count == 0 || len >= (int)sizeof(line)) {
+            continue;
+        }
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " %s %llu/%llu/%llu (%llu)",
+                        latency_phase_name((LatencyPhase)phase),
+                        (unsigned long long)latency_percentile(histogram, 0.50),
+                        (unsigned long long)latency_percentile(histogram, 0.99),
+                        (unsigned long long)latency_percentile(histogram, 0.999),
+                        (unsigned long long)histogram->count);
+        any = true;
+    }
+    // Leave room for the newline; once the message is full, lines are dropped
+    const size_t used = strlen(msg);
+    if (any && used + 2 < MAX_CONTENT_LEN) {
+        strncat(msg, line, MAX_CONTENT_LEN - used - 2);
+        strcat(msg, "\n");
+    }
+}
+
+static void server_schedule_close(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (client->closing) {
+        return;
+    }
+    if (client_handle_append(&server->pending_close, &server->pending_close_count,
+                             &server->pending_close_capacity, server_client_handle(server, client_index))) {
+        client->closing = true;
+    }
+}
+
+static void server_reap_closed(Server *server) {
+    // Disconnect announcements may schedule further closes, so re-read the count
+    for (int i = 0; i < server->pending_close_count; i++) {
+        const int index = server_resolve_client(server, server->pending_close[i]);
+        if (index >= 0) {
+            server_client_disconnected(server, index);
+        }
+    }
+    server->pending_close_count = 0;
+}
+
+// Room Management Functions
+
+static bool server_join_room(Server *server, int client_index, int room_id) {
+    Client *client = &server->clients[client_index];
+    Room *room = room_table_get(&server->rooms, room_id);
+    const int pos = room_add_member(room, client_index);
+    if (pos < 0) {
+        LOG_ERROR("Failed to add client fd=%d to room '%s'", client->fd, room->name);
+        return false;
+    }
+    client->room_id = room_id;
+    client->room_pos = pos;
+    LOG_DEBUG("Added client fd=%d to room '%s' (now %d clients)",
+           client->fd, room->name, room->member_count);
+    return true;
+}
+
+static void server_leave_room(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (client->room_pos < 0) {
+        return; // Not a member
+    }
+
+    Room *room = room_table_get(&server->rooms, client->room_id);
+    const int moved = room_remove_member(room, client->room_pos);
+    if (moved >= 0) {
+        server->clients[moved].room_pos = client->room_pos;
+    }
+    client->room_pos = -1;
+    LOG_DEBUG("Removed client fd=%d from room '%s' (now %d clients)",
+           client->fd, room->name, room->member_count);
+}
+
+// Points a client that is not a member of its room (yet, or any more) at
+// another room, -1 for none. The room it leaves is freed once no client
+// refers to it, and gives up its latency slot.
+static void server_set_room(Server *server, int client_index, int room_id) {
+    Client *client = &server->clients[client_index];
+    const int old_room = client->room_id;
+    if (room_id >= 0) {
+        room_table_retain(&server->rooms, room_id);
+    }
+    client->room_id = room_id;
+    if (!room_table_release(&server->rooms, old_room)) {
+        return;
+    }
+    for (int i = 0; i < LATENCY_TRACKED_ROOMS; i++) {
+        if (server->room_latency[i].room_id == old_room) {
+            server->room_latency[i].room_id = -1;
+            server->room_latency[i].recent = 0;
+        }
+    }
+}
+
+// The frame in the current protocol version: data itself, or its conversion
+// into buf (MAX_MESSAGE_SIZE bytes). NULL if it cannot be converted.
+static const uint8_t *server_current_version(const uint8_t *data, size_t *len, uint8_t *buf) {
+    if (((const MessageHeader *)data)->version == PROTOCOL_VERSION) {
+        return data;
+    }
+    const int converted = protocol_convert_message(data, *len, PROTOCOL_VERSION, buf);
+    if (converted <= 0) {
+        return NULL;
+    }
+    *len = (size_t)converted;
+    return buf;
+}
+
+// Keeps a chat frame for replay, in the current protocol version so that v2
+// joiners get it as is. Only the shard the sender is on stores it.
+static void server_remember_chat(Server *server, int room_id, const uint8_t *data, size_t len) {
+    if (server->group->config.backlog_frames == 0) {
+        return;
+    }
+    uint8_t buf[MAX_MESSAGE_SIZE];
+    const uint8_t *frame = server_current_version(data, &len, buf);
+    if (frame != NULL) {
+        backlog_store_append(&server->group->backlog, room_table_get(&server->rooms, room_id)->name, frame, len);
+    }
+}
+
+// Hands a chat frame to the on-disk log and the search index, in the current
+// protocol version. Only the shard the sender is on archives it.
+static void server_archive_chat(Server *server, int room_id, const uint8_t *data, size_t len) {
+    ServerGroup *group = server->group;
+    if (group->config.log_dir == NULL && group->config.search_memory == 0) {
+        return;
+    }
+    uint8_t buf[MAX_MESSAGE_SIZE];
+    const uint8_t *frame = server_current_version(data, &len, buf);
+    if (frame == NULL) {
+        return;
+    }
+    const Room *room = room_table_get(&server->rooms, room_id);
+    const uint64_t key = message_log_room_key(room->name, strlen(room->name));
+    if (group->config.log_dir != NULL) {
+        message_log_append(&group->message_log, key, server->wall_clock_us / 1000, frame, len);
+    }
+    if (group->config.search_memory > 0) {
+        search_service_index(&group->search, key, frame, len);
+    }
+}
+
+// Sends the room's backlog to a client that just joined, as one frame holding
+// every message back to back
+static void server_replay_backlog(Server *server, int client_index, int room_id) {
+    if (server->group->config.backlog_frames == 0) {
+        return;
+    }
+    BacklogStore *store = &server->group->backlog;
+    uint8_t *frames = malloc(store->backlog_bytes);
+    if (frames == NULL) {
+        LOG_ERROR("Failed to allocate %zu byte backlog copy", store->backlog_bytes);
+        return;
+    }
+    const size_t len = backlog_store_copy(store, room_table_get(&server->rooms, room_id)->name, frames);
+    server_send_replay(server, client_index, frames, len);
+    free(frames);
+}
+
+// Sends stored chat frames, back to back in the current protocol version, as
+// one frame, converted only for older clients
+static void server_send_replay(Server *server, int client_index, const uint8_t *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    const uint8_t version = server->clients[client_index].protocol_version;
+    size_t count = 0;
+    size_t pos = 0;
+    MessageHeader header;
+    while (pos < len && protocol_parse_header(data + pos, len - pos, &header)) {
+        pos += sizeof(MessageHeader) + header.content_len;
+        count++;
+    }
+    const size_t bound = version == PROTOCOL_VERSION ? len : count * MAX_MESSAGE_SIZE;
+    SharedFrame *frame = shared_frame_alloc(bound, MSG_TYPE_CHAT);
+    if (frame == NULL) {
+        LOG_ERROR("Failed to allocate %zu byte replay frame", bound);
+        return;
+    }
+    if (version == PROTOCOL_VERSION) {
+        memcpy(frame->data, data, len);
+        frame->len = len;
+    } else {
+        frame->len = 0;
+        pos = 0;
+        while (pos < len && protocol_parse_header(data + pos, len - pos, &header)) {
+            const size_t frame_len = sizeof(MessageHeader) + header.content_len;
+            // At least MAX_MESSAGE_SIZE is left for every frame not yet converted
+            const int n = protocol_convert_message(data + pos, frame_len, version, frame->data + frame->len);
+            if (n > 0) {
+                frame->len += (size_t)n;
+            }
+            pos += frame_len;
+        }
+    }
+    server_send_replay_frame(server, client_index, frame);
+    shared_frame_release(frame);
+}
+
+// Sends a replay built above. Over the output budget the slow-consumer policy
+// would shed it whole, so the oldest messages are left out until it fits in
+// what the client's queue has left.
+static void server_send_replay_frame(Server *server, int client_index, SharedFrame *frame) {
+    const size_t budget = server->group->config.output_budget;
+    const size_t pending = server->clients[client_index].out.bytes_pending;
+    const size_t room = pending < budget ? budget - pending : 0;
+    size_t skip = 0;
+    MessageHeader header;
+    while (frame->len - skip > room && protocol_parse_header(frame->data + skip, frame->len - skip, &header)) {
+        skip += sizeof(MessageHeader) + header.content_len;
+    }
+    if (skip > 0) {
+        frame->len -= skip;
+        memmove(frame->data, frame->data + skip, frame->len);
+    }
+
+    if (frame->len > 0) {
+        server->clients[client_index].replay_ms = server->wall_clock_us / 1000u;
+        server_send_frame(server, client_index, frame);
+    }
+}
+
+static bool server_watch_fd(Server *server, int fd, uint32_t events) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG_ERROR("epoll_ctl ADD: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool server_map_fd(Server *server, int fd, int client_index) {
+    if (fd >= server->fd_map_capacity) {
+        int new_capacity = server->fd_map_capacity > 0 ? server->fd_map_capacity : 64;
+        while (new_capacity <= fd) {
+            new_capacity *= 2;
+        }
+        int *new_map = realloc(server->fd_to_index, sizeof(int) * new_capacity);
+        if (new_map == NULL) {
+            LOG_ERROR("error while reallocating fd map: %s", strerror(errno));
+            return false;
+        }
+        for (int i = server->fd_map_capacity; i < new_capacity; i++) {
+            new_map[i] = -1;
+        }
+        server->fd_to_index = new_map;
+        server->fd_map_capacity = new_capacity;
+    }
+    server->fd_to_index[fd] = client_index;
+    return true;
+}
+
+static void server_handle_tick(Server *server) {
+    uint64_t expirations;
+    if (read(server->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    server->tick_count += expirations;
+    // Periodic housekeeping hooks in here
+    timer_wheel_advance(&server->keepalive, server->tick_count, server_keepalive_expired, server);
+    server_check_grace(server);
+    server_resync_presence(server);
+    server_decay_room_latency(server);
+    server_publish_metrics(server);
+}
+
+// Keep-alive
+
+static uint64_t keepalive_ticks(int ms) {
+    return ((uint64_t)ms + SERVER_TICK_MS - 1) / SERVER_TICK_MS;
+}
+
+// Sets a new client's timer to its first ping or idle deadline
+static void server_arm_keepalive(Server *server, int client_index) {
+    const ServerConfig *config = &server->group->config;
+    if (config->ping_interval_ms == 0 && config->idle_timeout_ms == 0) {
+        return;
+    }
+    const uint64_t ping = config->ping_interval_ms > 0 ? keepalive_ticks(config->ping_interval_ms) : UINT64_MAX;
+    const uint64_t idle = config->idle_timeout_ms > 0 ? keepalive_ticks(config->idle_timeout_ms) + 1 : UINT64_MAX;
+    timer_wheel_schedule(&server->keepalive, (uint32_t)client_index,
+                         server->tick_count + (ping < idle ? ping : idle));
+}
+
+// A client's keep-alive timer came due. Receiving only stamps
+// last_recv_tick; the timer is moved here, at most once per interval, to
+// whatever that stamp makes the next deadline.
+static void server_keepalive_expired(void *context, uint32_t client_index) {
+    Server *server = context;
+    Client *client = &server->clients[client_index];
+    if (!client->in_use || client->closing) {
+        return;
+    }
+    const ServerConfig *config = &server->group->config;
+    const uint64_t now = server->tick_count;
+    uint64_t next = UINT64_MAX;
+
+    if (config->idle_timeout_ms > 0) {
+        // The frame came in somewhere within its tick: one more keeps the
+        // timeout from running short
+        const uint64_t deadline = client->last_recv_tick + keepalive_ticks(config->idle_timeout_ms) + 1;
+        if (now >= deadline) {
+            LOG_INFO("Client %d (%s) silent for %d ms, disconnecting",
+                   client->fd, client->username[0] ? client->username : "unknown", config->idle_timeout_ms);
+            server->keepalive_stats.idle_disconnects++;
+            server_schedule_close(server, (int)client_index);
+            return;
+        }
+        next = deadline;
+    }
+    if (config->ping_interval_ms > 0) {
+        // Pinged again every interval while it stays silent
+        const uint64_t interval = keepalive_ticks(config->ping_interval_ms);
+        uint64_t ping_at = client->last_recv_tick + interval;
+        if (now >= ping_at) {
+            // A ping that could not be queued is tried again next interval;
+            // the idle deadline still stands either way
+            if (server_send_keepalive(server, (int)client_index, MSG_TYPE_PING)) {
+                server->keepalive_stats.pings++;
+            }
+            ping_at = now + interval;
+        }
+        if (ping_at < next) {
+            next = ping_at;
+        }
+    }
+    timer_wheel_schedule(&server->keepalive, client_index, next);
+}
+
+// PING or PONG in the client's protocol version
+static bool server_send_keepalive(Server *server, int client_index, MessageType type) {
+    uint8_t buffer[sizeof(MessageHeader)];
+    const int len = protocol_create_keepalive_message(buffer, server->clients[client_index].protocol_version, type);
+    if (len < 0) {
+        return false;
+    }
+    SharedFrame *frame = server_create_frame(buffer, (size_t)len);
+    const bool ok = frame != NULL && server_send_frame(server, client_index, frame);
+    shared_frame_release(frame);
+    return ok;
+}
+
+static void server_handle_presence_timer(Server *server) {
+    uint64_t expirations;
+    if (read(server->presence_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    server_flush_presence(server);
+}
+
+static void server_handle_signal(Server *server) {
+    struct signalfd_siginfo info;
+    while (read(server->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+            LOG_INFO("%s received, shutting down...", strsignal((int)info.ssi_signo));
+            server->running = false;
+            for (int i = 0; i < server->group->shard_count; i++) {
+                if (i != server->shard_id) {
+                    server_post(&server->group->shards[i], SHARD_ROUTE_STOP, NULL, NULL, 0, 0);
+                }
+            }
+        }
+    }
+}
+
+// Cross-Shard Messaging
+
+static void *server_thread_main(void *arg) {
+    Server *server = arg;
+    while (server->running) {
+        server_poll_events(server);
+    }
+    return NULL;
+}
+
+static void server_handle_wake(Server *server) {
+    wake_signal_clear(&server->inbox.wake);
+    MpscNode *node;
+    while ((node = wake_queue_pop(&server->inbox)) != NULL) {
+        ShardMessage *msg = (ShardMessage *)node;
+        if (msg->route == SHARD_ROUTE_STOP) {
+            server->running = false;
+        } else if (msg->route == SHARD_ROUTE_CLIENT) {
+            // A reply produced off the event loop; nothing to time it from
+            server->received_us = server->clock_us;
+            server_deliver_client(server, msg->client, msg->data, msg->len);
+        } else {
+            // Dispatch latency runs from when the first shard received the frame
+            server->received_us = msg->received_us;
+            server_deliver_local(server, msg->route, msg->target, msg->data, msg->len);
+        }
+        free(msg);
+    }
+}
+
+static void server_post(Server *target, ShardRoute route, const char *name, const uint8_t *data, size_t len,
+                        uint64_t received_us) {
+    ShardMessage *msg = malloc(sizeof(ShardMessage) + len);
+    if (msg == NULL) {
+        LOG_ERROR("Failed to allocate message for shard %d", target->shard_id);
+        return;
+    }
+    msg->route = route;
+    msg->target[0] = '\0';
+    if (name != NULL) {
+        strncpy(msg->target, name, MAX_ROOM_NAME - 1);
+        msg->target[MAX_ROOM_NAME - 1] = '\0';
+    }
+    msg->received_us = received_us;
+    msg->len = len;
+    if (len > 0) {
+        memcpy(msg->data, data, len);
+    }
+    server_post_message(target, msg);
+}
+
+// Queues a message the caller built on the target's inbox. Safe from any thread.
+static void server_post_message(Server *target, ShardMessage *msg) {
+    wake_queue_push(&target->inbox, &msg->node);
+}
+
+static void server_forward(Server *server, ShardRoute route, const char *name, const uint8_t *data, size_t len) {
+    for (int i = 0; i < server->group->shard_count; i++) {
+        if (i != server->shard_id) {
+            server_post(&server->group->shards[i], route, name, data, len, server->received_us);
+        }
+    }
+}
+
+static void server_deliver_local(Server *server, ShardRoute route, const char *name, const uint8_t *data, size_t len) {
+    switch (route) {
+        case SHARD_ROUTE_ROOM: {
+            // The sending shard stored chat in the shared backlog already
+            const int room_id = room_table_find(&server->rooms, name);
+            if (room_id < 0) {
+                break; // Nobody on this shard ever joined it
+            }
+            OutboundMessage msg;
+            outbound_init(&msg, data, len);
+            const Room *room = room_table_get(&server->rooms, room_id);
+            for (int i = 0; i < room->member_count; i++) {
+                server_send_message(server, room->members[i], &msg);
+            }
+            outbound_release(server, &msg);
+            break;
+        }
+
+        case SHARD_ROUTE_ALL: {
+            OutboundMessage msg;
+            outbound_init(&msg, data, len);
+            for (int j = 0; j < server->client_slots_used; j++) {
+                if (server->clients[j].in_use) {
+                    server_send_message(server, j, &msg);
+                }
+            }
+            outbound_release(server, &msg);
+            break;
+        }
+
+        case SHARD_ROUTE_PRESENCE: {
+            PresenceEvent event;
+            if (len == sizeof(event)) {
+                memcpy(&event, data, sizeof(event));
+                server_queue_presence(server, &event);
+            }
+            break;
+        }
+
+        case SHARD_ROUTE_USER: {
+            int index = server_find_client(server, name);
+            if (index >= 0) {
+                server_send_to_client(server, index, data, len);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+// Delivers a SHARD_ROUTE_CLIENT message: its leading chat frames as one
+// replay, then the rest one by one
+static void server_deliver_client(Server *server, ClientHandle handle, const uint8_t *data, size_t len) {
+    const int client_index = server_resolve_client(server, handle);
+    if (client_index < 0) {
+        return;  // Gone while the reply was on its way
     }
-    if (server->server_fd >= 0) {
-        close(server->server_fd);
-        server->server_fd = -1;
+    size_t chat_len = 0;
+    MessageHeader header;
+    while (chat_len < len && protocol_parse_header(data + chat_len, len - chat_len, &header) &&
+           header.type == MSG_TYPE_CHAT) {
+        chat_len += sizeof(MessageHeader) + header.content_len;
+    }
+    server_send_replay(server, client_index, data, chat_len);
+    size_t pos = chat_len;
+    while (pos < len && protocol_parse_header(data + pos, len - pos, &header)) {
+        const size_t frame_len = sizeof(MessageHeader) + header.content_len;
+        server_send_to_client(server, client_index, data + pos, frame_len);
+        pos += frame_len;
     }
-    // Rooms are statically allocated, no cleanup needed
 }
 
-void server_poll_events(Server *server) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(server->server_fd, &read_fds);
-    int max_fd = server->server_fd;
-
-    for (int i = 0; i < server->client_count; i++) {
-        FD_SET(server->clients[i].fd, &read_fds);
-        if (server->clients[i].fd > max_fd) {
-            max_fd = server->clients[i].fd;
-        }
+// Runs on a worker thread: posts a query's frames and a summary back to the
+// shard of the client that asked. reply_to is its handle, slot in the low 32
+// bits.
+static void server_post_reply(ServerGroup *group, int shard, uint64_t reply_to, const uint8_t *frames, size_t len,
+                              const char *text) {
+    uint8_t summary[MAX_MESSAGE_SIZE];
+    const int summary_len = protocol_create_system_message(summary, PROTOCOL_VERSION, text);
+    if (summary_len <= 0) {
+        LOG_ERROR("Failed to create reply summary");
+        return;
     }
 
-    int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-
-    if (activity < 0) {
-        if (errno == EINTR) {
-            return; // Interrupted by signal, just loop again
-        }
-        perror("select error");
+    ShardMessage *msg = malloc(sizeof(ShardMessage) + len + (size_t)summary_len);
+    if (msg == NULL) {
+        LOG_ERROR("Failed to allocate reply for shard %d", shard);
         return;
     }
+    msg->route = SHARD_ROUTE_CLIENT;
+    msg->target[0] = '\0';
+    msg->client = (ClientHandle){ .slot = (uint32_t)reply_to, .generation = (uint32_t)(reply_to >> 32) };
+    msg->received_us = 0;
+    msg->len = len + (size_t)summary_len;
+    memcpy(msg->data, frames, len);
+    memcpy(msg->data + len, summary, (size_t)summary_len);
+    server_post_message(&group->shards[shard], msg);
+}
 
-    // Check for new connections
-    if (FD_ISSET(server->server_fd, &read_fds)) {
-        server_accept_new_clients(server);
+// Runs on the search thread
+static void server_search_reply(void *context, int shard, uint64_t reply_to, const char *query, size_t query_len,
+                                const uint8_t *frames, size_t len, int matches) {
+    char text[MAX_CONTENT_LEN];
+    if (matches < 0) {
+        snprintf(text, sizeof(text), "Nothing to search for in \"%.*s\"", (int)query_len, query);
+    } else {
+        snprintf(text, sizeof(text), "%d matches for \"%.*s\"", matches, (int)query_len, query);
     }
+    server_post_reply(context, shard, reply_to, frames, len, text);
+}
 
-    // Check for client data
-    for (int i = 0; i < server->client_count; i++) {
-        if (FD_ISSET(server->clients[i].fd, &read_fds)) {
-            // Handle data, and if the client was removed, decrement i
-            // to correctly check the client that got shifted into its place.
-            if (server_handle_client_data(server, i)) {
-                i--;
-            }
-        }
-    }
+// Runs on the message log's reader thread
+static void server_history_reply(void *context, int shard, uint64_t reply_to, const char *room,
+                                 const uint8_t *frames, size_t len, int found) {
+    char text[MAX_CONTENT_LEN];
+    snprintf(text, sizeof(text), "%d messages from %s", found, room);
+    server_post_reply(context, shard, reply_to, frames, len, text);
 }
 
-void server_broadcast_message(Server *server, const uint8_t *data, const int len, int sender_index) {
-    // sender_index == -1 means broadcast to ALL (system messages)
-    if (sender_index < 0 || sender_index >= server->client_count) {
-        for (int j = 0; j < server->client_count; j++) {
-            ssize_t sent = send(server->clients[j].fd, data, len, MSG_NOSIGNAL);
-            if (sent < 0) {
-                printf("Failed to send to client %d\n", server->clients[j].fd);
-            }
-        }
-        return;
+static int server_find_client(Server *server, const char *username) {
+    DirectoryEntry entry;
+    if (!directory_find(server->group, username, &entry) || entry.shard != server->shard_id) {
+        return -1;
     }
+    return server_resolve_client(server, entry.handle);
+}
 
-    // Broadcast only to clients in same room as sender
-    const char *sender_room = server->clients[sender_index].current_room;
-    printf("Broadcasting to room '%s' (sender index %d)\n", sender_room, sender_index);
+// User Directory (shared by all shards)
 
-    for (int j = 0; j < server->client_count; j++) {
-        if (j != sender_index && strcmp(server->clients[j].current_room, sender_room) == 0) {
-            ssize_t sent = send(server->clients[j].fd, data, len, MSG_NOSIGNAL);
-            if (sent < 0) {
-                printf("Failed to send to client %d\n", server->clients[j].fd);
-            }
+static bool directory_add(ServerGroup *group, const char *username, int shard, ClientHandle handle, uint64_t *version) {
+    pthread_mutex_lock(&group->directory_lock);
+    // Keep the load factor at or below one half
+    if ((size_t)(group->directory_count + 1) * 2 > group->directory_bucket_count &&
+        !directory_rehash(group, group->directory_bucket_count > 0 ? group->directory_bucket_count * 2 : 64)) {
+        LOG_ERROR("error while growing user directory index: %s", strerror(errno));
+        pthread_mutex_unlock(&group->directory_lock);
+        return false;
+    }
+    const size_t bucket = directory_probe(group, username);
+    if (group->directory_buckets[bucket] != 0) {
+        pthread_mutex_unlock(&group->directory_lock);
+        return false; // Name already taken
+    }
+
+    if (group->directory_count >= group->directory_capacity) {
+        int new_capacity = group->directory_capacity > 0 ? group->directory_capacity * 2 : DEFAULT_CLIENT_COUNT;
+        DirectoryEntry *new_directory = realloc(group->directory, sizeof(DirectoryEntry) * new_capacity);
+        if (new_directory == NULL) {
+            LOG_ERROR("error while reallocating user directory: %s", strerror(errno));
+            pthread_mutex_unlock(&group->directory_lock);
+            return false;
         }
+        group->directory = new_directory;
+        group->directory_capacity = new_capacity;
     }
+    DirectoryEntry *entry = &group->directory[group->directory_count];
+    strncpy(entry->username, username, MAX_USERNAME_LEN - 1);
+    entry->username[MAX_USERNAME_LEN - 1] = '\0';
+    entry->shard = shard;
+    entry->handle = handle;
+    group->directory_buckets[bucket] = ++group->directory_count;
+    *version = ++group->directory_version;
+    pthread_mutex_unlock(&group->directory_lock);
+    return true;
 }
 
-// --- Static Helper Function Definitions ---
-
-// Room Management Functions
+static bool directory_remove(ServerGroup *group, const char *username, int shard, ClientHandle handle, uint64_t *version) {
+    pthread_mutex_lock(&group->directory_lock);
+    if (group->directory_bucket_count == 0) {
+        pthread_mutex_unlock(&group->directory_lock);
+        return false;
+    }
+    size_t hole = directory_probe(group, username);
+    const int index = group->directory_buckets[hole] - 1;
+    // Only the owning connection may release the name; it may already have been
+    // released and claimed by someone else
+    if (index < 0 || group->directory[index].shard != shard ||
+        group->directory[index].handle.slot != handle.slot ||
+        group->directory[index].handle.generation != handle.generation) {
+        pthread_mutex_unlock(&group->directory_lock);
+        return false;
+    }
 
-static Room* find_room(Server *server, const char *room_name) {
-    for (int i = 0; i < server->room_count; i++) {
-        if (strcmp(server->rooms[i].name, room_name) == 0) {
-            return &server->rooms[i];
+    // Backward-shift deletion: pull later entries of the probe chain into the
+    // hole unless that would move them before their home bucket
+    const size_t mask = group->directory_bucket_count - 1;
+    for (size_t next = (hole + 1) & mask; group->directory_buckets[next] != 0; next = (next + 1) & mask) {
+        const char *name = group->directory[group->directory_buckets[next] - 1].username;
+        const size_t home = name_hash(name, strnlen(name, MAX_USERNAME_LEN - 1)) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            group->directory_buckets[hole] = group->directory_buckets[next];
+            hole = next;
         }
     }
-    return NULL;
+    group->directory_buckets[hole] = 0;
+
+    // Keep the entries dense: move the last one into the freed index
+    const int last = group->directory_count - 1;
+    if (index != last) {
+        const size_t moved = directory_probe(group, group->directory[last].username);
+        group->directory[index] = group->directory[last];
+        group->directory_buckets[moved] = index + 1;
+    }
+    group->directory_count--;
+    *version = ++group->directory_version;
+    pthread_mutex_unlock(&group->directory_lock);
+    return true;
 }
 
-static void room_add_client(Room *room, int client_fd) {
-    for (int i = 0; i < room->client_count; i++) {
-        if (room->client_fds[i] == client_fd) {
-            return;  // Already in room
+static bool directory_find(ServerGroup *group, const char *username, DirectoryEntry *entry) {
+    bool found = false;
+    pthread_mutex_lock(&group->directory_lock);
+    if (group->directory_bucket_count > 0) {
+        const size_t bucket = directory_probe(group, username);
+        if (group->directory_buckets[bucket] != 0) {
+            *entry = group->directory[group->directory_buckets[bucket] - 1];
+            found = true;
         }
     }
-
-    if (room->client_count < 100) {
-        room->client_fds[room->client_count++] = client_fd;
-        printf("Added client fd=%d to room '%s' (now %d clients)\n",
-               client_fd, room->name, room->client_count);
-    }
+    pthread_mutex_unlock(&group->directory_lock);
+    return found;
 }
 
-static void room_remove_client(Room *room, int client_fd) {
-    for (int i = 0; i < room->client_count; i++) {
-        if (room->client_fds[i] == client_fd) {
-            memmove(&room->client_fds[i],
-                    &room->client_fds[i + 1],
-                    (room->client_count - i - 1) * sizeof(int));
-            room->client_count--;
-            printf("Removed client fd=%d from room '%s' (now %d clients)\n",
-                   client_fd, room->name, room->client_count);
+static size_t directory_probe(const ServerGroup *group, const char *username) {
+    // Bucket holding username, or the empty bucket where it would go. Caller holds directory_lock.
+    const size_t len = strnlen(username, MAX_USERNAME_LEN - 1);
+    const size_t mask = group->directory_bucket_count - 1;
+    size_t bucket = name_hash(username, len) & mask;
+    while (group->directory_buckets[bucket] != 0) {
+        const char *name = group->directory[group->directory_buckets[bucket] - 1].username;
+        if (strncmp(name, username, len) == 0 && name[len] == '\0') {
             break;
         }
+        bucket = (bucket + 1) & mask;
     }
+    return bucket;
 }
 
-static Room* create_room(Server *server, const char *room_name) {
-    if (server->room_count >= MAX_ROOMS) {
-        printf("ERROR: Cannot create room '%s', max rooms reached\n", room_name);
-        return NULL;
+static bool directory_rehash(ServerGroup *group, size_t bucket_count) {
+    int *buckets = calloc(bucket_count, sizeof(int));
+    if (buckets == NULL) {
+        return false;
     }
-
-    Room *room = &server->rooms[server->room_count++];
-    strncpy(room->name, room_name, MAX_ROOM_NAME - 1);
-    room->client_count = 0;
-    printf("Created new room: '%s'\n", room_name);
-    return room;
+    free(group->directory_buckets);
+    group->directory_buckets = buckets;
+    group->directory_bucket_count = bucket_count;
+    for (int i = 0; i < group->directory_count; i++) {
+        group->directory_buckets[directory_probe(group, group->directory[i].username)] = i + 1;
+    }
+    return true;
 }
 
 static void set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1) {
-        perror("fcntl F_GETFL");
+        LOG_ERROR("fcntl F_GETFL: %s", strerror(errno));
         return;
     }
     if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl F_SETFL");
+        LOG_ERROR("fcntl F_SETFL: %s", strerror(errno));
     }
 }
 
@@ -211,212 +2026,472 @@ static void server_accept_new_clients(Server *server) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break; // No more pending connections
             }
-            perror("accept error");
+            LOG_ERROR("accept error: %s", strerror(errno));
             break;
         }
 
-        set_nonblocking(client_fd);
+        server_add_client(server, client_fd);
+    }
+}
+
+static int server_add_client(Server *server, int client_fd) {
+    metric_add(&server->metrics->accepts, 1);
+    set_nonblocking(client_fd);
 
-        // Resize client array if full
-        if (server->client_count >= server->client_capacity) {
-            server->client_capacity *= 2;
-            Client *new_clients = realloc(server->clients, sizeof(Client) * server->client_capacity);
+    const int index = server_alloc_slot(server);
+    if (index < 0) {
+        close(client_fd);
+        return -1;
+    }
+
+    if (!server_map_fd(server, client_fd, index)) {
+        server_free_slot(server, index);
+        close(client_fd);
+        return -1;
+    }
+
+    // Set up the connection in its slot
+    Client *new_client = &server->clients[index];
+    new_client->fd = client_fd;
+    new_client->username[0] = '\0';
+    ring_buffer_init(&new_client->recv_ring, NULL, 0); // Storage is taken when a partial frame arrives
+    new_client->room_id = GENERAL_ROOM_ID;
+    room_table_retain(&server->rooms, GENERAL_ROOM_ID);
+    new_client->room_pos = -1; // Joins on registration
+    write_queue_init(&new_client->out);
+    new_client->send_frames = 0;
+    new_client->send_buf = NULL;
+    new_client->dirty = false;
+    new_client->write_blocked = false;
+    new_client->over_budget = false;
+    new_client->over_budget_tick = 0;
+    new_client->closing = false;
+    new_client->presence_stale = false;
+    new_client->presence_version = 0;
+    new_client->replay_ms = 0;
+    new_client->last_recv_tick = server->tick_count;
+    new_client->protocol_version = PROTOCOL_VERSION_1;
+    server_arm_keepalive(server, index);
+
+    // Register the fd once; it stays in the interest set until it is closed
+    if (server->backend == SERVER_BACKEND_IO_URING) {
+        server_uring_arm(server, URING_OP_RECV, client_fd,
+                         URING_HANDLE_PAYLOAD(server_client_handle(server, index)));
+    } else if (!server_watch_fd(server, client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+        server->fd_to_index[client_fd] = -1;
+        server_free_slot(server, index);
+        close(client_fd);
+        return -1;
+    }
+
+    LOG_INFO("New client connected: fd=%d (total clients: %d)",
+           client_fd, server->client_count);
 
+    // Send welcome message
+    server_send_text(server, index, MSG_TYPE_SYSTEM, "Welcome to the chat server! Please send your username.");
+    return index;
+}
+
+static int server_alloc_slot(Server *server) {
+    int index = server->free_slot;
+    if (index >= 0) {
+        server->free_slot = server->clients[index].next_free;
+    } else {
+        if (server->client_slots_used >= server->client_capacity) {
+            // Preallocated slots are a hard limit; otherwise grow, which only
+            // moves the array and leaves slot indices and handles valid
+            const int max_clients = server->group->config.max_clients;
+            if (max_clients > 0 || server->client_capacity * 2 > MAX_CLIENT_SLOTS) {
+                LOG_INFO("Shard %d is full (%d clients), refusing connection",
+                       server->shard_id, server->client_count);
+                return -1;
+            }
+            if (!timer_wheel_reserve(&server->keepalive, (uint32_t)server->client_capacity * 2)) {
+                LOG_ERROR("error while reallocating client timers: %s", strerror(errno));
+                return -1;
+            }
+            Client *new_clients = realloc(server->clients, sizeof(Client) * server->client_capacity * 2);
             if (new_clients == NULL) {
-                perror("error while reallocating memory");
-                close(client_fd);
-                continue;
+                LOG_ERROR("error while reallocating client slots: %s", strerror(errno));
+                return -1;
             }
             server->clients = new_clients;
+            server->client_capacity *= 2;
         }
+        index = server->client_slots_used++;
+        server->clients[index].generation = 0;
+    }
 
-        // Add new client to the list
-        Client *new_client = &server->clients[server->client_count];
-        new_client->fd = client_fd;
-        new_client->username[0] = '\0';
-        memset(new_client->recv_buffer, 0, MAX_MESSAGE_SIZE);
-        new_client->buffer_pos = 0;
-        strncpy(new_client->current_room, "general", MAX_ROOM_NAME - 1);
-
-        server->client_count++;
-        printf("New client connected: fd=%d (total clients: %d)\n",
-               client_fd, server->client_count);
+    server->clients[index].in_use = true;
+    server->client_count++;
+    metric_set(&server->metrics->connections, (uint64_t)server->client_count);
+    return index;
+}
 
-        // Send welcome message
-        uint8_t welcome_buf[MAX_MESSAGE_SIZE];
-        const char *welcome_text = "Welcome to the chat server! Please send your username.";
-        int welcome_len = protocol_create_system_message(welcome_buf, welcome_text);
-        if (welcome_len > 0) {
-            send(client_fd, welcome_buf, welcome_len, MSG_NOSIGNAL);
-        }
-    }
+static void server_free_slot(Server *server, int index) {
+    Client *client = &server->clients[index];
+    client->in_use = false;
+    client->fd = -1;
+    client->generation++;
+    timer_wheel_cancel(&server->keepalive, (uint32_t)index);
+    client->next_free = server->free_slot;
+    server->free_slot = index;
+    server->client_count--;
+    metric_set(&server->metrics->connections, (uint64_t)server->client_count);
 }
 
 static bool server_handle_client_data(Server *server, int client_index) {
     Client *client = &server->clients[client_index];
-    uint8_t temp_buffer[MAX_MESSAGE_SIZE];
 
-    ssize_t bytes = recv(client->fd, temp_buffer, MAX_MESSAGE_SIZE - 1, 0);
-
-    if (bytes > 0) {
-        if (client->buffer_pos + bytes > MAX_MESSAGE_SIZE) {
-            printf("ERROR: Buffer overflow for client %d\n", client->fd);
-            server_remove_client(server, client_index);
-            return true;
-        }
-        //server_remove_client(server, client_index);
-        memcpy(client->recv_buffer + client->buffer_pos,temp_buffer,bytes);
-        client->buffer_pos += bytes;
-        while (client->buffer_pos >= sizeof(MessageHeader)) {
-            MessageHeader header;
-            if (!protocol_parse_header(client->recv_buffer,client->buffer_pos,&header)) {
-                printf("ERROR: Invalid protocol header from client %d\n", client->fd);
+    // Edge-triggered: keep reading until the socket reports EAGAIN
+    while (1) {
+        ssize_t bytes;
+        if (client->recv_ring.data != NULL) {
+            // A partial frame is pending: read straight into the free space of its ring
+            struct iovec iov[2];
+            const int regions = ring_buffer_write_regions(&client->recv_ring, iov);
+            if (regions == 0) {
+                LOG_ERROR("Buffer overflow for client %d", client->fd);
                 server_remove_client(server, client_index);
                 return true;
             }
 
-            const size_t total_msg_size = sizeof(MessageHeader) + header.content_len;
+            bytes = readv(client->fd, iov, regions);
+            if (bytes > 0) {
+                ring_buffer_commit(&client->recv_ring, (size_t)bytes);
+                if (server_parse_ring(server, client_index)) {
+                    return true; // Client was removed
+                }
+            }
+        } else {
+            // Nothing pending: whole frames are parsed out of the shared scratch buffer
+            bytes = recv(client->fd, server->recv_scratch, RECV_SCRATCH_SIZE, 0);
+            if (bytes > 0 && server_consume_bytes(server, client_index, server->recv_scratch, (size_t)bytes)) {
+                return true; // Client was removed
+            }
+        }
 
-            if (client->buffer_pos < total_msg_size) {
-                printf("Waiting for the full message\n");
-                break;
+        if (bytes > 0) {
+            if (client->closing) {
+                return false; // Input from a connection being torn down is ignored
             }
+        } else if (bytes == 0) {
+            server_client_disconnected(server, client_index);
+            return true; // Client was removed
+        } else {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; // Drained
+            }
+            LOG_ERROR("recv error: %s", strerror(errno));
+            server_remove_client(server, client_index);
+            return true; // Client was removed
+        }
+    }
 
-            client_process_message(server,client_index,client->recv_buffer,total_msg_size);
+    return false; // Client was not removed
+}
 
-            const size_t remaining = client->buffer_pos - total_msg_size;
-            if (remaining > 0) {
-                memmove(client->recv_buffer,
-                       client->recv_buffer + total_msg_size,
-                       remaining);
-            }
-            client->buffer_pos = remaining;
+static bool server_consume_bytes(Server *server, int client_index, const uint8_t *data, size_t len) {
+    Client *client = &server->clients[client_index];
+    if (client->closing) {
+        return false; // Input from a connection being torn down is ignored
+    }
+
+    // Nothing buffered: parse whole frames straight out of the caller's buffer
+    while (ring_buffer_empty(&client->recv_ring) && len >= sizeof(MessageHeader)) {
+        const size_t total_msg_size = server_frame_size(client, data);
+        if (total_msg_size == 0) {
+            server_remove_client(server, client_index);
+            return true;
+        }
+        if (len < total_msg_size) {
+            break;
         }
 
-    } else if (bytes == 0) {
-        // Client disconnected gracefully
-        printf("Client %d (%s) disconnected\n",
-               client->fd, client->username[0] ? client->username : "unknown");
+        client_process_message(server, client_index, data, total_msg_size);
+        if (client->closing) {
+            return false;
+        }
+        data += total_msg_size;
+        len -= total_msg_size;
+    }
 
-        if (client->username[0] != '\0') {
-            char message[MAX_CONTENT_LEN];
-            uint8_t buffer[MAX_MESSAGE_SIZE];
-            snprintf(message, MAX_CONTENT_LEN, "%s left the chat\n", client->username);
-            const int buf_len = protocol_create_system_message(buffer,message);
-            server_broadcast_message(server, buffer,buf_len, client_index);
-            server_broadcast_user_list(server);
+    // A partial frame, or bytes behind one already buffered, go through the ring
+    while (len > 0) {
+        if (client->recv_ring.data == NULL && !server_acquire_recv_buffer(server, client)) {
+            server_remove_client(server, client_index);
+            return true;
         }
+        const size_t copied = ring_buffer_write(&client->recv_ring, data, len);
+        data += copied;
+        len -= copied;
 
-        server_remove_client(server, client_index);
-        return true; // Client was removed
-    } else {
-        // Error
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("recv error");
+        if (server_parse_ring(server, client_index)) {
+            return true;
+        }
+        if (client->closing) {
+            return false;
+        }
+        if (copied == 0) {
+            LOG_ERROR("Buffer overflow for client %d", client->fd);
             server_remove_client(server, client_index);
-            return true; // Client was removed
+            return true;
         }
     }
 
-    return false; // Client was not removed
+    return false;
+}
+
+static bool server_parse_ring(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    RingBuffer *ring = &client->recv_ring;
+    uint8_t scratch[MAX_MESSAGE_SIZE];
+
+    while (ring_buffer_used(ring) >= sizeof(MessageHeader)) {
+        const size_t total_msg_size = server_frame_size(client, ring_buffer_peek(ring, sizeof(MessageHeader), scratch));
+        if (total_msg_size == 0) {
+            server_remove_client(server, client_index);
+            return true;
+        }
+
+        if (ring_buffer_used(ring) < total_msg_size) {
+            LOG_DEBUG("Waiting for the full message");
+            break;
+        }
+
+        // Parsed in place; only a frame that wraps the end of the ring is copied
+        client_process_message(server, client_index, ring_buffer_peek(ring, total_msg_size, scratch), total_msg_size);
+        if (client->closing) {
+            return false;
+        }
+        ring_buffer_consume(ring, total_msg_size);
+    }
+
+    if (ring_buffer_empty(ring)) {
+        server_release_recv_buffer(server, client);
+    }
+    return false;
+}
+
+static bool server_acquire_recv_buffer(Server *server, Client *client) {
+    uint8_t *storage = buffer_pool_acquire(&server->recv_pool);
+    if (storage == NULL) {
+        LOG_ERROR("Failed to allocate receive buffer for client %d", client->fd);
+        return false;
+    }
+    ring_buffer_init(&client->recv_ring, storage, RECV_BUFFER_SIZE);
+    return true;
+}
+
+static void server_release_recv_buffer(Server *server, Client *client) {
+    buffer_pool_release(&server->recv_pool, client->recv_ring.data);
+    ring_buffer_init(&client->recv_ring, NULL, 0);
+}
+
+static size_t server_frame_size(const Client *client, const uint8_t *raw_header) {
+    MessageHeader header;
+    if (!protocol_parse_header(raw_header, sizeof(MessageHeader), &header)) {
+        LOG_ERROR("Invalid protocol header from client %d", client->fd);
+        return 0;
+    }
+
+    const size_t total_msg_size = sizeof(MessageHeader) + header.content_len;
+    if (total_msg_size > MAX_MESSAGE_SIZE) {
+        LOG_ERROR("Frame of %zu bytes from client %d exceeds the maximum", total_msg_size, client->fd);
+        return 0;
+    }
+    return total_msg_size;
+}
+
+static void server_client_disconnected(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+
+    // Client disconnected gracefully
+    LOG_INFO("Client %d (%s) disconnected",
+           client->fd, client->username[0] ? client->username : "unknown");
+
+    if (client->username[0] != '\0') {
+        char message[MAX_CONTENT_LEN];
+        snprintf(message, MAX_CONTENT_LEN, "%s left the chat\n", client->username);
+        server_announce(server, message, client_index);
+    }
+
+    server_remove_client(server, client_index);
 }
 
 static void server_remove_client(Server *server, int index) {
-    if (index < 0 || index >= server->client_count) {
+    if (index < 0 || index >= server->client_slots_used || !server->clients[index].in_use) {
         return;
     }
 
-    // Remove from current room
+    // Release the username, telling every shard the user left, and the room
     Client *client = &server->clients[index];
-    Room *room = find_room(server, client->current_room);
-    if (room) {
-        room_remove_client(room, client->fd);
+    uint64_t version;
+    if (client->username[0] != '\0' &&
+        directory_remove(server->group, client->username, server->shard_id, server_client_handle(server, index), &version)) {
+        server_broadcast_presence(server, PRESENCE_LEAVE, client->username, version);
+    }
+    if (client->presence_stale) {
+        server->presence_stale_count--;
     }
+    server_leave_room(server, index);
+    server_set_room(server, index, -1);
+
+    if (server->backend == SERVER_BACKEND_IO_URING) {
+        // Cancel the multishot recv (and any send) before closing: in-flight
+        // requests hold a file reference that close() alone would not drop.
+        struct io_uring_sqe *sqe = uring_get_sqe(&server->uring);
+        if (sqe != NULL) {
+            uring_prep_cancel_fd(sqe, client->fd, URING_DATA(URING_OP_CANCEL, 0));
+            uring_submit_and_wait(&server->uring, 0);
+        }
 
-    // Close the socket
-    close(server->clients[index].fd);
+        // Frames may still be in flight; keep them until the completion arrives
+        if (client->send_frames > 0) {
+            OrphanSend *orphan = malloc(sizeof(OrphanSend));
+            for (int i = 0; i < client->send_frames; i++) {
+                SharedFrame *frame = write_queue_detach_head(&client->out);
+                if (orphan != NULL) {
+                    orphan->frames[i] = frame;
+                }
+            }
+            if (orphan != NULL) {
+                orphan->payload = URING_HANDLE_PAYLOAD(server_client_handle(server, index));
+                orphan->send_buf = client->send_buf;
+                orphan->frame_count = client->send_frames;
+                orphan->next = server->orphan_sends;
+                server->orphan_sends = orphan;
+            }
+            // Without an orphan record the references are leaked rather than freed under the kernel
+            client->send_buf = NULL;
+            client->send_frames = 0;
+        }
+    }
+    write_queue_clear(&client->out);
+    free(client->send_buf);
+    buffer_pool_release(&server->recv_pool, client->recv_ring.data);
 
-    // Shift the rest of the array down
-    memmove(&server->clients[index],
-            &server->clients[index + 1],
-            (server->client_count - index - 1) * sizeof(Client));
+    // Close the socket (this also drops it from the epoll set)
+    server->fd_to_index[client->fd] = -1;
+    close(client->fd);
 
-    server->client_count--;
+    // The slot goes back on the free list; nothing else moves
+    server_free_slot(server, index);
 }
 
-static void client_process_message(Server *server, int client_index, uint8_t *message, size_t total_message_size) {
+static void client_process_message(Server *server, int client_index, const uint8_t *message, size_t total_message_size) {
     Client *client = &server->clients[client_index];
-
-    // Parse header to determine message type
-    MessageHeader header;
-    if (!protocol_parse_header(message, total_message_size, &header)) {
-        printf("ERROR: Failed to parse header from client %d\n", client->fd);
-        send_error_message(server, client_index, "Invalid message header");
+    const uint8_t raw_type = ((const MessageHeader *)message)->type;
+    const int type = raw_type < METRICS_MESSAGE_TYPES ? raw_type : 0;
+    metric_add(&server->metrics->frames_in[type], 1);
+    metric_add(&server->metrics->bytes_in[type], total_message_size);
+    // Any frame shows the peer is alive; its keep-alive timer catches up when it fires
+    client->last_recv_tick = server->tick_count;
+
+    // Validate the frame in place; the fields below point into the receive buffer
+    MessageView view;
+    if (!protocol_view_message(message, total_message_size, &view)) {
+        MessageHeader header;
+        if (!protocol_parse_header(message, total_message_size, &header)) {
+            LOG_ERROR("Failed to parse header from client %d", client->fd);
+            send_error_message(server, client_index, "Invalid message header");
+        } else if (header.type == MSG_TYPE_CHAT) {
+            LOG_ERROR("Failed to parse chat message from client %d", client->fd);
+            send_error_message(server, client_index, "Invalid chat message format");
+        } else if (header.type == MSG_TYPE_COMMAND) {
+            LOG_ERROR("Failed to parse command from client %d", client->fd);
+            send_error_message(server, client_index, "Invalid command format");
+        } else {
+            LOG_WARN("Unknown message type 0x%02x from client %d", header.type, client->fd);
+            send_error_message(server, client_index, "Unsupported message type");
+        }
         return;
     }
 
-    printf("DEBUG: Received message type 0x%02x from client %d\n", header.type, client->fd);
+    LOG_DEBUG("Received message type 0x%02x from client %d", view.header.type, client->fd);
+    server->received_us = server->clock_us;
+    // Replies follow the version the client last spoke
+    client->protocol_version = view.header.version;
 
     // Handle different message types
-    switch (header.type) {
+    switch (view.header.type) {
         case MSG_TYPE_CHAT: {
-            ChatMessage chat_msg;
-            if (!protocol_parse_chat_message(message, total_message_size, &chat_msg)) {
-                printf("ERROR: Failed to parse chat message from client %d\n", client->fd);
-                send_error_message(server, client_index, "Invalid chat message format");
-                return;
-            }
+            const StringView *username = &view.chat.username;
 
-            printf("DEBUG: Chat message - user='%s', room='%s', msg='%s'\n",
-                   chat_msg.username, chat_msg.room, chat_msg.message);
+            LOG_DEBUG("Chat message - user='%s', room='%s', msg='%s'", *username, view.chat.room, view.chat.message);
 
             // First message = username registration
             if (client->username[0] == '\0') {
-                strncpy(client->username, chat_msg.username, sizeof(client->username) - 1);
-                printf("Client %d registered username: %s\n", client->fd, client->username);
+                if (username->len == 0) {
+                    send_error_message(server, client_index, "Username must not be empty");
+                    break;
+                }
+                // The view fits MAX_USERNAME_LEN with its terminator
+                char name[MAX_USERNAME_LEN];
+                memcpy(name, username->data, username->len);
+                name[username->len] = '\0';
+
+                // Claiming the name in the directory also rejects duplicates on every shard
+                uint64_t version;
+                if (!directory_add(server->group, name, server->shard_id,
+                                   server_client_handle(server, client_index), &version)) {
+                    char error[MAX_CONTENT_LEN];
+                    snprintf(error, MAX_CONTENT_LEN, "Username '%s' is already taken", name);
+                    send_error_message(server, client_index, error);
+                    break;
+                }
+                memcpy(client->username, name, username->len + 1);
+                LOG_INFO("Client %d registered username: %s", client->fd, client->username);
 
-                // Add client to general room
-                Room *general = find_room(server, "general");
-                if (general) {
-                    room_add_client(general, client->fd);
+                // Add client to its room (general unless it already used /join)
+                if (client->room_pos < 0) {
+                    server_join_room(server, client_index, client->room_id);
                 }
 
                 // Send system message announcing new user
-                uint8_t announce_buf[MAX_MESSAGE_SIZE];
                 char announce_text[MAX_CONTENT_LEN];
                 snprintf(announce_text, MAX_CONTENT_LEN, "%s joined the chat", client->username);
-                int announce_len = protocol_create_system_message(announce_buf, announce_text);
-                if (announce_len > 0) {
-                    server_broadcast_message(server, announce_buf, announce_len, client_index);
-                }
-                server_broadcast_user_list(server);
+                server_announce(server, announce_text, client_index);
+                // The newcomer gets the whole list, everyone else a delta
+                server_send_user_list(server, client_index);
+                server_broadcast_presence(server, PRESENCE_JOIN, client->username, version);
             } else {
                 // Regular chat message - broadcast to all IN SAME ROOM (including sender)
-                printf("Broadcasting message from %s: %s\n", client->username, chat_msg.message);
-
-                // Send to everyone in the room (including sender)
-                const char *sender_room = client->current_room;
-                for (int j = 0; j < server->client_count; j++) {
-                    if (strcmp(server->clients[j].current_room, sender_room) == 0) {
-                        ssize_t sent = send(server->clients[j].fd, message, (int)total_message_size, MSG_NOSIGNAL);
-                        if (sent < 0) {
-                            printf("Failed to send to client %d\n", server->clients[j].fd);
-                        }
+                LOG_DEBUG("Broadcasting message from %s: %s", client->username, view.chat.message);
+                if (view.header.timestamp != 0) {  // 0: the client does not stamp its messages
+                    const uint64_t sent_us = view.header.timestamp * 1000u;
+                    server_record_latency(server, client->room_id, LATENCY_INGRESS,
+                                          server->wall_clock_us > sent_us ? server->wall_clock_us - sent_us : 0);
+                }
+
+                // Relay the received frame as is: one shared frame per protocol version
+                const Room *room = room_table_get(&server->rooms, client->room_id);
+                OutboundMessage out;
+                outbound_init(&out, message, total_message_size);
+                for (int i = 0; i < room->member_count; i++) {
+                    const int j = room->members[i];
+                    if (!server_send_message(server, j, &out)) {
+                        LOG_WARN("Failed to send to client %d", server->clients[j].fd);
                     }
                 }
+                outbound_release(server, &out);
+                server_forward(server, SHARD_ROUTE_ROOM, room->name, message, total_message_size);
+                server_remember_chat(server, client->room_id, message, total_message_size);
+                server_archive_chat(server, client->room_id, message, total_message_size);
             }
             break;
         }
 
         case MSG_TYPE_COMMAND: {
+            // Commands are parsed with the C string functions, so terminate a copy of the text
             CommandMessage cmd_msg;
-            if (!protocol_parse_command_message(message, total_message_size, &cmd_msg)) {
-                printf("ERROR: Failed to parse command from client %d\n", client->fd);
-                send_error_message(server, client_index, "Invalid command format");
-                return;
-            }
+            memcpy(cmd_msg.command, view.text.data, view.text.len);
+            cmd_msg.command[view.text.len] = '\0';
 
-            printf("DEBUG: Command from client %d: %s\n", client->fd, cmd_msg.command);
+            LOG_DEBUG("Command from client %d: %s", client->fd, cmd_msg.command);
 
             // Handle /dm <username> <message>
             if (strncmp(cmd_msg.command, "/dm ", 4) == 0) {
@@ -439,31 +2514,45 @@ static void client_process_message(Server *server, int client_index, uint8_t *me
                 if (dm_message == NULL || strlen(dm_message) == 0) {
                     send_error_message(server, client_index, "Usage: /dm <username> <message>");
                 } else {
-                    // Find target user
+                    // One directory lookup finds the target's shard and, if local, its slot
+                    DirectoryEntry target;
                     int target_index = -1;
-                    for (int j = 0; j < server->client_count; j++) {
-                        if (strcmp(server->clients[j].username, target_username) == 0) {
-                            target_index = j;
-                            break;
+                    int target_shard = -1;
+                    if (directory_find(server->group, target_username, &target)) {
+                        target_shard = target.shard;
+                        if (target_shard == server->shard_id) {
+                            target_index = server_resolve_client(server, target.handle);
+                            target_shard = target_index >= 0 ? target_shard : -1;
                         }
                     }
 
-                    if (target_index == -1) {
+                    if (target_shard < 0) {
                         char error[MAX_CONTENT_LEN];
                         snprintf(error, MAX_CONTENT_LEN, "User '%s' not found", target_username);
                         send_error_message(server, client_index, error);
                     } else {
-                        // Create DM as chat message with recipient username as "room"
-                        uint8_t dm_buf[MAX_MESSAGE_SIZE];
-                        int dm_len = protocol_create_chat_message(dm_buf,
-                                                                  client->username,
-                                                                  target_username,  // Use recipient as "room"
-                                                                  dm_message);
-                        if (dm_len > 0) {
+                        // Create DM as chat message with recipient username as "room";
+                        // the text is gathered straight into the one frame both sides share
+                        MessageBuilder dm;
+                        OutboundMessage out;
+                        bool built = protocol_build_chat(&dm, PROTOCOL_VERSION, protocol_string_view(client->username),
+                                                         protocol_string_view(target_username),  // Use recipient as "room"
+                                                         protocol_string_view(dm_message));
+                        if (built) {
+                            // Carry the sender's timestamp so delivery receipts measure end to end
+                            protocol_builder_set_timestamp(&dm, view.header.timestamp);
+                        }
+                        if (built && outbound_init_built(&out, &dm)) {
                             // Send to recipient
-                            send(server->clients[target_index].fd, dm_buf, dm_len, MSG_NOSIGNAL);
+                            if (target_index >= 0) {
+                                server_send_message(server, target_index, &out);
+                            } else {
+                                server_post(&server->group->shards[target_shard], SHARD_ROUTE_USER,
+                                            target_username, out.data, out.len, server->received_us);
+                            }
                             // Also send back to sender (so they see it)
-                            send(client->fd, dm_buf, dm_len, MSG_NOSIGNAL);
+                            server_send_message(server, client_index, &out);
+                            outbound_release(server, &out);
                         }
                     }
                 }
@@ -472,66 +2561,195 @@ static void client_process_message(Server *server, int client_index, uint8_t *me
             else if (strncmp(cmd_msg.command, "/join ", 6) == 0) {
                 const char *room_name = cmd_msg.command + 6;
 
-                // Remove from old room
-                Room *old_room = find_room(server, client->current_room);
-                if (old_room) {
-                    room_remove_client(old_room, client->fd);
-                }
-
                 // Find or create new room
-                Room *new_room = find_room(server, room_name);
-                if (!new_room) {
-                    new_room = create_room(server, room_name);
+                const int room_id = room_table_intern(&server->rooms, room_name);
+                const bool moved = room_id >= 0 && room_id != client->room_id;
+                if (moved) {
+                    // Leave the old room; a client that has not registered yet is not a member
+                    const bool member = client->room_pos >= 0;
+                    server_leave_room(server, client_index);
+                    server_set_room(server, client_index, room_id);
+                    if (member && !server_join_room(server, client_index, room_id)) {
+                        server_set_room(server, client_index, GENERAL_ROOM_ID);
+                        server_join_room(server, client_index, GENERAL_ROOM_ID);
+                    }
                 }
 
-                if (new_room) {
-                    strncpy(client->current_room, room_name, MAX_ROOM_NAME - 1);
-                    room_add_client(new_room, client->fd);
-
+                if (room_id >= 0 && room_id == client->room_id) {
                     char msg[MAX_CONTENT_LEN];
                     snprintf(msg, MAX_CONTENT_LEN, "Joined room: %s", room_name);
-                    uint8_t buf[MAX_MESSAGE_SIZE];
-                    int len = protocol_create_system_message(buf, msg);
-                    send(client->fd, buf, len, MSG_NOSIGNAL);
+                    server_send_text(server, client_index, MSG_TYPE_SYSTEM, msg);
+                    if (moved) {
+                        server_replay_backlog(server, client_index, room_id);
+                    }
                 } else {
-                    send_error_message(server, client_index, "Failed to join room (max rooms reached)");
+                    send_error_message(server, client_index, "Failed to join room");
                 }
             }
             // Handle /rooms
             else if (strcmp(cmd_msg.command, "/rooms") == 0) {
                 char msg[MAX_CONTENT_LEN] = "Available rooms:\n";
-                for (int i = 0; i < server->room_count; i++) {
+                for (int i = 0; i < server->rooms.room_slots_used; i++) {
+                    const Room *room = room_table_get(&server->rooms, i);
+                    if (!room->in_use) {
+                        continue;
+                    }
                     char line[128];
-                    snprintf(line, 128, "  - %s (%d users)\n",
-                             server->rooms[i].name,
-                             server->rooms[i].client_count);
+                    snprintf(line, 128, "  - %s (%d users)\n", room->name, room->member_count);
                     strncat(msg, line, MAX_CONTENT_LEN - strlen(msg) - 1);
                 }
 
-                uint8_t buf[MAX_MESSAGE_SIZE];
-                int len = protocol_create_system_message(buf, msg);
-                send(client->fd, buf, len, MSG_NOSIGNAL);
+                server_send_text(server, client_index, MSG_TYPE_SYSTEM, msg);
+            }
+            // Handle /history <room> <from> <count>; answered later from the log's reader thread
+            else if (strncmp(cmd_msg.command, "/history ", 9) == 0) {
+                char room_name[MAX_ROOM_NAME];
+                unsigned long long from;
+                int count;
+                if (sscanf(cmd_msg.command + 9, "%63s %llu %d", room_name, &from, &count) != 3 ||
+                    count < 1 || count > MAX_HISTORY_COUNT) {
+                    char error[MAX_CONTENT_LEN];
+                    snprintf(error, MAX_CONTENT_LEN, "Usage: /history <room> <from ms> <count 1-%d>",
+                             MAX_HISTORY_COUNT);
+                    send_error_message(server, client_index, error);
+                } else if (server->group->config.log_dir == NULL) {
+                    send_error_message(server, client_index, "History is not kept on this server");
+                } else {
+                    const ClientHandle handle = server_client_handle(server, client_index);
+                    if (!message_log_query(&server->group->message_log, room_name, from, count, server->shard_id,
+                                           ((uint64_t)handle.generation << 32) | handle.slot)) {
+                        send_error_message(server, client_index, "History is busy, try again later");
+                    }
+                }
+            }
+            // Handle /search <room> <terms>; answered later from the search thread
+            else if (strncmp(cmd_msg.command, "/search ", 8) == 0) {
+                char room_name[MAX_ROOM_NAME];
+                int terms = 0;
+                if (sscanf(cmd_msg.command + 8, "%63s %n", room_name, &terms) != 1 || terms == 0 ||
+                    cmd_msg.command[8 + terms] == '\0') {
+                    send_error_message(server, client_index, "Usage: /search <room> <terms>");
+                } else if (server->group->config.search_memory == 0) {
+                    send_error_message(server, client_index, "Search is not enabled on this server");
+                } else {
+                    const char *query = cmd_msg.command + 8 + terms;
+                    const ClientHandle handle = server_client_handle(server, client_index);
+                    if (!search_service_query(&server->group->search,
+                                              message_log_room_key(room_name, strlen(room_name)),
+                                              query, strlen(query), SEARCH_RESULT_COUNT, server->shard_id,
+                                              ((uint64_t)handle.generation << 32) | handle.slot)) {
+                        send_error_message(server, client_index, "Search is busy, try again later");
+                    }
+                }
             }
             // Handle /leave
             else if (strcmp(cmd_msg.command, "/leave") == 0) {
-                if (strcmp(client->current_room, "general") == 0) {
+                if (client->room_id == GENERAL_ROOM_ID) {
                     send_error_message(server, client_index, "Already in general room");
                 } else {
-                    Room *old_room = find_room(server, client->current_room);
-                    if (old_room) {
-                        room_remove_client(old_room, client->fd);
+                    const bool member = client->room_pos >= 0;
+                    server_leave_room(server, client_index);
+                    server_set_room(server, client_index, GENERAL_ROOM_ID);
+                    if (member) {
+                        server_join_room(server, client_index, GENERAL_ROOM_ID);
+                    }
+
+                    server_send_text(server, client_index, MSG_TYPE_SYSTEM, "Returned to general room");
+                }
+            }
+            // Handle /stats
+            else if (strcmp(cmd_msg.command, "/stats") == 0) {
+                int backlogged = 0;
+                for (int i = 0; i < server->client_slots_used; i++) {
+                    if (server->clients[i].in_use && !write_queue_empty(&server->clients[i].out)) {
+                        backlogged++;
                     }
+                }
 
-                    strncpy(client->current_room, "general", MAX_ROOM_NAME - 1);
-                    Room *general = find_room(server, "general");
-                    if (general) {
-                        room_add_client(general, client->fd);
+                char msg[MAX_CONTENT_LEN];
+                snprintf(msg, MAX_CONTENT_LEN, "Shard %d: %d clients, %d with pending output\n",
+                         server->shard_id, server->client_count, backlogged);
+                const SlowConsumerStats *stats = &server->slow_stats;
+                char counters[256];
+                snprintf(counters, sizeof(counters),
+                         "Slow consumers: %llu chat dropped, %llu non-control dropped, "
+                         "%llu grace disconnects, %llu overflow disconnects\n",
+                         (unsigned long long)stats->chat_dropped,
+                         (unsigned long long)stats->non_control_dropped,
+                         (unsigned long long)stats->grace_disconnects,
+                         (unsigned long long)stats->overflow_disconnects);
+                strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                snprintf(counters, sizeof(counters), "Writes: %llu syscalls for %llu frames\n",
+                         (unsigned long long)server->flush_stats.writes,
+                         (unsigned long long)server->flush_stats.frames);
+                strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                snprintf(counters, sizeof(counters), "Receive buffers: %zu in use of %zu pooled (%zu bytes)\n",
+                         server->recv_pool.in_use, buffer_pool_capacity(&server->recv_pool),
+                         buffer_pool_capacity(&server->recv_pool) * RECV_BUFFER_SIZE);
+                strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                const PresenceStats *presence = &server->presence_stats;
+                snprintf(counters, sizeof(counters),
+                         "Presence: %llu changes, %llu coalesced, %llu entries sent in %llu updates\n",
+                         (unsigned long long)presence->changes,
+                         (unsigned long long)presence->coalesced,
+                         (unsigned long long)presence->entries,
+                         (unsigned long long)presence->batches);
+                strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                const KeepaliveStats *keepalive = &server->keepalive_stats;
+                snprintf(counters, sizeof(counters),
+                         "Keep-alive: %llu pings sent, %llu client pings answered, %llu idle disconnects\n",
+                         (unsigned long long)keepalive->pings,
+                         (unsigned long long)keepalive->pongs,
+                         (unsigned long long)keepalive->idle_disconnects);
+                strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                if (server->group->config.log_dir != NULL) {
+                    const MessageLog *log = &server->group->message_log;
+                    snprintf(counters, sizeof(counters),
+                             "Message log: %llu records, %llu bytes durable in %llu commits, %llu dropped\n",
+                             (unsigned long long)atomic_load(&log->records),
+                             (unsigned long long)atomic_load(&log->durable),
+                             (unsigned long long)atomic_load(&log->commits),
+                             (unsigned long long)atomic_load(&log->dropped));
+                    strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                }
+                if (server->group->config.search_memory > 0) {
+                    const SearchService *search = &server->group->search;
+                    snprintf(counters, sizeof(counters),
+                             "Search: %llu messages indexed in %llu bytes, %llu evicted, %llu queries, %llu dropped\n",
+                             (unsigned long long)atomic_load(&search->indexed),
+                             (unsigned long long)atomic_load(&search->bytes),
+                             (unsigned long long)atomic_load(&search->evicted),
+                             (unsigned long long)atomic_load(&search->queries),
+                             (unsigned long long)atomic_load(&search->dropped));
+                    strncat(msg, counters, MAX_CONTENT_LEN - strlen(msg) - 1);
+                }
+                for (int i = 0; i < server->client_slots_used; i++) {
+                    const Client *other = &server->clients[i];
+                    if (!other->in_use || write_queue_empty(&other->out)) {
+                        continue;
                     }
+                    char line[128];
+                    snprintf(line, 128, "  - %s (fd %d): %zu frames, %zu bytes pending\n",
+                             other->username[0] ? other->username : "unknown", other->fd,
+                             other->out.depth, other->out.bytes_pending);
+                    strncat(msg, line, MAX_CONTENT_LEN - strlen(msg) - 1);
+                }
 
-                    uint8_t buf[MAX_MESSAGE_SIZE];
-                    int len = protocol_create_system_message(buf, "Returned to general room");
-                    send(client->fd, buf, len, MSG_NOSIGNAL);
+                server_send_text(server, client_index, MSG_TYPE_SYSTEM, msg);
+            }
+            // Handle /latency
+            else if (strcmp(cmd_msg.command, "/latency") == 0) {
+                char msg[MAX_CONTENT_LEN];
+                snprintf(msg, MAX_CONTENT_LEN,
+                         "Shard %d chat latency in us, p50/p99/p999 (samples):\n", server->shard_id);
+                server_append_latency(msg, "all rooms", &server->latency);
+                for (int i = 0; i < LATENCY_TRACKED_ROOMS; i++) {
+                    const RoomLatency *room = &server->room_latency[i];
+                    if (room->room_id >= 0) {
+                        server_append_latency(msg, room_table_get(&server->rooms, room->room_id)->name, &room->stats);
+                    }
                 }
+                server_send_text(server, client_index, MSG_TYPE_SYSTEM, msg);
             }
             // Handle /help
             else if (strcmp(cmd_msg.command, "/help") == 0) {
@@ -539,13 +2757,15 @@ static void client_process_message(Server *server, int client_index, uint8_t *me
                     "Available commands:\n"
                     "  /help - Show this help message\n"
                     "  /rooms - List all rooms\n"
+                    "  /history <room> <from> <count> - Show messages sent since a time (ms)\n"
+                    "  /search <room> <terms> - Show recent messages containing every term\n"
                     "  /join <room> - Join or create a room\n"
                     "  /leave - Return to general room\n"
+                    "  /stats - Show pending output and slow-consumer counters\n"
+                    "  /latency - Show chat latency percentiles per phase and room\n"
                     "  /dm <username> <message> - Send direct message";
 
-                uint8_t buf[MAX_MESSAGE_SIZE];
-                int len = protocol_create_system_message(buf, help_text);
-                send(client->fd, buf, len, MSG_NOSIGNAL);
+                server_send_text(server, client_index, MSG_TYPE_SYSTEM, help_text);
             }
             else {
                 send_error_message(server, client_index, "Unknown command. Type /help for available commands");
@@ -553,43 +2773,243 @@ static void client_process_message(Server *server, int client_index, uint8_t *me
             break;
         }
 
+        case MSG_TYPE_RECEIPT: {
+            // A client got a chat message: sent_at is the sender's header timestamp
+            char room[MAX_ROOMNAME_LEN];
+            memcpy(room, view.receipt.room.data, view.receipt.room.len);
+            room[view.receipt.room.len] = '\0';
+            const uint64_t sent_at = view.receipt.sent_at;
+            const uint64_t received_at = view.receipt.received_at;
+            // DMs name a user instead of a room and only count for all rooms;
+            // replayed backlog says nothing about delivery latency
+            if (sent_at != 0 && sent_at > client->replay_ms) {
+                server_record_latency(server, room_table_find(&server->rooms, room), LATENCY_DELIVERY,
+                                      received_at > sent_at ? (received_at - sent_at) * 1000u : 0);
+            }
+            break;
+        }
+
         case MSG_TYPE_PING: {
-            // TODO: Send PONG response
-            printf("DEBUG: Received PING from client %d\n", client->fd);
+            LOG_DEBUG("Received PING from client %d", client->fd);
+            if (server_send_keepalive(server, client_index, MSG_TYPE_PONG)) {
+                server->keepalive_stats.pongs++;
+            }
             break;
         }
 
+        case MSG_TYPE_PONG:
+            break; // Only resets the idle timer, like any other frame
+
         default:
-            printf("WARNING: Unknown message type 0x%02x from client %d\n", header.type, client->fd);
+            LOG_WARN("Unknown message type 0x%02x from client %d", view.header.type, client->fd);
             send_error_message(server, client_index, "Unsupported message type");
             break;
     }
 }
 
 static void send_error_message(Server *server, int client_index, const char *message) {
-    uint8_t response[MAX_MESSAGE_SIZE];
-    int len = protocol_create_error_message(response, message);
-    if (len < 0) {
-        printf("ERROR: Failed to create error message\n");
-        return;
+    if (!server_send_text(server, client_index, MSG_TYPE_ERROR, message)) {
+        LOG_ERROR("Failed to send error message to client %d", server->clients[client_index].fd);
+    }
+}
+
+static void server_send_user_list(Server *server, int client_index) {
+    ServerGroup *group = server->group;
+    Client *client = &server->clients[client_index];
+    const uint8_t protocol_version = client->protocol_version;
+
+    // The directory holds registered users from every shard
+    pthread_mutex_lock(&group->directory_lock);
+    if (server->userlist_version != group->directory_version) {
+        for (int v = 0; v <= PROTOCOL_VERSION; v++) {
+            shared_frame_release(server->userlist_snapshot[v]);
+            server->userlist_snapshot[v] = NULL;
+        }
+        server->userlist_version = group->directory_version;
+    }
+    if (server->userlist_snapshot[protocol_version] == NULL) {
+        // USERLIST holds fewer than MAX_USER_COUNT names; later users are only known through deltas
+        const int count = group->directory_count < MAX_USER_COUNT - 1 ? group->directory_count : MAX_USER_COUNT - 1;
+        const char *users[MAX_USER_COUNT];
+        for (int i = 0; i < count; i++) {
+            users[i] = group->directory[i].username;
+        }
+        uint8_t buf[MAX_MESSAGE_SIZE];
+        const int len = protocol_create_userlist_message(buf, protocol_version, users, (uint16_t)count);
+        server->userlist_snapshot[protocol_version] = len > 0 ? server_create_frame(buf, (size_t)len) : NULL;
+    }
+    pthread_mutex_unlock(&group->directory_lock);
+
+    if (server->userlist_snapshot[protocol_version] != NULL) {
+        client->presence_version = server->userlist_version;
+        server_send_frame(server, client_index, server->userlist_snapshot[protocol_version]);
+    }
+}
+
+static void server_broadcast_presence(Server *server, PresenceAction action, const char *username, uint64_t version) {
+    PresenceEvent event = {0};
+    strncpy(event.username, username, MAX_USERNAME_LEN - 1);
+    event.action = (uint8_t)action;
+    event.version = version;
+    server_queue_presence(server, &event);
+    server_forward(server, SHARD_ROUTE_PRESENCE, NULL, (const uint8_t *)&event, sizeof(event));
+}
+
+static void server_queue_presence(Server *server, const PresenceEvent *event) {
+    const int window_ms = server->group->config.presence_window_ms;
+    bool opened = server->presence.count == 0;
+    server->presence_stats.changes++;
+    if (!presence_batch_add(&server->presence, event->username, (PresenceAction)event->action, event->version)) {
+        // The batch cannot grow: send what it holds and start over with this change
+        server_flush_presence(server);
+        opened = true;
+        if (!presence_batch_add(&server->presence, event->username, (PresenceAction)event->action, event->version)) {
+            LOG_ERROR("Failed to queue presence change for %s", event->username);
+            return;
+        }
+    }
+
+    if (window_ms == 0) {
+        server_flush_presence(server);
+    } else if (opened) {
+        struct itimerspec window = {
+            .it_interval = { 0, 0 },
+            .it_value    = { window_ms / 1000, (window_ms % 1000) * 1000000L }
+        };
+        if (timerfd_settime(server->presence_timer_fd, 0, &window, NULL) < 0) {
+            LOG_ERROR("timerfd_settime presence window: %s", strerror(errno));
+            server_flush_presence(server);
+        }
     }
+}
 
-    ssize_t sent = send(server->clients[client_index].fd, response, len, MSG_NOSIGNAL);
-    if (sent < 0) {
-        printf("ERROR: Failed to send error message to client %d\n", server->clients[client_index].fd);
+// The whole update as one frame: PRESENCE messages back to back
+static SharedFrame *server_presence_frame(const PresenceEntry *entries, int count, uint8_t version) {
+    const int message_count = (count + MAX_PRESENCE_ENTRIES - 1) / MAX_PRESENCE_ENTRIES;
+    uint8_t *buf = malloc((size_t)message_count * MAX_MESSAGE_SIZE);
+    if (buf == NULL) {
+        LOG_ERROR("Failed to allocate presence update");
+        return NULL;
     }
+    size_t len = 0;
+    for (int i = 0; i < count; i += MAX_PRESENCE_ENTRIES) {
+        const int chunk = count - i < MAX_PRESENCE_ENTRIES ? count - i : MAX_PRESENCE_ENTRIES;
+        len += (size_t)protocol_create_presence_message(buf + len, version, entries + i, (uint16_t)chunk);
+    }
+    SharedFrame *frame = server_create_frame(buf, len);
+    free(buf);
+    return frame;
 }
 
-void server_broadcast_user_list(Server *server) {
-    uint8_t announce_buf[MAX_MESSAGE_SIZE];
+static void server_flush_presence(Server *server) {
+    PresenceBatch *batch = &server->presence;
+    if (batch->count == 0) {
+        return;
+    }
+    ServerGroup *group = server->group;
+    PresenceStats *stats = &server->presence_stats;
+
+    PresenceEntry *entries = malloc(sizeof(PresenceEntry) * (size_t)batch->count);
+    if (entries == NULL) {
+        LOG_ERROR("Failed to allocate presence update");
+    }
+    int entry_count = 0;
+    uint64_t sent = 0;
+    uint64_t newest = 0;
+    uint64_t cancelled_from = UINT64_MAX;
+    uint64_t cancelled_to = 0;
+
+    // A change can still be in flight from another shard while a newer one for
+    // the same user was already sent; only send what the directory agrees with
+    pthread_mutex_lock(&group->directory_lock);
+    for (int i = 0; i < batch->count; i++) {
+        const PresenceChange *change = &batch->changes[i];
+        if (presence_change_cancelled(change)) {
+            if (change->first_version < cancelled_from) {
+                cancelled_from = change->first_version;
+            }
+            if (change->last_version > cancelled_to) {
+                cancelled_to = change->last_version;
+            }
+            continue;
+        }
+        const bool listed = group->directory_bucket_count > 0 &&
+                            group->directory_buckets[directory_probe(group, change->username)] != 0;
+        if (listed != (change->last_action == PRESENCE_JOIN)) {
+            continue;
+        }
+        if (change->last_version > newest) {
+            newest = change->last_version;
+        }
+        sent++;
+        if (entries != NULL) {
+            entries[entry_count].action = change->last_action;
+            memcpy(entries[entry_count].username, change->username, MAX_USERNAME_LEN);
+            entry_count++;
+        }
+    }
+    pthread_mutex_unlock(&group->directory_lock);
+
+    stats->batches++;
+    stats->entries += sent;
+    stats->coalesced += batch->events - sent;
+    presence_batch_clear(batch);
+
+    // Encoded once per protocol version in use
+    SharedFrame *frames[PROTOCOL_VERSION + 1] = {0};
+    for (int j = 0; j < server->client_slots_used; j++) {
+        Client *client = &server->clients[j];
+        if (!client->in_use || client->username[0] == '\0') {
+            continue;
+        }
+        // A list taken after the newest change already shows all of them
+        bool stale = false;
+        if (sent > 0 && client->presence_version < newest) {
+            const uint8_t version = client->protocol_version;
+            if (frames[version] == NULL && entry_count > 0) {
+                frames[version] = server_presence_frame(entries, entry_count, version);
+            }
+            if (frames[version] != NULL) {
+                server_send_frame(server, j, frames[version]);
+            } else {
+                stale = true; // Lost the update
+            }
+        }
+        // Its list was taken between a join and a leave (or the reverse) that are not being sent
+        if (stale || (client->presence_version >= cancelled_from && client->presence_version < cancelled_to)) {
+            server_mark_presence_stale(server, j);
+        }
+    }
+    for (int v = 0; v <= PROTOCOL_VERSION; v++) {
+        shared_frame_release(frames[v]);
+    }
+    free(entries);
+}
 
-    const char **all_users = malloc(sizeof(char*) * server->client_count);
-    for (int i = 0; i < server->client_count; i++) {
-        all_users[i] = server->clients[i].username;
+static void server_mark_presence_stale(Server *server, int client_index) {
+    Client *client = &server->clients[client_index];
+    if (!client->presence_stale && client->username[0] != '\0') {
+        client->presence_stale = true;
+        server->presence_stale_count++;
     }
+}
 
-    int len = protocol_create_userlist_message(announce_buf, all_users, server->client_count);
-    server_broadcast_message(server, announce_buf, len, -1);
+static void server_resync_presence(Server *server) {
+    if (server->presence_stale_count == 0) {
+        return;
+    }
 
-    free(all_users);
+    // A client that lost deltas is back in sync once it has room for a full list
+    const size_t budget = server->group->config.output_budget;
+    for (int i = 0; i < server->client_slots_used; i++) {
+        Client *client = &server->clients[i];
+        if (!client->in_use || !client->presence_stale || client->closing) {
+            continue;
+        }
+        if (client->out.bytes_pending + MAX_MESSAGE_SIZE <= budget / 2) {
+            client->presence_stale = false;
+            server->presence_stale_count--;
+            server_send_user_list(server, i);
+        }
+    }
 }
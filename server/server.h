@@ -1,46 +1,358 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include "../common/protocol.h"
+#include "../common/ring_buffer.h"
+#include "wake_queue.h"
+#include "uring.h"
+#include "shared_frame.h"
+#include "write_queue.h"
+#include "buffer_pool.h"
+#include "room_table.h"
+#include "presence_batch.h"
+#include "latency.h"
+#include "metrics.h"
+#include "logger.h"
+#include "message_log.h"
+#include "backlog_store.h"
+#include "search_index.h"
+#include "timer_wheel.h"
 
 #define DEFAULT_CLIENT_COUNT 16
-#define MAX_ROOMS 10
-#define MAX_ROOM_NAME 64
+#define MAX_CLIENT_SLOTS (1 << 24)  // Slot indices share io_uring user_data with a generation
+#define MAX_EPOLL_EVENTS 256
+#define SERVER_TICK_MS 1000
 
-// Represents a chat room
+// io_uring backend sizing
+#define URING_ENTRIES 4096
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 1024  // Provided recv buffers (power of two)
+#define URING_BUFFER_SIZE 4096
+
+#define MAX_SHARDS 64
+#define FLUSH_IOV_MAX 64  // Frames gathered into one sendmsg() when flushing
+#define URING_SEND_IOV_MAX 16  // Frames gathered into one io_uring SENDMSG
+
+// Receive buffers are only held by a connection while a partial frame is pending.
+// Complete frames are parsed straight out of the shard's scratch buffer.
+#define RECV_SCRATCH_SIZE (64 * 1024)
+#define RECV_POOL_SLAB_BUFFERS 64  // Pooled receive buffers allocated at once
+
+// Write coalescing defaults: queued output is flushed once per loop iteration,
+// or earlier when a client has this much pending or the iteration runs long
+#define DEFAULT_FLUSH_BYTES (64 * 1024)
+#define DEFAULT_FLUSH_BUDGET_US 1000
+
+// Slow-consumer policy defaults
+#define DEFAULT_OUTPUT_BUDGET (1024 * 1024)       // Bytes queued per client before the policy kicks in
+#define MIN_OUTPUT_BUDGET (2 * MAX_MESSAGE_SIZE)   // Room for an in-flight frame plus one more
+#define DEFAULT_SLOW_GRACE_MS 5000
+#define SLOW_CONSUMER_HARD_LIMIT 4                // disconnect-after-grace: queue may grow to this many budgets
+
+// Keep-alive defaults: a client silent for the ping interval is pinged, and one
+// silent for the idle timeout is disconnected. Both run on housekeeping ticks.
+#define DEFAULT_PING_INTERVAL_MS 30000
+#define DEFAULT_IDLE_TIMEOUT_MS 90000
+
+// Joins and leaves are gathered for this long and sent as one presence update
+#define DEFAULT_PRESENCE_WINDOW_MS 200
+
+// Chat frames each room keeps for clients that join it
+#define DEFAULT_BACKLOG_FRAMES 50
+#define MAX_BACKLOG_FRAMES 10000
+#define BACKLOG_BYTES_PER_FRAME 512  // Byte budget per frame; fewer long messages fit
+
+// Rooms per shard with their own latency histograms; the others count only for all rooms
+#define LATENCY_TRACKED_ROOMS 16
+
+// Most messages one /history command returns
+#define MAX_HISTORY_COUNT 100
+#define SEARCH_RESULT_COUNT 20     // Newest matches /search returns
+
+// I/O backend driving server_poll_events
+typedef enum {
+    SERVER_BACKEND_EPOLL,
+    SERVER_BACKEND_IO_URING
+} ServerBackend;
+
+// What to do with a client whose queued output exceeds its budget
+typedef enum {
+    SLOW_POLICY_DROP_OLDEST_CHAT,   // Evict the oldest queued chat frames to make room
+    SLOW_POLICY_DROP_NON_CONTROL,   // Drop every queued and new non-control frame
+    SLOW_POLICY_DISCONNECT          // Keep queueing, disconnect if still over budget after the grace period
+} SlowConsumerPolicy;
+
+// Startup options, filled from the command line in main.c
+typedef struct {
+    int port;
+    ServerBackend backend;
+    int threads;          // Number of shards, each with its own listener and event loop
+    size_t output_budget; // Per-client bytes of queued output
+    SlowConsumerPolicy slow_policy;
+    int slow_grace_ms;    // SLOW_POLICY_DISCONNECT only
+    size_t flush_bytes;   // Flush a client early once this much output is queued
+    int flush_budget_us;  // Flush every dirty client early once an iteration has run this long
+    int max_clients;      // Client slots preallocated per shard; 0 grows the slot array on demand
+    int presence_window_ms;  // Presence coalescing window; 0 sends every join and leave right away
+    int ping_interval_ms; // Ping clients silent this long; 0 never pings
+    int idle_timeout_ms;  // Disconnect clients silent this long; 0 never does
+    int backlog_frames;   // Chat frames replayed on /join; 0 disables the backlog
+    size_t backlog_memory;  // Storage of all rooms' backlogs together
+    int metrics_port;     // Serve metrics on 127.0.0.1:metrics_port; 0 for none
+    const char *metrics_socket;  // ... or on this unix socket instead, NULL for none
+    const char *log_dir;  // Directory of the on-disk chat log, NULL for none
+    size_t log_segment_size;  // Size of each log segment file
+    size_t search_memory; // Memory cap of the /search index; 0 disables search
+} ServerConfig;
+
+// Slow-consumer policy actions taken by one shard
 typedef struct {
-    char name[MAX_ROOM_NAME];
-    int client_count;
-    int client_fds[100];  // List of client FDs in this room
-} Room;
+    uint64_t chat_dropped;          // Chat frames evicted or refused
+    uint64_t non_control_dropped;   // Chat and user list frames dropped
+    uint64_t grace_disconnects;     // Clients still over budget when the grace period ran out
+    uint64_t overflow_disconnects;  // Clients whose unsheddable output no longer fit
+} SlowConsumerStats;
+
+// Presence coalescing counters for one shard
+typedef struct {
+    uint64_t changes;     // Joins and leaves that entered a window
+    uint64_t coalesced;   // ... that were not sent: cancelled out, superseded or stale
+    uint64_t entries;     // Presence entries sent
+    uint64_t batches;     // Windows flushed
+} PresenceStats;
+
+// Generation-tagged reference to a client slot. A slot is reused once its
+// client is removed; the generation changes then, so a stale handle stops
+// resolving instead of reaching the new occupant.
+typedef struct {
+    uint32_t slot;
+    uint32_t generation;
+} ClientHandle;
+
+// Keep-alive counters for one shard
+typedef struct {
+    uint64_t pings;       // Pings sent to silent clients
+    uint64_t pongs;       // Pings from clients answered
+    uint64_t idle_disconnects;  // Clients silent past the idle timeout
+} KeepaliveStats;
+
+// How a frame forwarded to another shard is delivered there
+typedef enum {
+    SHARD_ROUTE_ROOM,     // Every local client in room `target`
+    SHARD_ROUTE_ALL,      // Every local client
+    SHARD_ROUTE_USER,     // The local client named `target`
+    SHARD_ROUTE_CLIENT,   // The local client `client`: a replay of chat frames, then any others
+    SHARD_ROUTE_PRESENCE, // No frame: a PresenceEvent for the shard's presence window
+    SHARD_ROUTE_STOP      // No frame: stop the shard's event loop
+} ShardRoute;
+
+// A frame handed from one shard to another through its inbox
+typedef struct {
+    MpscNode node;        // Must be first
+    ShardRoute route;
+    char target[MAX_ROOM_NAME];
+    ClientHandle client;  // SHARD_ROUTE_CLIENT
+    uint64_t received_us; // Sending shard's clock_us when the frame came in
+    size_t len;
+    uint8_t data[];
+} ShardMessage;
+
+// A join or leave on one shard, posted to the others as a SHARD_ROUTE_PRESENCE payload
+typedef struct {
+    char username[MAX_USERNAME_LEN];
+    uint8_t action;       // PresenceAction
+    uint64_t version;     // directory_version right after the change
+} PresenceEvent;
+
+// Registered username and the connection it belongs to
+typedef struct {
+    char username[MAX_USERNAME_LEN];
+    int shard;
+    ClientHandle handle;  // Client slot on that shard
+} DirectoryEntry;
+
+struct ServerGroup;
+
+// Message header and iovecs of a client's in-flight io_uring SENDMSG. Heap
+// allocated so it stays put when the client array is reallocated.
+typedef struct {
+    struct msghdr msg;
+    struct iovec iov[URING_SEND_IOV_MAX];
+} UringSendBuf;
+
+// An io_uring send still in flight for a connection that has been removed
+typedef struct OrphanSend {
+    struct OrphanSend *next;
+    uint64_t payload;     // Connection payload the send was submitted with
+    UringSendBuf *send_buf;
+    int frame_count;
+    SharedFrame *frames[URING_SEND_IOV_MAX];  // References held until the completion arrives
+} OrphanSend;
+
+// A message bound for clients that may speak different protocol versions.
+// The frame for each version is encoded on first use and then shared by every
+// recipient of that version.
+typedef struct {
+    const uint8_t *data;  // Encoded message, in any version
+    size_t len;
+    SharedFrame *frames[PROTOCOL_VERSION + 1];  // Indexed by version
+    int recipients;       // Local clients it was queued for, reported as the fan-out
+} OutboundMessage;
+
+// Write coalescing counters for one shard
+typedef struct {
+    uint64_t writes;      // sendmsg() calls / io_uring sends submitted
+    uint64_t frames;      // Frames completed by those writes
+} FlushStats;
+
+// Latency histograms of one room, in a shard's fixed set of tracked rooms
+typedef struct {
+    int room_id;          // -1 for a free slot
+    uint64_t recent;      // Samples, halved every tick; at 0 another room may take the slot
+    LatencyStats stats;
+} RoomLatency;
 
 // Represents a single connected client
 typedef struct {
     int fd;
+    bool in_use;          // Slot holds a live connection
+    uint32_t generation;  // Bumped when the slot is freed, invalidating handles to it
+    int next_free;        // Free slots only: next entry of the shard's free list, -1 at the end
     char username[64];
-    uint8_t recv_buffer[MAX_MESSAGE_SIZE];
-    size_t buffer_pos;
-    char current_room[MAX_ROOM_NAME];
+    uint8_t protocol_version;  // Version of the client's last message; replies use it
+    RingBuffer recv_ring;    // Partial frame awaiting more bytes; storage from the shard pool, NULL when idle
+    int room_id;             // Room the client is in, GENERAL_ROOM_ID until it joins another
+    int room_pos;            // Position in that room's member set, -1 while not a member
+    WriteQueue out;          // Frames not yet accepted by the socket
+    int send_frames;         // io_uring only: frames at the front of `out` covered by the in-flight send
+    UringSendBuf *send_buf;  // io_uring only: allocated on first send
+    bool dirty;              // Has queued output and is on the shard's dirty list
+    bool write_blocked;      // epoll only: last write hit EAGAIN, wait for EPOLLOUT
+    bool over_budget;        // SLOW_POLICY_DISCONNECT: queued output exceeds the budget
+    uint64_t over_budget_tick;  // tick_count when over_budget was set
+    bool closing;            // Scheduled for removal, no more reads or writes
+    bool presence_stale;     // A presence frame was shed; resend the user list once caught up
+    uint64_t presence_version;  // directory_version of the last user list sent to the client
+    uint64_t replay_ms;      // Wall clock of the last backlog replay; receipts for older messages are not timed
+    uint64_t last_recv_tick; // tick_count when the client's last frame came in
 } Client;
 
-// Represents the entire server state
+// Represents the state of one shard: a listener, its clients and its event loop.
+// Each shard is driven by exactly one thread.
 typedef struct {
+    struct ServerGroup *group;
+    int shard_id;
+    ServerBackend backend;
     int server_fd;
-    Client *clients;
-    int client_count;
-    int client_capacity;
-    Room rooms[MAX_ROOMS];
-    int room_count;
+    int epoll_fd;
+    Uring uring;
+    int timer_fd;         // Periodic housekeeping tick (timerfd)
+    int presence_timer_fd;  // One-shot timerfd closing the presence window
+    int signal_fd;        // SIGINT/SIGTERM delivered through the event loop (signalfd), shard 0 only
+    WakeQueue inbox;      // ShardMessages from other shards; its eventfd is watched by the event loop
+    bool running;
+    uint64_t tick_count;
+    Client *clients;      // Slot array; a client keeps its slot index for its whole lifetime
+    int client_count;     // Live clients
+    int client_capacity;  // Allocated slots
+    int client_slots_used;  // Slots handed out at least once; loops over clients stop here
+    int free_slot;        // Head of the free list of released slots, -1 if empty
+    int *fd_to_index;     // Maps a client fd to its slot in clients, -1 if unused
+    int fd_map_capacity;
+    ClientHandle *pending_close;
+    int pending_close_count;
+    int pending_close_capacity;
+    ClientHandle *dirty;  // Clients with output queued this iteration
+    int dirty_count;
+    int dirty_capacity;
+    uint64_t phase_start_us;  // When the current event-processing phase started
+    uint64_t loop_start_us;   // When the current loop iteration's events came in, 0 if none did
+    uint64_t clock_us;        // Monotonic time, read once per loop iteration
+    uint64_t wall_clock_us;   // Wall-clock time read with clock_us; also stamps created frames
+    uint64_t received_us;     // clock_us at which the frame being dispatched was received
+    LatencyStats latency;     // Chat message latency across all rooms
+    RoomLatency room_latency[LATENCY_TRACKED_ROOMS];  // Same for the busiest rooms
+    FlushStats flush_stats;
+    ShardMetrics *metrics;    // This shard's entry in the group's metrics
+    OrphanSend *orphan_sends;
+    SlowConsumerStats slow_stats;
+    SharedFrame *userlist_snapshot[PROTOCOL_VERSION + 1];  // Cached USERLIST frames by protocol version
+    uint64_t userlist_version;       // directory_version the snapshots were built from
+    int presence_stale_count;        // Clients with presence_stale set
+    PresenceBatch presence;          // Joins and leaves of the open presence window
+    PresenceStats presence_stats;
+    BufferPool recv_pool;     // Receive buffers for clients with a partial frame pending
+    uint8_t *recv_scratch;    // epoll only: RECV_SCRATCH_SIZE bytes that idle clients read into
+    RoomTable rooms;
+    TimerWheel keepalive;     // Keep-alive timer of every live client, by slot, in ticks
+    KeepaliveStats keepalive_stats;
 } Server;
 
+// Passed through write_queue_consume to time the frames a write completes
+typedef struct {
+    Server *server;
+    int room_id;          // Recipient's room
+} FrameWriteContext;
+
+// The whole server: one shard per worker thread plus state shared between them
+typedef struct ServerGroup {
+    ServerConfig config;
+    Server *shards;
+    int shard_count;
+    pthread_t *threads;
+    ShardMetrics *metrics;          // One per shard, each written only by its shard
+    MetricsServer metrics_server;   // Used when config.metrics_port or metrics_socket is set
+    MessageLog message_log;         // Used when config.log_dir is set
+    SearchService search;           // Used when config.search_memory is set
+    BacklogStore backlog;           // Used when config.backlog_frames is set
+
+    // Registered usernames across all shards (user list, DMs, duplicate names),
+    // indexed by an open-addressing hash of the username
+    pthread_mutex_t directory_lock;
+    DirectoryEntry *directory;
+    int directory_count;
+    int directory_capacity;
+    int *directory_buckets;         // Index into directory + 1, 0 for an empty bucket
+    size_t directory_bucket_count;  // Power of two, or 0 before the first registration
+    uint64_t directory_version;     // Bumped on every add and remove; invalidates user list snapshots
+} ServerGroup;
+
 /**
- * @brief Initializes the server, allocates memory, and starts listening.
+ * @brief Blocks termination signals and initializes every shard. Each shard
+ *        binds its own listener to the port with SO_REUSEPORT.
+ * @param group A pointer to the ServerGroup to initialize.
+ * @param config Startup options.
+ * @return true on success, false on failure.
+ */
+bool server_group_init(ServerGroup *group, const ServerConfig *config);
+
+/**
+ * @brief Runs shard 0 on the calling thread and every other shard on its own
+ *        thread. Returns once all shards have stopped.
+ * @param group A pointer to the ServerGroup.
+ * @return true if every thread started, false if the group could not run.
+ */
+bool server_group_run(ServerGroup *group);
+
+/**
+ * @brief Shuts down every shard and frees shared state.
+ * @param group A pointer to the ServerGroup.
+ */
+void server_group_shutdown(ServerGroup *group);
+
+/**
+ * @brief Initializes one shard, allocates memory, and starts listening.
+ *        If the io_uring backend is requested but the kernel does not support
+ *        it, the server falls back to epoll.
  * @param server A pointer to the Server struct to initialize.
- * @param port The port to listen on.
+ * @param group The group the shard belongs to (provides the config).
+ * @param shard_id Index of the shard within the group.
  * @return true on success, false on failure.
  */
-bool server_init(Server *server, int port);
+bool server_init(Server *server, ServerGroup *group, int shard_id);
 
 /**
  * @brief Shuts down the server, closes all sockets, and frees memory.
@@ -49,29 +361,22 @@ bool server_init(Server *server, int port);
 void server_shutdown(Server *server);
 
 /**
- * @brief Waits for and processes all network events (new connections, messages).
+ * @brief Runs one loop iteration in two phases. First every ready event (new
+ *        connections, messages, timer ticks and signals) is processed, which only
+ *        queues output. Then each client that had output queued is flushed once
+ *        with a single gathered write. A client is flushed early when its
+ *        queue reaches flush_bytes, and every dirty client is flushed early when
+ *        the first phase runs past flush_budget_us.
  * @param server A pointer to the Server struct.
  */
 void server_poll_events(Server *server);
 
 /**
  * @brief Broadcasts a message to all connected clients (except the sender).
+ *        The frame is also forwarded to the other shards.
  * @param server A pointer to the Server struct.
  * @param data The message data to send.
  * @param len The length of the message data.
  * @param sender_index The index of the client who sent the message.
  */
 void server_broadcast_message(Server *server, const uint8_t *data,const int len, int sender_index);
-
-// --- Static Helper Function Declarations ---
-static void set_nonblocking(int fd);
-static void server_accept_new_clients(Server *server);
-static bool server_handle_client_data(Server *server, int client_index);
-static void server_remove_client(Server *server, int client_index);
-static void client_process_message(Server *server, int client_index, uint8_t *message, size_t total_message_size);
-static void send_error_message(Server *server, int client_index, const char *message);
-/**
- * @brief send alle the active users to all clients
- * @param server A pointer to the Server struct.
- */
-static void server_broadcast_user_list(Server *server);
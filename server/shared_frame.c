@@ -0,0 +1,43 @@
+#include "shared_frame.h"
+#include <stdlib.h>
+#include <string.h>
+
+SharedFrame *shared_frame_alloc(size_t len, uint8_t tag) {
+    SharedFrame *frame = malloc(sizeof(SharedFrame) + len);
+    if (frame == NULL) {
+        return NULL;
+    }
+    frame->refcount = 1;
+    frame->tag = tag;
+    frame->len = len;
+    return frame;
+}
+
+SharedFrame *shared_frame_create(const uint8_t *data, size_t len, uint8_t tag) {
+    const struct iovec iov = { (void *)data, len };
+    return shared_frame_create_gather(&iov, 1, tag);
+}
+
+SharedFrame *shared_frame_create_gather(const struct iovec *iov, int count, uint8_t tag) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+
+    SharedFrame *frame = shared_frame_alloc(len, tag);
+    if (frame == NULL) {
+        return NULL;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(frame->data + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    return frame;
+}
+
+void shared_frame_release(SharedFrame *frame) {
+    if (frame != NULL && --frame->refcount == 0) {
+        free(frame);
+    }
+}
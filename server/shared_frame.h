@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * An encoded frame shared by every output queue it is bound for.
+ *
+ * A broadcast is serialized once into a SharedFrame and each recipient's
+ * WriteQueue holds a reference to it instead of a copy. The frame is immutable
+ * once created and is freed when the last reference is released. Frames never
+ * leave the shard that created them, so the count is not atomic.
+ */
+typedef struct {
+    uint32_t refcount;
+    uint8_t tag;           // Caller-defined frame class (the message type), must be < 32
+    size_t len;
+    uint8_t data[];
+} SharedFrame;
+
+/**
+ * @brief Allocates a frame of `len` uninitialized bytes, with one reference.
+ *        The caller fills it and may lower `len` before queueing it.
+ * @return The frame, or NULL if allocation failed.
+ */
+SharedFrame *shared_frame_alloc(size_t len, uint8_t tag);
+
+/**
+ * @brief Allocates a frame holding a copy of `len` bytes, with one reference.
+ * @param data Encoded frame bytes.
+ * @param len Frame length.
+ * @param tag Frame class used when dropping queued frames (< 32).
+ * @return The frame, or NULL if allocation failed.
+ */
+SharedFrame *shared_frame_create(const uint8_t *data, size_t len, uint8_t tag);
+
+/**
+ * @brief Allocates a frame holding the concatenation of `count` buffers, with one reference.
+ * @param iov Pieces of the encoded frame, in order.
+ * @param count Number of pieces.
+ * @param tag Frame class used when dropping queued frames (< 32).
+ * @return The frame, or NULL if allocation failed.
+ */
+SharedFrame *shared_frame_create_gather(const struct iovec *iov, int count, uint8_t tag);
+
+/**
+ * @brief Takes another reference to the frame.
+ * @return The same frame.
+ */
+static inline SharedFrame *shared_frame_retain(SharedFrame *frame) {
+    frame->refcount++;
+    return frame;
+}
+
+/**
+ * @brief Drops a reference, freeing the frame when it was the last. NULL is ignored.
+ */
+void shared_frame_release(SharedFrame *frame);
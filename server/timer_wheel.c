@@ -0,0 +1,143 @@
+#include "timer_wheel.h"
+#include <stdlib.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_EXPIRING (TIMER_WHEEL_BUCKETS - 1)
+
+// The slot a timer waits in: the lowest level whose span covers it, at the
+// position its expiry has on that level
+static uint32_t timer_wheel_bucket(const TimerWheel *wheel, uint64_t expires) {
+    if (expires < wheel->next_tick) {
+        expires = wheel->next_tick;
+    }
+    const uint64_t delta = expires - wheel->next_tick;
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        const unsigned shift = TIMER_WHEEL_BITS * level;
+        if (delta < (1ull << (shift + TIMER_WHEEL_BITS))) {
+            return level * TIMER_WHEEL_SLOTS + (uint32_t)((expires >> shift) & TIMER_WHEEL_MASK);
+        }
+    }
+    // Beyond the wheel: wait in the farthest top slot and be placed again
+    // when it is cascaded
+    const unsigned shift = TIMER_WHEEL_BITS * (TIMER_WHEEL_LEVELS - 1);
+    const uint64_t farthest = wheel->next_tick + (1ull << (shift + TIMER_WHEEL_BITS)) - 1;
+    return (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_SLOTS + (uint32_t)((farthest >> shift) & TIMER_WHEEL_MASK);
+}
+
+static void timer_wheel_link(TimerWheel *wheel, uint32_t id, uint32_t bucket) {
+    TimerWheelNode *node = &wheel->nodes[id];
+    node->bucket = bucket;
+    node->prev = TIMER_NONE;
+    node->next = wheel->heads[bucket];
+    if (node->next != TIMER_NONE) {
+        wheel->nodes[node->next].prev = id;
+    }
+    wheel->heads[bucket] = id;
+}
+
+static void timer_wheel_unlink(TimerWheel *wheel, uint32_t id) {
+    TimerWheelNode *node = &wheel->nodes[id];
+    if (node->prev != TIMER_NONE) {
+        wheel->nodes[node->prev].next = node->next;
+    } else {
+        wheel->heads[node->bucket] = node->next;
+    }
+    if (node->next != TIMER_NONE) {
+        wheel->nodes[node->next].prev = node->prev;
+    }
+    node->bucket = TIMER_NONE;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now) {
+    for (uint32_t i = 0; i < TIMER_WHEEL_BUCKETS; i++) {
+        wheel->heads[i] = TIMER_NONE;
+    }
+    wheel->nodes = NULL;
+    wheel->node_capacity = 0;
+    wheel->next_tick = now + 1;
+    wheel->armed = 0;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+    free(wheel->nodes);
+    timer_wheel_init(wheel, wheel->next_tick - 1);
+}
+
+bool timer_wheel_reserve(TimerWheel *wheel, uint32_t count) {
+    if (count <= wheel->node_capacity) {
+        return true;
+    }
+    uint32_t capacity = wheel->node_capacity > 0 ? wheel->node_capacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    TimerWheelNode *nodes = realloc(wheel->nodes, sizeof(TimerWheelNode) * capacity);
+    if (nodes == NULL) {
+        return false;
+    }
+    for (uint32_t i = wheel->node_capacity; i < capacity; i++) {
+        nodes[i].bucket = TIMER_NONE;
+    }
+    wheel->nodes = nodes;
+    wheel->node_capacity = capacity;
+    return true;
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, uint32_t id, uint64_t expires) {
+    if (wheel->nodes[id].bucket != TIMER_NONE) {
+        timer_wheel_unlink(wheel, id);
+    } else {
+        wheel->armed++;
+    }
+    wheel->nodes[id].expires = expires;
+    timer_wheel_link(wheel, id, timer_wheel_bucket(wheel, expires));
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, uint32_t id) {
+    if (id < wheel->node_capacity && wheel->nodes[id].bucket != TIMER_NONE) {
+        timer_wheel_unlink(wheel, id);
+        wheel->armed--;
+    }
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now, TimerWheelFn fn, void *context) {
+    if (wheel->armed == 0 && wheel->next_tick <= now) {
+        wheel->next_tick = now + 1; // Nothing to cascade or expire on the way
+        return;
+    }
+    while (wheel->next_tick <= now) {
+        const uint64_t tick = wheel->next_tick;
+
+        // A new turn of a level begins: spread its next slot over the levels below
+        for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            const unsigned shift = TIMER_WHEEL_BITS * level;
+            if (tick & ((1ull << shift) - 1)) {
+                break;
+            }
+            const uint32_t bucket = level * TIMER_WHEEL_SLOTS + (uint32_t)((tick >> shift) & TIMER_WHEEL_MASK);
+            uint32_t id = wheel->heads[bucket];
+            wheel->heads[bucket] = TIMER_NONE;
+            while (id != TIMER_NONE) {
+                const uint32_t next = wheel->nodes[id].next;
+                timer_wheel_link(wheel, id, timer_wheel_bucket(wheel, wheel->nodes[id].expires));
+                id = next;
+            }
+        }
+
+        // Detach the due slot first: callbacks may schedule timers into it for
+        // its next turn
+        wheel->next_tick = tick + 1;
+        const uint32_t due = (uint32_t)(tick & TIMER_WHEEL_MASK);
+        wheel->heads[TIMER_WHEEL_EXPIRING] = wheel->heads[due];
+        wheel->heads[due] = TIMER_NONE;
+        for (uint32_t id = wheel->heads[TIMER_WHEEL_EXPIRING]; id != TIMER_NONE; id = wheel->nodes[id].next) {
+            wheel->nodes[id].bucket = TIMER_WHEEL_EXPIRING;
+        }
+        uint32_t id;
+        while ((id = wheel->heads[TIMER_WHEEL_EXPIRING]) != TIMER_NONE) {
+            timer_wheel_unlink(wheel, id);
+            wheel->armed--;
+            fn(context, id);
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6                        // Slots per level: 64
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4                      // Spans 64^4 ticks; later timers wait at the top
+#define TIMER_WHEEL_BUCKETS (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1)  // ... plus the list being expired
+#define TIMER_NONE UINT32_MAX
+
+/**
+ * Hierarchical timer wheel.
+ *
+ * Timers are identified by small integers (a client slot) and live in lists
+ * hanging off the wheel's slots. Level 0 has one slot per tick; each slot of
+ * a higher level covers a whole turn of the level below and is cascaded into
+ * it when that turn begins. Scheduling, rescheduling and cancelling are O(1),
+ * and advancing costs only the timers that come due plus the occasional
+ * cascade, however many are armed.
+ *
+ * The lists are linked through an array indexed by timer ID rather than
+ * through pointers, so whatever owns the IDs may move in memory. Not
+ * thread-safe: each shard owns its own wheel.
+ */
+
+typedef struct {
+    uint32_t next;        // TIMER_NONE at the end of the list
+    uint32_t prev;        // TIMER_NONE at the head
+    uint32_t bucket;      // TIMER_NONE while not armed
+    uint64_t expires;     // Tick the timer comes due
+} TimerWheelNode;
+
+typedef struct {
+    uint32_t heads[TIMER_WHEEL_BUCKETS];
+    TimerWheelNode *nodes;
+    uint32_t node_capacity;
+    uint64_t next_tick;   // First tick not yet expired
+    size_t armed;
+} TimerWheel;
+
+/**
+ * Called for each timer that comes due. The timer is no longer armed and
+ * may be scheduled again from the callback.
+ */
+typedef void (*TimerWheelFn)(void *context, uint32_t id);
+
+/**
+ * @brief Initializes an empty wheel.
+ * @param wheel The wheel.
+ * @param now The current tick.
+ */
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+
+/**
+ * @brief Frees the wheel's nodes.
+ */
+void timer_wheel_destroy(TimerWheel *wheel);
+
+/**
+ * @brief Makes room for timer IDs below count.
+ * @return true on success, false if memory ran out.
+ */
+bool timer_wheel_reserve(TimerWheel *wheel, uint32_t count);
+
+/**
+ * @brief Arms a timer, or moves it if it is armed already.
+ * @param wheel The wheel.
+ * @param id Timer ID, below the reserved count.
+ * @param expires Tick it comes due; one already past comes due on the next advance.
+ */
+void timer_wheel_schedule(TimerWheel *wheel, uint32_t id, uint64_t expires);
+
+/**
+ * @brief Disarms a timer. Does nothing if it is not armed.
+ */
+void timer_wheel_cancel(TimerWheel *wheel, uint32_t id);
+
+/**
+ * @brief Expires every timer due at or before now, calling fn for each.
+ */
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now, TimerWheelFn fn, void *context);
+
+static inline bool timer_wheel_armed(const TimerWheel *wheel, uint32_t id) {
+    return id < wheel->node_capacity && wheel->nodes[id].bucket != TIMER_NONE;
+}
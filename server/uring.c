@@ -0,0 +1,276 @@
+#include "uring.h"
+#include "logger.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// --- Raw syscall wrappers ---
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// --- Public Function Definitions ---
+
+bool uring_init(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd < 0) {
+        LOG_ERROR("io_uring_setup: %s", strerror(errno));
+        return false;
+    }
+    ring->ring_fd = fd;
+
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        LOG_ERROR("mmap SQ ring: %s", strerror(errno));
+        ring->sq_ptr = NULL;
+        uring_destroy(ring);
+        return false;
+    }
+
+    if (single_mmap) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            LOG_ERROR("mmap CQ ring: %s", strerror(errno));
+            ring->cq_ptr = NULL;
+            uring_destroy(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        LOG_ERROR("mmap SQEs: %s", strerror(errno));
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // SQE slots map 1:1 onto the index array
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    ring->sqe_tail = *ring->sq_tail;
+    ring->sqe_submitted = ring->sqe_tail;
+
+    return true;
+}
+
+void uring_destroy(Uring *ring) {
+    if (ring->buf_ring != NULL) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = ring->buf_group;
+        sys_io_uring_register(ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(ring->buf_ring, ring->buf_ring_len);
+        ring->buf_ring = NULL;
+    }
+    if (ring->buf_base != NULL) {
+        munmap(ring->buf_base, (size_t)ring->buf_count * ring->buf_size);
+        ring->buf_base = NULL;
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+        ring->sqes = NULL;
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    ring->cq_ptr = NULL;
+    if (ring->sq_ptr != NULL) {
+        munmap(ring->sq_ptr, ring->sq_len);
+        ring->sq_ptr = NULL;
+    }
+    if (ring->ring_fd >= 0) {
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+    }
+}
+
+bool uring_setup_buffers(Uring *ring, uint16_t group, unsigned count, unsigned size) {
+    ring->buf_ring_len = count * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOG_ERROR("mmap buffer ring: %s", strerror(errno));
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        LOG_ERROR("io_uring_register PBUF_RING: %s", strerror(errno));
+        munmap(mem, ring->buf_ring_len);
+        return false;
+    }
+    ring->buf_ring = mem;
+
+    ring->buf_base = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_base == MAP_FAILED) {
+        LOG_ERROR("mmap provided buffers: %s", strerror(errno));
+        ring->buf_base = NULL;
+        return false;
+    }
+
+    ring->buf_group = group;
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_tail = 0;
+    for (unsigned i = 0; i < count; i++) {
+        uring_recycle_buffer(ring, (uint16_t)i);
+    }
+    return true;
+}
+
+void uring_recycle_buffer(Uring *ring, uint16_t bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        // Ring full: hand what we have to the kernel and try again
+        if (uring_submit_and_wait(ring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    const unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    const unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    int ret = sys_io_uring_enter(ring->ring_fd, to_submit, wait_nr, flags);
+    if (ret < 0) {
+        return -errno;
+    }
+    ring->sqe_submitted += (unsigned)ret;
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    const unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// --- SQE preparation helpers ---
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint32_t poll_mask, uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_mask;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/**
+ * Minimal io_uring wrapper built directly on the io_uring_setup/io_uring_enter/
+ * io_uring_register syscalls (no liburing dependency).
+ *
+ * Supports one kernel-provided buffer ring (IORING_REGISTER_PBUF_RING) that
+ * multishot recv requests pick their buffers from.
+ */
+typedef struct {
+    int ring_fd;
+
+    // Submission queue (mapped from the kernel)
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;       // Local tail, published on submit
+    unsigned sqe_submitted;  // Tail value last handed to the kernel
+
+    // Completion queue (mapped from the kernel)
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    // Provided buffer ring
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    uint8_t *buf_base;
+    uint16_t buf_group;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+} Uring;
+
+/**
+ * @brief Creates the ring and maps the submission/completion queues.
+ * @param ring The ring to initialize.
+ * @param entries Number of submission queue entries (power of two).
+ * @return true on success, false if the kernel does not support io_uring.
+ */
+bool uring_init(Uring *ring, unsigned entries);
+
+/**
+ * @brief Unmaps the queues, unregisters the buffer ring and closes the ring fd.
+ * @param ring The ring to destroy.
+ */
+void uring_destroy(Uring *ring);
+
+/**
+ * @brief Registers a provided buffer ring with `count` buffers of `size` bytes.
+ * @param ring The ring.
+ * @param group Buffer group ID used by recv requests.
+ * @param count Number of buffers (power of two).
+ * @param size Size of each buffer in bytes.
+ * @return true on success, false if the kernel lacks provided buffer rings.
+ */
+bool uring_setup_buffers(Uring *ring, uint16_t group, unsigned count, unsigned size);
+
+/**
+ * @brief Returns a consumed buffer to the provided buffer ring.
+ * @param ring The ring.
+ * @param bid Buffer ID reported in the completion flags.
+ */
+void uring_recycle_buffer(Uring *ring, uint16_t bid);
+
+/**
+ * @brief Returns the address of a provided buffer.
+ */
+static inline uint8_t *uring_buffer(const Uring *ring, uint16_t bid) {
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+/**
+ * @brief Gets a zeroed SQE, flushing queued entries to the kernel if the ring is full.
+ * @param ring The ring.
+ * @return The SQE, or NULL if no entry could be made available.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/**
+ * @brief Submits all queued SQEs and waits for at least `wait_nr` completions.
+ * @param ring The ring.
+ * @param wait_nr Minimum number of completions to wait for (0 = don't wait).
+ * @return Number of SQEs submitted, or -errno on failure.
+ */
+int uring_submit_and_wait(Uring *ring, unsigned wait_nr);
+
+/**
+ * @brief Returns the next unseen completion, or NULL if the CQ is empty.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+/**
+ * @brief Marks the completion returned by uring_peek_cqe() as consumed.
+ */
+void uring_cqe_seen(Uring *ring);
+
+// --- SQE preparation helpers ---
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data);
+void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, uint32_t poll_mask, uint64_t user_data);
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
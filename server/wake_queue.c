@@ -0,0 +1,77 @@
+#include "wake_queue.h"
+#include "logger.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+bool wake_signal_init(WakeSignal *wake) {
+    atomic_init(&wake->pending, false);
+    wake->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake->fd < 0) {
+        LOG_ERROR("eventfd: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void wake_signal_destroy(WakeSignal *wake) {
+    if (wake->fd >= 0) {
+        close(wake->fd);
+        wake->fd = -1;
+    }
+}
+
+void wake_signal_force(WakeSignal *wake) {
+    const uint64_t one = 1;
+    if (write(wake->fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("write eventfd: %s", strerror(errno));
+    }
+}
+
+void wake_signal_notify(WakeSignal *wake) {
+    // An exchange, not a load: it orders the caller's work before the flag
+    // as the consumer's exchange in wake_signal_clear() sees it
+    if (!atomic_exchange(&wake->pending, true)) {
+        wake_signal_force(wake);
+    }
+}
+
+void wake_signal_clear(WakeSignal *wake) {
+    uint64_t count;
+    if (read(wake->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_ERROR("read eventfd: %s", strerror(errno));
+    }
+    atomic_exchange(&wake->pending, false);
+}
+
+void wake_signal_wait(WakeSignal *wake, int timeout_ms) {
+    struct pollfd pfd = { .fd = wake->fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+        LOG_ERROR("poll eventfd: %s", strerror(errno));
+    }
+}
+
+bool wake_queue_init(WakeQueue *queue) {
+    mpsc_queue_init(&queue->queue);
+    return wake_signal_init(&queue->wake);
+}
+
+void wake_queue_destroy(WakeQueue *queue) {
+    if (queue->wake.fd < 0) {
+        return;
+    }
+    MpscNode *node;
+    while ((node = mpsc_queue_pop(&queue->queue)) != NULL) {
+        free(node);
+    }
+    wake_signal_destroy(&queue->wake);
+}
+
+void wake_queue_push(WakeQueue *queue, MpscNode *node) {
+    mpsc_queue_push(&queue->queue, node);
+    wake_signal_notify(&queue->wake);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "mpsc_queue.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/**
+ * An eventfd that wakes one consumer thread, written only when it may be
+ * asleep.
+ *
+ * Producers call wake_signal_notify() once their work is visible; only the
+ * first since the consumer last called wake_signal_clear() writes the
+ * eventfd. The consumer clears before it looks for work, so any producer it
+ * does not see finishes after the clear and signals again.
+ */
+typedef struct {
+    atomic_bool pending;  // Signalled and not yet cleared
+    int fd;
+} WakeSignal;
+
+/**
+ * @brief Creates the eventfd.
+ * @return true on success, false if the eventfd could not be created.
+ */
+bool wake_signal_init(WakeSignal *wake);
+
+/**
+ * @brief Closes the eventfd. Does nothing if it was never created.
+ */
+void wake_signal_destroy(WakeSignal *wake);
+
+/**
+ * @brief Wakes the consumer unless it was woken since it last cleared. Safe
+ *        to call from any thread.
+ */
+void wake_signal_notify(WakeSignal *wake);
+
+/**
+ * @brief Wakes the consumer unconditionally, e.g. to have it look at a stop flag.
+ */
+void wake_signal_force(WakeSignal *wake);
+
+/**
+ * @brief Consumer side: resets the eventfd and the flag. Call before
+ *        looking for work.
+ */
+void wake_signal_clear(WakeSignal *wake);
+
+/**
+ * @brief Consumer side: sleeps until the eventfd is signalled.
+ * @param wake The signal.
+ * @param timeout_ms Longest wait, or -1 for none.
+ */
+void wake_signal_wait(WakeSignal *wake, int timeout_ms);
+
+// A relaxed peek, for producers that would rather skip the exchange when a
+// wakeup is already on its way; such a caller must wait with a timeout
+static inline bool wake_signal_pending(const WakeSignal *wake) {
+    return atomic_load_explicit(&wake->pending, memory_order_relaxed);
+}
+
+/**
+ * An MPSC queue whose consumer sleeps on a WakeSignal: any thread pushes,
+ * the owning thread clears the signal and pops until the queue is empty.
+ * A push still linking its node when the consumer looks reads as an empty
+ * queue, but signals after it, so nothing is left behind.
+ */
+typedef struct {
+    MpscQueue queue;
+    WakeSignal wake;
+} WakeQueue;
+
+/**
+ * @brief Initializes an empty queue and creates its eventfd. The queue must
+ *        not be moved afterwards.
+ * @return true on success, false if the eventfd could not be created.
+ */
+bool wake_queue_init(WakeQueue *queue);
+
+/**
+ * @brief Frees the nodes still queued and closes the eventfd. Each node must
+ *        be the first member of a malloc'd object. Does nothing if the
+ *        eventfd was never created.
+ */
+void wake_queue_destroy(WakeQueue *queue);
+
+/**
+ * @brief Appends a node and wakes the consumer if needed. Safe to call from any thread.
+ */
+void wake_queue_push(WakeQueue *queue, MpscNode *node);
+
+static inline MpscNode *wake_queue_pop(WakeQueue *queue) {
+    return mpsc_queue_pop(&queue->queue);
+}
@@ -0,0 +1,128 @@
+#include "write_queue.h"
+#include <stdlib.h>
+
+void write_queue_init(WriteQueue *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->head_offset = 0;
+    queue->depth = 0;
+    queue->bytes_pending = 0;
+}
+
+bool write_queue_push(WriteQueue *queue, SharedFrame *frame, uint64_t queued_at) {
+    WriteEntry *entry = malloc(sizeof(WriteEntry));
+    if (entry == NULL) {
+        return false;
+    }
+    entry->next = NULL;
+    entry->frame = shared_frame_retain(frame);
+    entry->queued_at = queued_at;
+
+    if (queue->tail == NULL) {
+        queue->head = entry;
+        queue->head_offset = 0;
+    } else {
+        queue->tail->next = entry;
+    }
+    queue->tail = entry;
+    queue->depth++;
+    queue->bytes_pending += frame->len;
+    return true;
+}
+
+int write_queue_fill_iov(const WriteQueue *queue, struct iovec *iov, int max_iov) {
+    int count = 0;
+    size_t offset = queue->head_offset;
+    for (WriteEntry *entry = queue->head; entry != NULL && count < max_iov; entry = entry->next) {
+        iov[count].iov_base = entry->frame->data + offset;
+        iov[count].iov_len = entry->frame->len - offset;
+        count++;
+        offset = 0;
+    }
+    return count;
+}
+
+size_t write_queue_consume(WriteQueue *queue, size_t bytes, WriteQueueDoneFn done, void *context) {
+    size_t completed = 0;
+    while (bytes > 0 && queue->head != NULL) {
+        const size_t remaining = queue->head->frame->len - queue->head_offset;
+        if (bytes < remaining) {
+            queue->head_offset += bytes;
+            queue->bytes_pending -= bytes;
+            break;
+        }
+        bytes -= remaining;
+        if (done != NULL) {
+            done(context, queue->head->frame, queue->head->queued_at);
+        }
+        shared_frame_release(write_queue_detach_head(queue));
+        completed++;
+    }
+    return completed;
+}
+
+SharedFrame *write_queue_detach_head(WriteQueue *queue) {
+    WriteEntry *entry = queue->head;
+    if (entry == NULL) {
+        return NULL;
+    }
+    SharedFrame *frame = entry->frame;
+    queue->bytes_pending -= frame->len - queue->head_offset;
+    queue->head = entry->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    queue->head_offset = 0;
+    queue->depth--;
+    free(entry);
+    return frame;
+}
+
+size_t write_queue_drop(WriteQueue *queue, uint32_t tag_mask, size_t bytes_wanted, size_t keep_frames) {
+    WriteEntry *prev = NULL;
+    WriteEntry **link = &queue->head;
+
+    // Dropping a partially written head would desync the stream
+    if (keep_frames == 0 && queue->head_offset > 0) {
+        keep_frames = 1;
+    }
+    while (keep_frames > 0 && *link != NULL) {
+        prev = *link;
+        link = &prev->next;
+        keep_frames--;
+    }
+
+    size_t freed = 0;
+    size_t dropped = 0;
+    while (*link != NULL && freed < bytes_wanted) {
+        WriteEntry *entry = *link;
+        if ((tag_mask & (1u << entry->frame->tag)) == 0) {
+            prev = entry;
+            link = &entry->next;
+            continue;
+        }
+
+        *link = entry->next;
+        if (queue->tail == entry) {
+            queue->tail = prev;
+        }
+        freed += entry->frame->len;
+        queue->bytes_pending -= entry->frame->len;
+        queue->depth--;
+        dropped++;
+        shared_frame_release(entry->frame);
+        free(entry);
+    }
+    return dropped;
+}
+
+void write_queue_clear(WriteQueue *queue) {
+    WriteEntry *entry = queue->head;
+    while (entry != NULL) {
+        WriteEntry *next = entry->next;
+        shared_frame_release(entry->frame);
+        free(entry);
+        entry = next;
+    }
+    write_queue_init(queue);
+}
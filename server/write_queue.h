@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "shared_frame.h"
+
+/**
+ * Per-client outbound queue of encoded frames.
+ *
+ * Each entry references a SharedFrame, so a broadcast costs one small entry per
+ * recipient rather than one copy, and each entry maps onto exactly one iovec.
+ * Frames are consumed from the front as the socket accepts bytes, so a short
+ * write leaves the remainder queued instead of truncating the frame. The frame
+ * tag lets whole frames be selectively dropped when a reader falls behind.
+ */
+typedef struct WriteEntry {
+    struct WriteEntry *next;
+    SharedFrame *frame;    // One reference held by this entry
+    uint64_t queued_at;    // Caller's clock when the frame was pushed
+} WriteEntry;
+
+typedef struct {
+    WriteEntry *head;
+    WriteEntry *tail;
+    size_t head_offset;    // Bytes of head already written
+    size_t depth;          // Frames queued (including a partially written head)
+    size_t bytes_pending;  // Unwritten bytes across all queued frames
+} WriteQueue;
+
+/**
+ * Called by write_queue_consume for every frame it completes, before the
+ * entry's reference is released.
+ */
+typedef void (*WriteQueueDoneFn)(void *context, const SharedFrame *frame, uint64_t queued_at);
+
+/**
+ * @brief Initializes an empty queue.
+ */
+void write_queue_init(WriteQueue *queue);
+
+/**
+ * @brief Appends a frame, taking a new reference to it.
+ * @param queue The queue.
+ * @param frame The frame to append.
+ * @param queued_at Time handed back to the WriteQueueDoneFn once the frame is written.
+ * @return true on success, false if allocation failed.
+ */
+bool write_queue_push(WriteQueue *queue, SharedFrame *frame, uint64_t queued_at);
+
+/**
+ * @brief Fills `iov` with the unwritten bytes from the front of the queue.
+ * @param queue The queue.
+ * @param iov Output iovec array.
+ * @param max_iov Capacity of `iov`.
+ * @return Number of iovec entries filled.
+ */
+int write_queue_fill_iov(const WriteQueue *queue, struct iovec *iov, int max_iov);
+
+/**
+ * @brief Marks `bytes` as written, releasing every frame that is now complete.
+ * @param done Called for each completed frame; may be NULL.
+ * @param context Passed to `done`.
+ * @return Number of frames completed.
+ */
+size_t write_queue_consume(WriteQueue *queue, size_t bytes, WriteQueueDoneFn done, void *context);
+
+/**
+ * @brief Unlinks the head entry and returns its frame; the entry's reference
+ *        passes to the caller.
+ */
+SharedFrame *write_queue_detach_head(WriteQueue *queue);
+
+/**
+ * @brief Drops whole frames whose tag is in `tag_mask`, oldest first, until at
+ *        least `bytes_wanted` bytes have been freed. A partially written head is
+ *        never dropped.
+ * @param queue The queue.
+ * @param tag_mask Bit (1 << tag) set for every droppable tag.
+ * @param bytes_wanted Stop once this many bytes are freed (SIZE_MAX drops all matches).
+ * @param keep_frames Number of frames at the front to keep regardless (e.g. they
+ *        are referenced by an in-flight send).
+ * @return Number of frames dropped.
+ */
+size_t write_queue_drop(WriteQueue *queue, uint32_t tag_mask, size_t bytes_wanted, size_t keep_frames);
+
+/**
+ * @brief Releases every queued frame.
+ */
+void write_queue_clear(WriteQueue *queue);
+
+static inline bool write_queue_empty(const WriteQueue *queue) {
+    return queue->head == NULL;
+}
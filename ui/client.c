@@ -105,45 +105,101 @@ static bool is_dm_message(const char *room_field, const char *my_username) {
             strcmp(room_field, "random") != 0 && strcmp(room_field, "help") != 0);
 }
 
+// Terminated copy of a received string, truncated to the buffer
+static void copy_view(char *out, size_t capacity, StringView view) {
+    const size_t len = view.len < capacity ? view.len : capacity - 1;
+    memcpy(out, view.data, len);
+    out[len] = '\0';
+}
+
+// Appends a line to a room's history
+static void add_room_line(ChatRoom *room, const char *prefix, StringView text) {
+    if (room->message_count < 100) {
+        snprintf(room->messages[room->message_count], 256, "%s%.*s", prefix, (int)text.len, text.data);
+        get_current_time(room->timestamps[room->message_count], 8);
+        room->message_count++;
+    }
+}
+
+// Deltas may repeat what the last full list already reflects, so both
+// directions are idempotent
+static void apply_presence(ChatState *state, ListView *presence) {
+    uint8_t action;
+    StringView name;
+    while (protocol_list_next_presence(presence, &action, &name)) {
+        char username[MAX_USERNAME_LEN];
+        copy_view(username, sizeof(username), name);
+
+        int index = -1;
+        for (int i = 0; i < state->online_user_count; i++) {
+            if (strcmp(state->online_users[i], username) == 0) {
+                index = i;
+                break;
+            }
+        }
+
+        if (action == PRESENCE_JOIN) {
+            if (index < 0 && state->online_user_count < 50) {
+                memcpy(state->online_users[state->online_user_count], username, sizeof(username));
+                state->online_user_count++;
+            }
+        } else if (index >= 0) {
+            memmove(state->online_users[index], state->online_users[index + 1],
+                    (size_t)(state->online_user_count - index - 1) * MAX_USERNAME_LEN);
+            state->online_user_count--;
+        }
+    }
+}
+
 static void handle_incoming_messages(SimpleClient *client, ChatState *state) {
     if (client == NULL || !client->connected) {
         return;
     }
 
-    ParsedMessage msg;
+    // Fields point into the receive buffer; only names used as keys are copied
+    MessageView msg;
     if (check_for_messages(client, &msg)) {
-        switch (msg.type) {
+        switch (msg.header.type) {
             case MSG_TYPE_CHAT: {
+                char sender[MAX_USERNAME_LEN];
+                char room[MAX_ROOMNAME_LEN];
+                copy_view(sender, sizeof(sender), msg.chat.username);
+                copy_view(room, sizeof(room), msg.chat.room);
+                // Receipts for every message would send the server one frame
+                // per member for each chat in a large room; a sample is enough
+                // for the latency percentiles
+                if (GetRandomValue(0, RECEIPT_SAMPLE_RATE - 1) == 0) {
+                    send_receipt(client, msg.header.timestamp, room);
+                }
+
                 // Check if this is a DM (room field contains username)
-                bool is_dm = is_dm_message(msg.chat.room, client->username);
+                bool is_dm = is_dm_message(room, client->username);
 
                 ChatRoom *target_room;
                 if (is_dm) {
                     // For DM, create/find room with the OTHER person's username
-                    const char *dm_partner = (strcmp(msg.chat.username, client->username) == 0)
-                                           ? msg.chat.room  // I sent it, partner is in "room" field
-                                           : msg.chat.username;  // They sent it, partner is username
+                    const char *dm_partner = (strcmp(sender, client->username) == 0)
+                                           ? room    // I sent it, partner is in "room" field
+                                           : sender; // They sent it, partner is username
                     target_room = find_or_create_room(state, dm_partner, CHAT_TYPE_DM);
                 } else {
                     // Regular room message
-                    target_room = find_or_create_room(state, msg.chat.room, CHAT_TYPE_ROOM);
+                    target_room = find_or_create_room(state, room, CHAT_TYPE_ROOM);
                 }
 
-                if (target_room->message_count < 100) {
-                    char formatted[256];
-                    snprintf(formatted, 256, "%s: %s", msg.chat.username, msg.chat.message);
-                    strncpy(target_room->messages[target_room->message_count], formatted, 255);
-                    target_room->messages[target_room->message_count][255] = '\0';
-                    get_current_time(target_room->timestamps[target_room->message_count], 8);
-                    target_room->message_count++;
-                }
+                char prefix[MAX_USERNAME_LEN + 2];
+                snprintf(prefix, sizeof(prefix), "%s: ", sender);
+                add_room_line(target_room, prefix, msg.chat.message);
                 break;
             }
 
             case MSG_TYPE_SYSTEM: {
                 // Check if this is a "Joined room:" message to update UI
-                if (strncmp(msg.system.message, "Joined room: ", 13) == 0) {
-                    const char *new_room_name = msg.system.message + 13;
+                const StringView text = msg.text;
+                if (text.len >= 13 && memcmp(text.data, "Joined room: ", 13) == 0) {
+                    char new_room_name[MAX_ROOMNAME_LEN];
+                    copy_view(new_room_name, sizeof(new_room_name),
+                              (StringView){ text.data + 13, text.len - 13 });
 
                     // Find or create this room and switch to it
                     ChatRoom *new_room = find_or_create_room(state, new_room_name, CHAT_TYPE_ROOM);
@@ -159,45 +215,35 @@ static void handle_incoming_messages(SimpleClient *client, ChatState *state) {
                 }
 
                 // System messages go to current room
-                ChatRoom *current_room = &state->rooms[state->active_room_index];
-                if (current_room->message_count < 100) {
-                    char formatted[256];
-                    snprintf(formatted, 256, "[System] %s", msg.system.message);
-                    strncpy(current_room->messages[current_room->message_count], formatted, 255);
-                    current_room->messages[current_room->message_count][255] = '\0';
-                    get_current_time(current_room->timestamps[current_room->message_count], 8);
-                    current_room->message_count++;
-                }
+                add_room_line(&state->rooms[state->active_room_index], "[System] ", text);
                 break;
             }
 
-            case MSG_TYPE_ERROR: {
+            case MSG_TYPE_ERROR:
                 // Error messages go to current room
-                ChatRoom *current_room = &state->rooms[state->active_room_index];
-                if (current_room->message_count < 100) {
-                    char formatted[256];
-                    snprintf(formatted, 256, "[Error] %s", msg.error.error);
-                    strncpy(current_room->messages[current_room->message_count], formatted, 255);
-                    current_room->messages[current_room->message_count][255] = '\0';
-                    get_current_time(current_room->timestamps[current_room->message_count], 8);
-                    current_room->message_count++;
-                }
+                add_room_line(&state->rooms[state->active_room_index], "[Error] ", msg.text);
                 break;
-            }
 
             case MSG_TYPE_USERLIST: {
+                StringView name;
                 state->online_user_count = 0;
-                for (int i = 0; i < msg.userlist.count && i < 50; i++) {
-                    strncpy(state->online_users[state->online_user_count],
-                           msg.userlist.usernames[i], MAX_USERNAME_LEN - 1);
-                    state->online_users[state->online_user_count][MAX_USERNAME_LEN - 1] = '\0';
+                while (state->online_user_count < 50 && protocol_list_next_user(&msg.list, &name)) {
+                    copy_view(state->online_users[state->online_user_count], MAX_USERNAME_LEN, name);
                     state->online_user_count++;
                 }
                 break;
             }
 
+            case MSG_TYPE_PRESENCE:
+                apply_presence(state, &msg.list);
+                break;
+
+            case MSG_TYPE_PING:
+                send_pong(client);
+                break;
+
             default:
-                printf("WARNING: Unhandled message type 0x%02x\n", msg.type);
+                printf("WARNING: Unhandled message type 0x%02x\n", msg.header.type);
                 break;
         }
     }
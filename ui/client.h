@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "../common/protocol.h"
+#include "../common/ring_buffer.h"
 
 // UI Constants
 #define SIDEBAR_WIDTH 240
@@ -12,6 +13,9 @@
 #define INPUT_HEIGHT 70
 #define BUTTON_HEIGHT 32
 
+// One chat message in this many gets a delivery receipt
+#define RECEIPT_SAMPLE_RATE 32
+
 // Discord-like Colors
 #define SIDEBAR_BG (Color){47, 49, 54, 255}
 #define HEADER_BG (Color){54, 57, 63, 255}
@@ -45,8 +49,10 @@ typedef struct {
     int socket_fd;
     bool connected;
     char username[64];
-    uint8_t recv_buffer[MAX_MESSAGE_SIZE];
-    size_t buffer_pos;
+    RingBuffer recv_ring;                    // Received bytes not yet parsed
+    uint8_t recv_storage[RECV_BUFFER_SIZE];  // Backing memory for recv_ring
+    size_t pending_consume;                  // Frame the last view points into, dropped on the next check
+    uint8_t frame_scratch[MAX_MESSAGE_SIZE]; // Holds a frame that wraps the end of recv_ring
 } SimpleClient;
 
 typedef struct {
@@ -64,7 +70,9 @@ SimpleClient* create_client(void);
 bool connect_to_server(SimpleClient *client, const char *ip, int port);
 bool send_chat_message(SimpleClient *client, const char *room, const char *message);
 bool send_command(SimpleClient *client, const char *command);
-bool check_for_messages(SimpleClient *client, ParsedMessage *msg_out);
+bool send_receipt(SimpleClient *client, uint64_t sent_at, const char *room);
+bool send_pong(SimpleClient *client);
+bool check_for_messages(SimpleClient *client, MessageView *view_out);
 void disconnect_client(SimpleClient *client);
 
 // Utility functions
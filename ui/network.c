@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -17,8 +18,8 @@ SimpleClient* create_client(void) {
     client->socket_fd = -1;
     client->connected = false;
     client->username[0] = '\0';
-    client->recv_buffer[0] = '\0';
-    client->buffer_pos = 0;
+    ring_buffer_init(&client->recv_ring, client->recv_storage, RECV_BUFFER_SIZE);
+    client->pending_consume = 0;
     return client;
 }
 
@@ -52,18 +53,19 @@ bool connect_to_server(SimpleClient *client, const char *ip, int port) {
 }
 
 bool send_chat_message(SimpleClient *client, const char *room, const char *message) {
-    if (client == NULL || !client->connected) {
+    if (client == NULL || !client->connected || room == NULL || message == NULL) {
         return false;
     }
 
-    uint8_t buffer[MAX_MESSAGE_SIZE];
-    int len = protocol_create_chat_message(buffer, client->username, room, message);
-    if (len < 0) {
+    // The header is built in place and the message text is written from where it is
+    MessageBuilder builder;
+    if (!protocol_build_chat(&builder, PROTOCOL_VERSION, protocol_string_view(client->username),
+                             protocol_string_view(room), protocol_string_view(message))) {
         printf("Failed to create chat message\n");
         return false;
     }
 
-    ssize_t sent = send(client->socket_fd, buffer, len, 0);
+    ssize_t sent = writev(client->socket_fd, builder.iov, builder.iov_count);
     if (sent < 0) {
         printf("Failed to send chat message\n");
         client->connected = false;
@@ -74,18 +76,17 @@ bool send_chat_message(SimpleClient *client, const char *room, const char *messa
 }
 
 bool send_command(SimpleClient *client, const char *command) {
-    if (client == NULL || !client->connected) {
+    if (client == NULL || !client->connected || command == NULL) {
         return false;
     }
 
-    uint8_t buffer[MAX_MESSAGE_SIZE];
-    int len = protocol_create_command_message(buffer, command);
-    if (len < 0) {
+    MessageBuilder builder;
+    if (!protocol_build_text(&builder, PROTOCOL_VERSION, MSG_TYPE_COMMAND, protocol_string_view(command))) {
         printf("Failed to create command message\n");
         return false;
     }
 
-    ssize_t sent = send(client->socket_fd, buffer, len, 0);
+    ssize_t sent = writev(client->socket_fd, builder.iov, builder.iov_count);
     if (sent < 0) {
         printf("Failed to send command\n");
         client->connected = false;
@@ -94,79 +95,118 @@ bool send_command(SimpleClient *client, const char *command) {
     return true;
 }
 
-bool check_for_messages(SimpleClient *client, ParsedMessage *msg_out) {
-    if (client == NULL || !client->connected || msg_out == NULL) {
+// Tells the server when a chat message stamped `sent_at` arrived, for its latency histograms
+bool send_receipt(SimpleClient *client, uint64_t sent_at, const char *room) {
+    if (client == NULL || !client->connected || room == NULL) {
         return false;
     }
 
-    uint8_t temp_buffer[MAX_MESSAGE_SIZE];
-    ssize_t bytes = recv(client->socket_fd, temp_buffer, sizeof(temp_buffer), 0);
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    int len = protocol_create_receipt_message(buffer, PROTOCOL_VERSION, sent_at, protocol_get_timestamp(), room);
+    if (len < 0) {
+        return false;
+    }
 
-    if (bytes < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return false;
-        }
-        printf("Connection error\n");
+    ssize_t sent = send(client->socket_fd, buffer, len, 0);
+    if (sent < 0) {
+        printf("Failed to send receipt\n");
         client->connected = false;
         return false;
     }
+    return true;
+}
+
+// Answers the server's keep-alive ping so an idle client is not disconnected
+bool send_pong(SimpleClient *client) {
+    if (client == NULL || !client->connected) {
+        return false;
+    }
+
+    uint8_t buffer[sizeof(MessageHeader)];
+    int len = protocol_create_keepalive_message(buffer, PROTOCOL_VERSION, MSG_TYPE_PONG);
+    if (len < 0) {
+        return false;
+    }
 
-    if (bytes == 0) {
-        printf("Server disconnected\n");
+    ssize_t sent = send(client->socket_fd, buffer, len, 0);
+    if (sent < 0) {
+        printf("Failed to send pong\n");
         client->connected = false;
         return false;
     }
+    return true;
+}
 
-    // Accumulate bytes in client buffer
-    if (client->buffer_pos + bytes > MAX_MESSAGE_SIZE) {
-        printf("ERROR: Buffer overflow! buffer_pos=%lu + bytes=%zd > MAX=%lu\n",
-               client->buffer_pos, bytes, MAX_MESSAGE_SIZE);
-        client->buffer_pos = 0;
+bool check_for_messages(SimpleClient *client, MessageView *view_out) {
+    if (client == NULL || !client->connected || view_out == NULL) {
         return false;
     }
 
-    memcpy(client->recv_buffer + client->buffer_pos, temp_buffer, bytes);
-    client->buffer_pos += bytes;
+    RingBuffer *ring = &client->recv_ring;
+
+    // The previous view is no longer in use; release its frame
+    ring_buffer_consume(ring, client->pending_consume);
+    client->pending_consume = 0;
+
+    // Read straight into the ring's free space (two regions when it wraps)
+    struct iovec iov[2];
+    int regions = ring_buffer_write_regions(ring, iov);
+    if (regions > 0) {
+        ssize_t bytes = readv(client->socket_fd, iov, regions);
+
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("Connection error\n");
+                client->connected = false;
+                return false;
+            }
+            // Nothing new, but frames may already be buffered
+        } else if (bytes == 0) {
+            printf("Server disconnected\n");
+            client->connected = false;
+            return false;
+        } else {
+            ring_buffer_commit(ring, (size_t)bytes);
+        }
+    }
 
     // Try to parse a complete message
-    if (client->buffer_pos < sizeof(MessageHeader)) {
+    if (ring_buffer_used(ring) < sizeof(MessageHeader)) {
         return false; // Not enough data for header yet
     }
 
-    // Parse header
+    // Parse header; only bytes that wrap the end of the ring get copied to scratch
+    uint8_t *scratch = client->frame_scratch;
     MessageHeader header;
-    if (!protocol_parse_header(client->recv_buffer, client->buffer_pos, &header)) {
+    if (!protocol_parse_header(ring_buffer_peek(ring, sizeof(MessageHeader), scratch),
+                               sizeof(MessageHeader), &header)) {
         printf("ERROR: Invalid protocol header\n");
-        client->buffer_pos = 0;
+        ring_buffer_consume(ring, ring_buffer_used(ring));
         return false;
     }
 
     // Check if we have complete message
     size_t total_msg_size = sizeof(MessageHeader) + header.content_len;
-
-    if (client->buffer_pos < total_msg_size) {
+    if (total_msg_size > MAX_MESSAGE_SIZE) {
+        printf("ERROR: Message too large (%zu bytes)\n", total_msg_size);
+        ring_buffer_consume(ring, ring_buffer_used(ring));
         return false;
     }
 
-    // Parse message based on type
-    msg_out->type = header.type;
-    bool success = false;
-
-    success = protocol_get_parsed_message(client->recv_buffer, total_msg_size, msg_out, &header);
+    if (ring_buffer_used(ring) < total_msg_size) {
+        return false;
+    }
 
-    if (success) {
-        // Remove processed message from buffer
-        size_t remaining = client->buffer_pos - total_msg_size;
-        if (remaining > 0) {
-            memmove(client->recv_buffer, client->recv_buffer + total_msg_size, remaining);
-        }
-        client->buffer_pos = remaining;
-    } else {
+    // Validate in place; the view stays valid until the next call
+    if (!protocol_view_message(ring_buffer_peek(ring, total_msg_size, scratch), total_msg_size, view_out)) {
         // Failed to parse, clear buffer
-        client->buffer_pos = 0;
+        printf("ERROR: Malformed %s message\n", protocol_get_type_name(header.type));
+        ring_buffer_consume(ring, ring_buffer_used(ring));
+        return false;
     }
 
-    return success;
+    client->pending_consume = total_msg_size;
+    return true;
 }
 
 void disconnect_client(SimpleClient *client) {